@@ -162,6 +162,10 @@ SOURCE=..\..\src\files9x.h
 # PROP Default_Filter ""
 # Begin Source File
 
+SOURCE=..\..\src\async.c
+# End Source File
+# Begin Source File
+
 SOURCE=..\..\src\comments.c
 # End Source File
 # Begin Source File
@@ -278,6 +282,10 @@ SOURCE="c:\lpg\gtk\lib\glib-2.0.lib"
 # End Source File
 # Begin Source File
 
+SOURCE="c:\lpg\gtk\lib\gthread-2.0.lib"
+# End Source File
+# Begin Source File
+
 SOURCE=c:\lpg\gtk\lib\z.lib
 # End Source File
 # End Group
@@ -0,0 +1,692 @@
+/* Hey EMACS -*- linux-c -*- */
+/* $Id$ */
+
+/*  libtifiles - file format library, a part of the TiLP project
+ *  Copyright (C) 1999-2005  Romain Lievin
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+  Asynchronous reading/writing of files.
+
+  Operations are run by a pool of worker threads. A file is read into memory
+  (or written from memory) block by block so that progress can be reported
+  and the operation cancelled between blocks. It is parsed from (or built
+  into) memory with the stream readers/writers (tifiles_fread_* and
+  tifiles_fwrite_*).
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tifiles.h"
+#include "async.h"
+#include "error.h"
+#include "logging.h"
+#include "rwfile.h"
+
+#define ASYNC_BLOCK	65536		// bytes read or written between progress reports
+
+enum
+{
+	ASYNC_READ_REGULAR, ASYNC_WRITE_REGULAR,
+	ASYNC_READ_BACKUP, ASYNC_WRITE_BACKUP,
+	ASYNC_READ_FLASH, ASYNC_WRITE_FLASH
+};
+
+// pool of worker threads, created on first use
+static GThreadPool *async_pool = NULL;
+static GMutex async_pool_mutex;	// static: no initialization needed
+
+static void async_unref(FileAsync *op)
+{
+	if(!g_atomic_int_dec_and_test(&op->ref_count))
+		return;
+
+	g_mutex_clear((GMutex *)op->mutex);
+	g_cond_clear((GCond *)op->cond);
+	g_free(op->mutex);
+	g_free(op->cond);
+	g_free(op->filename);
+	g_free(op);
+}
+
+/*******************/
+/* Progress & done */
+/*******************/
+
+static gboolean async_progress_dispatch(gpointer data)
+{
+	FileAsync *op = (FileAsync *)data;
+	uint64_t done, total;
+
+	g_mutex_lock((GMutex *)op->mutex);
+	op->pending = 0;
+	done = op->done;
+	total = op->total;
+	g_mutex_unlock((GMutex *)op->mutex);
+
+	op->callbacks.progress(op, done, total, op->callbacks.user_data);
+
+	return FALSE;
+}
+
+/*
+  Record the number of bytes done and notify the progress callback. With a
+  context, at most one notification is pending at a time: it reports the
+  latest values when dispatched.
+*/
+static void async_progress(FileAsync *op, uint64_t done)
+{
+	int notify;
+
+	g_mutex_lock((GMutex *)op->mutex);
+	op->done = done;
+	notify = (op->callbacks.progress != NULL) && !op->pending;
+	if(notify && op->callbacks.context != NULL)
+		op->pending = 1;
+	g_mutex_unlock((GMutex *)op->mutex);
+
+	if(!notify)
+		return;
+
+	if(op->callbacks.context == NULL)
+		op->callbacks.progress(op, done, op->total, op->callbacks.user_data);
+	else
+	{
+		GSource *source = g_idle_source_new();
+
+		g_atomic_int_inc(&op->ref_count);
+		g_source_set_callback(source, async_progress_dispatch, op, (GDestroyNotify)async_unref);
+		g_source_attach(source, (GMainContext *)op->callbacks.context);
+		g_source_unref(source);
+	}
+}
+
+static gboolean async_done_dispatch(gpointer data)
+{
+	FileAsync *op = (FileAsync *)data;
+
+	if(op->callbacks.done != NULL)
+		op->callbacks.done(op, op->err, op->callbacks.user_data);
+
+	g_mutex_lock((GMutex *)op->mutex);
+	op->completed = 1;
+	g_cond_broadcast((GCond *)op->cond);
+	g_mutex_unlock((GMutex *)op->mutex);
+
+	return FALSE;
+}
+
+/*
+  Call the done callback, from the context if any. The reference held by
+  the worker is released once the callback has returned.
+*/
+static void async_done(FileAsync *op)
+{
+	if(op->callbacks.context == NULL)
+	{
+		async_done_dispatch(op);
+		async_unref(op);
+	}
+	else
+	{
+		GSource *source = g_idle_source_new();
+
+		// after pending progress notifications
+		g_source_set_priority(source, G_PRIORITY_LOW);
+		g_source_set_callback(source, async_done_dispatch, op, (GDestroyNotify)async_unref);
+		g_source_attach(source, (GMainContext *)op->callbacks.context);
+		g_source_unref(source);
+	}
+}
+
+/*************/
+/* Block I/O */
+/*************/
+
+/*
+  Load a whole file into memory block by block.
+  - data [out]: the data, to be freed with g_free
+  - len [out]: size of data
+  - [out]: an error code, 0 otherwise.
+*/
+static int async_load(FileAsync *op, uint8_t **data, size_t *len)
+{
+	FILE *f;
+	foff_t size;
+	size_t n, block;
+	int ret = 0;
+
+	*data = NULL;
+	*len = 0;
+
+	f = g_fopen(op->filename, "rb");
+	if (f == NULL)
+	{
+		tifiles_info("Unable to open this file: %s", op->filename);
+		return ERR_FILE_OPEN;
+	}
+
+	size = fsize(f);
+	if (size <= 0 || (uint64_t)size > (size_t)-1)
+	{
+		fclose(f);
+		return ERR_INVALID_FILE;
+	}
+
+	g_mutex_lock((GMutex *)op->mutex);
+	op->total = size;
+	g_mutex_unlock((GMutex *)op->mutex);
+
+	*data = (uint8_t *)g_malloc((size_t)size);
+	if (*data == NULL)
+	{
+		fclose(f);
+		return ERR_MALLOC;
+	}
+
+	for(n = 0; n < (size_t)size; n += block)
+	{
+		if (g_atomic_int_get(&op->cancelled))
+		{
+			ret = ERR_CANCELLED;
+			break;
+		}
+
+		block = MIN(ASYNC_BLOCK, (size_t)size - n);
+		if (fread(*data + n, 1, block, f) < block)
+		{
+			ret = ERR_FILE_IO;
+			break;
+		}
+		async_progress(op, n + block);
+	}
+	fclose(f);
+
+	if (ret)
+	{
+		g_free(*data);
+		*data = NULL;
+		return ret;
+	}
+
+	*len = (size_t)size;
+	return 0;
+}
+
+/*
+  Write a file from memory block by block. The file is written atomically:
+  it is left untouched on error or cancellation.
+  - data, len [in]: the data and its size
+  - [out]: an error code, 0 otherwise.
+*/
+static int async_store(FileAsync *op, const uint8_t *data, size_t len)
+{
+	FILE *f;
+	char *tmpname;
+	size_t n, block;
+	int ret = 0;
+
+	f = fopen_atomic(op->filename, &tmpname);
+	if (f == NULL)
+	{
+		tifiles_info("Unable to open this file: %s", op->filename);
+		return ERR_FILE_OPEN;
+	}
+
+	g_mutex_lock((GMutex *)op->mutex);
+	op->total = len;
+	g_mutex_unlock((GMutex *)op->mutex);
+
+	for(n = 0; n < len; n += block)
+	{
+		if (g_atomic_int_get(&op->cancelled))
+		{
+			ret = ERR_CANCELLED;
+			break;
+		}
+
+		block = MIN(ASYNC_BLOCK, len - n);
+		if (fwrite(data + n, 1, block, f) < block)
+		{
+			ret = ERR_FILE_IO;
+			break;
+		}
+		async_progress(op, n + block);
+	}
+
+	if(fclose_atomic(f, op->filename, tmpname, !ret) && !ret)
+		ret = ERR_FILE_CLOSE;
+
+	return ret;
+}
+
+/*
+  Stop the pool of workers (last call of tifiles_library_exit). Queued
+  operations are run to completion first.
+*/
+void async_exit(void)
+{
+	GThreadPool *pool;
+
+	g_mutex_lock(&async_pool_mutex);
+	pool = async_pool;
+	async_pool = NULL;
+	g_mutex_unlock(&async_pool_mutex);
+
+	if (pool != NULL)
+		g_thread_pool_free(pool, FALSE, TRUE);
+}
+
+/**************/
+/* Operations */
+/**************/
+
+/*
+  Parse a file into a new content (the caller's one is left untouched until
+  the file has been parsed).
+  - f [in]: the file held in memory
+  - content [out]: the new content, which becomes the caller's on success
+  - [out]: an error code, 0 otherwise.
+*/
+static int async_parse(FileAsync *op, FILE *f, void **content)
+{
+	int ret;
+
+	switch(op->type)
+	{
+	case ASYNC_READ_REGULAR:
+		*content = tifiles_content_create_regular(((FileContent *)op->content)->model);
+		if (*content == NULL)
+			return ERR_MALLOC;
+		// variable names are converted to the caller's target model
+		((FileContent *)*content)->model_dst = ((FileContent *)op->content)->model_dst;
+		ret = tifiles_fread_regular(f, op->filename, (FileContent *)*content);
+		if (ret)
+			tifiles_content_delete_regular((FileContent *)*content);
+		break;
+	case ASYNC_READ_BACKUP:
+		*content = tifiles_content_create_backup(((BackupContent *)op->content)->model);
+		if (*content == NULL)
+			return ERR_MALLOC;
+		ret = tifiles_fread_backup(f, op->filename, (BackupContent *)*content);
+		if (ret)
+			tifiles_content_delete_backup((BackupContent *)*content);
+		break;
+	default:
+		*content = tifiles_content_create_flash(((FlashContent *)op->content)->model);
+		if (*content == NULL)
+			return ERR_MALLOC;
+		ret = tifiles_fread_flash(f, op->filename, (FlashContent *)*content);
+		if (ret)
+			tifiles_content_delete_flash((FlashContent *)*content);
+		break;
+	}
+
+	return ret;
+}
+
+static int async_read(FileAsync *op)
+{
+	uint8_t *data;
+	size_t len;
+	FILE *f;
+	void *content;
+	int ret;
+
+	switch(op->type)
+	{
+	case ASYNC_READ_REGULAR: ret = !tifiles_file_is_regular(op->filename); break;
+	case ASYNC_READ_BACKUP: ret = !tifiles_file_is_backup(op->filename); break;
+	default: ret = !tifiles_file_is_flash(op->filename) && !tifiles_file_is_tib(op->filename); break;
+	}
+	if (ret)
+		return ERR_INVALID_FILE;
+
+	ret = async_load(op, &data, &len);
+	if (ret)
+		return ret;
+
+	f = fopen_buffer(data, len);
+	if (f == NULL)
+	{
+		g_free(data);
+		return ERR_FILE_IO;
+	}
+
+	ret = async_parse(op, f, &content);
+	fclose(f);
+	g_free(data);
+	if (ret)
+		return ret;
+
+	// the structure is moved into the caller's one
+	switch(op->type)
+	{
+	case ASYNC_READ_REGULAR: memcpy(op->content, content, sizeof(FileContent)); break;
+	case ASYNC_READ_BACKUP: memcpy(op->content, content, sizeof(BackupContent)); break;
+	default: memcpy(op->content, content, sizeof(FlashContent)); break;
+	}
+	g_free(content);
+
+	return 0;
+}
+
+static int async_write(FileAsync *op)
+{
+	uint8_t *data;
+	size_t len;
+	FILE *f;
+	int ret;
+
+	f = fopen_memstream(&data, &len);
+	if (f == NULL)
+		return ERR_FILE_IO;
+
+	switch(op->type)
+	{
+	case ASYNC_WRITE_REGULAR:
+		ret = tifiles_fwrite_regular(f, (FileContent *)op->content);
+		break;
+	case ASYNC_WRITE_BACKUP:
+		ret = tifiles_fwrite_backup(f, (BackupContent *)op->content);
+		break;
+	default:
+		ret = tifiles_fwrite_flash(f, (FlashContent *)op->content);
+		break;
+	}
+
+	if (fclose_memstream(f, &data, &len) && !ret)
+		ret = ERR_FILE_IO;
+	if (!ret)
+		ret = async_store(op, data, len);
+	free(data);
+
+	return ret;
+}
+
+static void async_worker(gpointer data, gpointer user_data)
+{
+	FileAsync *op = (FileAsync *)data;
+
+	if (g_atomic_int_get(&op->cancelled))
+		op->err = ERR_CANCELLED;
+	else if (op->type == ASYNC_READ_REGULAR || op->type == ASYNC_READ_BACKUP || op->type == ASYNC_READ_FLASH)
+		op->err = async_read(op);
+	else
+		op->err = async_write(op);
+
+	async_done(op);
+}
+
+/*
+  Create an operation and queue it to the pool of workers.
+  - [out]: an error code, 0 otherwise.
+*/
+static int async_start(int type, const char *filename, void *content, AsyncCallbacks *callbacks, FileAsync **op)
+{
+	FileAsync *fa;
+
+	if (filename == NULL || content == NULL || op == NULL)
+	{
+		tifiles_critical("tifiles_file_*_async(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+	*op = NULL;
+
+	g_mutex_lock(&async_pool_mutex);
+	if (async_pool == NULL)
+		async_pool = g_thread_pool_new(async_worker, NULL, cpu_count(), FALSE, NULL);
+	g_mutex_unlock(&async_pool_mutex);
+	if (async_pool == NULL)
+		return ERR_UNSUPPORTED;
+
+	fa = g_malloc0(sizeof(FileAsync));
+	if (fa == NULL)
+		return ERR_MALLOC;
+
+	fa->filename = g_strdup(filename);
+	fa->content = content;
+	fa->type = type;
+	if (callbacks != NULL)
+		fa->callbacks = *callbacks;
+	fa->ref_count = 2;		// caller and worker
+	fa->mutex = g_new(GMutex, 1);
+	fa->cond = g_new(GCond, 1);
+	g_mutex_init((GMutex *)fa->mutex);
+	g_cond_init((GCond *)fa->cond);
+
+	*op = fa;
+	g_thread_pool_push(async_pool, fa, NULL);
+
+	return 0;
+}
+
+/**
+ * tifiles_file_read_regular_async:
+ * @filename: name of single/group file to open.
+ * @content: where to store the file content.
+ * @callbacks: callbacks to call (may be NULL).
+ * @op: address of a pointer where to store the operation.
+ *
+ * Same as #tifiles_file_read_regular but the file is read by a worker
+ * thread and this function returns at once. @content must not be used until
+ * the operation has completed. @content always belongs to the caller: it is
+ * filled only if the file has been read and left untouched otherwise (error
+ * or cancellation), and must be freed with #tifiles_content_delete_regular
+ * in any case.
+ *
+ * When the operation has completed, failed or been cancelled, the done
+ * callback is called with the error code (ERR_CANCELLED if cancelled). If a
+ * GMainContext is given, callbacks are called from this context (the
+ * progress callback being coalesced), otherwise from the worker thread.
+ *
+ * The operation must be freed with #tifiles_async_free once completed
+ * (from the done callback or after #tifiles_async_wait).
+ *
+ * Return value: an error code if the operation could not be started, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_read_regular_async(const char *filename, FileContent *content, AsyncCallbacks *callbacks, FileAsync **op)
+{
+	return async_start(ASYNC_READ_REGULAR, filename, content, callbacks, op);
+}
+
+/**
+ * tifiles_file_write_regular_async:
+ * @filename: name of single/group file where to write.
+ * @content: the file content to write.
+ * @callbacks: callbacks to call (may be NULL).
+ * @op: address of a pointer where to store the operation.
+ *
+ * Same as #tifiles_file_write_regular but the file is written by a worker
+ * thread (see #tifiles_file_read_regular_async). The file is left untouched
+ * if the operation fails or is cancelled.
+ *
+ * Return value: an error code if the operation could not be started, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_write_regular_async(const char *filename, FileContent *content, AsyncCallbacks *callbacks, FileAsync **op)
+{
+	return async_start(ASYNC_WRITE_REGULAR, filename, content, callbacks, op);
+}
+
+/**
+ * tifiles_file_read_backup_async:
+ * @filename: name of backup file to open.
+ * @content: where to store the file content.
+ * @callbacks: callbacks to call (may be NULL).
+ * @op: address of a pointer where to store the operation.
+ *
+ * Same as #tifiles_file_read_backup but the file is read by a worker thread
+ * (see #tifiles_file_read_regular_async).
+ *
+ * Return value: an error code if the operation could not be started, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_read_backup_async(const char *filename, BackupContent *content, AsyncCallbacks *callbacks, FileAsync **op)
+{
+	return async_start(ASYNC_READ_BACKUP, filename, content, callbacks, op);
+}
+
+/**
+ * tifiles_file_write_backup_async:
+ * @filename: name of backup file where to write.
+ * @content: the file content to write.
+ * @callbacks: callbacks to call (may be NULL).
+ * @op: address of a pointer where to store the operation.
+ *
+ * Same as #tifiles_file_write_backup but the file is written by a worker
+ * thread (see #tifiles_file_write_regular_async).
+ *
+ * Return value: an error code if the operation could not be started, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_write_backup_async(const char *filename, BackupContent *content, AsyncCallbacks *callbacks, FileAsync **op)
+{
+	return async_start(ASYNC_WRITE_BACKUP, filename, content, callbacks, op);
+}
+
+/**
+ * tifiles_file_read_flash_async:
+ * @filename: name of FLASH file to open.
+ * @content: where to store the file content.
+ * @callbacks: callbacks to call (may be NULL).
+ * @op: address of a pointer where to store the operation.
+ *
+ * Same as #tifiles_file_read_flash but the file is read by a worker thread
+ * (see #tifiles_file_read_regular_async).
+ *
+ * Return value: an error code if the operation could not be started, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_read_flash_async(const char *filename, FlashContent *content, AsyncCallbacks *callbacks, FileAsync **op)
+{
+	return async_start(ASYNC_READ_FLASH, filename, content, callbacks, op);
+}
+
+/**
+ * tifiles_file_write_flash_async:
+ * @filename: name of FLASH file where to write.
+ * @content: the file content to write.
+ * @callbacks: callbacks to call (may be NULL).
+ * @op: address of a pointer where to store the operation.
+ *
+ * Same as #tifiles_file_write_flash but the file is written by a worker
+ * thread (see #tifiles_file_write_regular_async).
+ *
+ * Return value: an error code if the operation could not be started, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_write_flash_async(const char *filename, FlashContent *content, AsyncCallbacks *callbacks, FileAsync **op)
+{
+	return async_start(ASYNC_WRITE_FLASH, filename, content, callbacks, op);
+}
+
+/**
+ * tifiles_async_cancel:
+ * @op: an operation.
+ *
+ * Request cancellation of an operation. It stops before the next block of
+ * data and completes with ERR_CANCELLED (unless it was about to complete).
+ * May be called from any thread.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_async_cancel(FileAsync *op)
+{
+	if (op == NULL)
+	{
+		tifiles_critical("tifiles_async_cancel(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+
+	g_atomic_int_set(&op->cancelled, 1);
+	return 0;
+}
+
+/**
+ * tifiles_async_get_progress:
+ * @op: an operation.
+ * @done: where to store the number of bytes read or written so far (may be NULL).
+ * @total: where to store the size of file, 0 if not known yet (may be NULL).
+ *
+ * Get the progress of an operation. May be called from any thread.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_async_get_progress(FileAsync *op, uint64_t *done, uint64_t *total)
+{
+	if (op == NULL)
+	{
+		tifiles_critical("tifiles_async_get_progress(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+
+	g_mutex_lock((GMutex *)op->mutex);
+	if (done != NULL)
+		*done = op->done;
+	if (total != NULL)
+		*total = op->total;
+	g_mutex_unlock((GMutex *)op->mutex);
+
+	return 0;
+}
+
+/**
+ * tifiles_async_wait:
+ * @op: an operation.
+ *
+ * Wait for an operation to complete, that is to say until its done callback
+ * has returned. When callbacks are called from a GMainContext, this function
+ * must not be called from the thread which runs this context.
+ *
+ * Return value: the error code of the operation, 0 if successful.
+ **/
+TIEXPORT2 int TICALL tifiles_async_wait(FileAsync *op)
+{
+	if (op == NULL)
+	{
+		tifiles_critical("tifiles_async_wait(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+
+	g_mutex_lock((GMutex *)op->mutex);
+	while(!op->completed)
+		g_cond_wait((GCond *)op->cond, (GMutex *)op->mutex);
+	g_mutex_unlock((GMutex *)op->mutex);
+
+	return op->err;
+}
+
+/**
+ * tifiles_async_free:
+ * @op: an operation.
+ *
+ * Free an operation. It must have completed: call this function from the
+ * done callback or after #tifiles_async_wait. The content is not released.
+ *
+ * Return value: always 0.
+ **/
+TIEXPORT2 int TICALL tifiles_async_free(FileAsync *op)
+{
+	if (op != NULL)
+		async_unref(op);
+
+	return 0;
+}
@@ -30,76 +30,151 @@
 
 #include "tifiles.h"
 
-static char comment[64];	// 40 bytes max
+#define COMMENT_MAX	64	// 40 bytes max (but TiGroup files)
+
+static const char *day_names[7] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char *month_names[12] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", 
+									   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+// buffer of the non-reentrant functions: one per thread
+static GPrivate comment_key = G_PRIVATE_INIT(g_free);
+
+static char* comment_buffer(void)
+{
+	char *buffer = g_private_get(&comment_key);
+
+	if (buffer == NULL)
+	{
+		buffer = g_malloc0(COMMENT_MAX);
+		g_private_set(&comment_key, buffer);
+	}
+
+	return buffer;
+}
+
+/*
+  Format a comment like "<what> file dated <date as asctime>" and truncate it
+  to 'max' chars. The date is built by hand: asctime and localtime share a
+  static buffer.
+*/
+static char* comment_set(char *comment, const char *what, int max)
+{
+	time_t t = time(NULL);
+	struct tm tm;
+
+#ifdef __WIN32__
+	tm = *localtime(&t);	// thread-local storage in the C runtime
+#else
+	localtime_r(&t, &tm);
+#endif
+
+	g_snprintf(comment, max + 1, "%s file dated %.3s %.3s%3d %.2d:%.2d:%.2d %d\n",
+			   what, day_names[tm.tm_wday], month_names[tm.tm_mon], tm.tm_mday,
+			   tm.tm_hour, tm.tm_min, tm.tm_sec, 1900 + tm.tm_year);
+
+	return comment;
+}
 
 /**
  * tifiles_comment_set_single:
  *
  * Returns a string which contains a comment such as "Group file dated 12/31/99, 15:15".
+ * The string is private to the calling thread; see #tifiles_comment_set_single_r.
  *
  * Return value: a static string.
  **/
 TIEXPORT2 const char* TICALL tifiles_comment_set_single(void)
 {
-	time_t t = time(NULL);
-	char *str = asctime(localtime(&t));
-
-	sprintf(comment, "Single file dated %s", str);
-	comment[40] = '\0';
+	return tifiles_comment_set_single_r(comment_buffer());
+}
 
-	return comment;
+/**
+ * tifiles_comment_set_single_r:
+ * @comment: a buffer of 41 bytes at least.
+ *
+ * Reentrant version of #tifiles_comment_set_single.
+ *
+ * Return value: @comment.
+ **/
+TIEXPORT2 char* TICALL tifiles_comment_set_single_r(char *comment)
+{
+	return comment_set(comment, "Single", 40);
 }
 
 /**
  * tifiles_comment_set_group:
  *
  * Returns a string which contains a comment such as "Group file dated 12/31/99, 15:15".
+ * The string is private to the calling thread; see #tifiles_comment_set_group_r.
  *
  * Return value: a static string.
  **/
 TIEXPORT2 const char* TICALL tifiles_comment_set_group(void)
 {
-time_t t = time(NULL);
-	char *str = asctime(localtime(&t));
-
-	sprintf(comment, "Group file dated %s", str);
-	comment[40] = '\0';
+	return tifiles_comment_set_group_r(comment_buffer());
+}
 
-	return comment;
+/**
+ * tifiles_comment_set_group_r:
+ * @comment: a buffer of 41 bytes at least.
+ *
+ * Reentrant version of #tifiles_comment_set_group.
+ *
+ * Return value: @comment.
+ **/
+TIEXPORT2 char* TICALL tifiles_comment_set_group_r(char *comment)
+{
+	return comment_set(comment, "Group", 40);
 }
 
 /**
  * tifiles_comment_set_backup:
  *
  * Returns a string which contains a comment such as "Group file dated 12/31/99, 15:15".
+ * The string is private to the calling thread; see #tifiles_comment_set_backup_r.
  *
  * Return value: a static string.
  **/
 TIEXPORT2 const char* TICALL tifiles_comment_set_backup(void)
 {
-	time_t t = time(NULL);
-	char *str = asctime(localtime(&t));
-
-	sprintf(comment, "Backup file dated %s", str);
-	comment[40] = '\0';
+	return tifiles_comment_set_backup_r(comment_buffer());
+}
 
-	return comment;
+/**
+ * tifiles_comment_set_backup_r:
+ * @comment: a buffer of 41 bytes at least.
+ *
+ * Reentrant version of #tifiles_comment_set_backup.
+ *
+ * Return value: @comment.
+ **/
+TIEXPORT2 char* TICALL tifiles_comment_set_backup_r(char *comment)
+{
+	return comment_set(comment, "Backup", 40);
 }
 
 /**
  * tifiles_comment_set_tigroup:
  *
  * Returns a string which contains a comment such as "TiGroup file dated 12/31/99, 15:15".
+ * The string is private to the calling thread; see #tifiles_comment_set_tigroup_r.
  *
- * Return value: a _dynamically allocated_ .
+ * Return value: a static string.
  **/
 TIEXPORT2 const char* TICALL tifiles_comment_set_tigroup(void)
 {
-	time_t t = time(NULL);
-	char *str = asctime(localtime(&t));
+	return tifiles_comment_set_tigroup_r(comment_buffer());
+}
 
-	sprintf(comment, "TiGroup file dated %s", str);
-	comment[63] = 0;
-	
-	return comment;
+/**
+ * tifiles_comment_set_tigroup_r:
+ * @comment: a buffer of 64 bytes at least.
+ *
+ * Reentrant version of #tifiles_comment_set_tigroup.
+ *
+ * Return value: @comment.
+ **/
+TIEXPORT2 char* TICALL tifiles_comment_set_tigroup_r(char *comment)
+{
+	return comment_set(comment, "TiGroup", COMMENT_MAX - 1);
 }
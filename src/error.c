@@ -129,6 +129,14 @@ TIEXPORT2 int TICALL tifiles_error_get(FileError number, char **message)
 			NULL);
 		break;
 
+	case ERR_CANCELLED:
+		*message = g_strconcat(
+			_("Msg: operation cancelled."),
+			"\n",
+			_("Cause: the operation has been cancelled by the program."),
+			NULL);
+		break;
+
 
 	default:
 		// propagate error code
@@ -47,8 +47,8 @@
 /* Misc */
 /********/
 
-static uint8_t fsignature85[3] = { 0x1A, 0x0C, 0x00 };	//TI85
-static uint8_t fsignature8x[3] = { 0x1A, 0x0A, 0x00 };	//TI73, 82, 83, 86
+static const uint8_t fsignature85[3] = { 0x1A, 0x0C, 0x00 };	//TI85
+static const uint8_t fsignature8x[3] = { 0x1A, 0x0A, 0x00 };	//TI73, 82, 83, 86
 
 
 static int is_ti8586(CalcModel model)
@@ -61,9 +61,42 @@ static int is_ti83p(CalcModel model)
   return ((model == CALC_TI83P) || (model == CALC_TI84P) || (model == CALC_TI84P_USB));
 }
 
+/*
+  Backup data parts seen as a list of segments. In file, each segment is
+  preceded by its length except the third one when empty (TI86).
+*/
+typedef struct
+{
+  uint16_t	length;
+  uint8_t*	data;
+} BackupSegment;
+
+#define SEGMENT_HAS_LENGTH(seg, i)	((i) != 2 || (seg)[i].length != 0)
+
+/*
+  Get the data parts of a backup (4 on TI86, 3 otherwise).
+  - seg [out]: array of 4 segments
+  - [out]: number of segments.
+*/
+static int get_backup_segments(Ti8xBackup *content, BackupSegment *seg)
+{
+  seg[0].length = content->data_length1;
+  seg[0].data = content->data_part1;
+  seg[1].length = content->data_length2;
+  seg[1].data = content->data_part2;
+  seg[2].length = content->data_length3;
+  seg[2].data = content->data_part3;
+  seg[3].length = content->data_length4;
+  seg[3].data = content->data_part4;
+
+  return (content->model == CALC_TI86) ? 4 : 3;
+}
+
 static uint16_t compute_backup_sum(BackupContent* content)
 {
-	uint16_t sum= 0;
+  BackupSegment seg[4];
+  int i, n;
+  uint16_t sum= 0;
 
   sum += 9;
   sum += tifiles_checksum((uint8_t *)&(content->data_length1), 2);
@@ -75,14 +108,12 @@ static uint16_t compute_backup_sum(BackupContent* content)
   else
     sum += tifiles_checksum((uint8_t *)&(content->data_length4), 2);
 
-  sum += tifiles_checksum((uint8_t *)&(content->data_length1), 2);
-  sum += tifiles_checksum(content->data_part1, content->data_length1);
-  sum += tifiles_checksum((uint8_t *)&(content->data_length2), 2);
-  sum += tifiles_checksum(content->data_part2, content->data_length2);
-  sum += tifiles_checksum((uint8_t *)&(content->data_length3), 2);
-  sum += tifiles_checksum(content->data_part3, content->data_length3);
-  sum += tifiles_checksum((uint8_t *)&(content->data_length4), 2);
-  sum += tifiles_checksum(content->data_part4, content->data_length4);
+  n = get_backup_segments(content, seg);
+  for (i = 0; i < n; i++)
+  {
+    sum += tifiles_checksum((uint8_t *)&(seg[i].length), 2);
+    sum += tifiles_checksum(seg[i].data, seg[i].length);
+  }
 
   return sum;
 }
@@ -106,15 +137,7 @@ static uint16_t compute_backup_sum(BackupContent* content)
 int ti8x_file_read_regular(const char *filename, Ti8xRegular *content)
 {
   FILE *f;
-  uint16_t tmp = 0x000B;
-  long offset = 0;
-  int i, j;
-  int ti83p_flag = 0;
-  uint8_t name_length = 8;	// ti85/86 only
-  uint16_t data_size, sum = 0;
-  char signature[9];
-  int padded86 = 0;
-  char varname[VARNAME_MAX];
+  int ret;
 
   if (!tifiles_file_is_regular(filename))
     return ERR_INVALID_FILE;
@@ -126,6 +149,33 @@ int ti8x_file_read_regular(const char *filename, Ti8xRegular *content)
     return ERR_FILE_OPEN;
   }
 
+  ret = ti8x_fread_regular(f, content);
+  fclose(f);
+  if (ret)
+    tifiles_content_delete_regular(content);
+
+  return ret;
+}
+
+/**
+ * ti8x_fread_regular:
+ * @f: a stream opened for reading and positioned at the file signature.
+ * @content: where to store the file content.
+ *
+ * Same as #ti8x_file_read_regular but read from an already opened stream
+ * (which is not closed). The content is not released on error.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti8x_fread_regular(FILE *f, Ti8xRegular *content)
+{
+  uint32_t offset;
+  int i, j, n = 16;
+  uint8_t name_length = 8;	// ti85/86 only
+  uint16_t data_size, sum = 0;
+  char signature[9];
+  char varname[VARNAME_MAX];
+
   if(fread_8_chars(f, signature) < 0) goto tfrr;
   content->model = tifiles_signature2calctype(signature);
   if (content->model == CALC_NONE)
@@ -135,85 +185,69 @@ int ti8x_file_read_regular(const char *filename, Ti8xRegular *content)
   if(fread_n_chars(f, 42, content->comment) < 0) goto tfrr;
   if(fread_word(f, &data_size) < 0) goto tfrr;
 
-  // search for the number of entries by parsing the whole file
-  offset = ftell(f);
-  if(offset == -1L) goto tfrr;
+  // entries are parsed in one pass (the stream may not be seekable)
+  content->entries = tifiles_ve_create_array(n);
+  if (content->entries == NULL) 
+  {
+    return ERR_MALLOC;
+  }
 
-  for (i = 0;; i++) 
+  for (i = 0, offset = 0;; i++) 
   {
-    int current_offset = (int)ftell(f);
+    VarEntry *entry;
+	uint16_t packet_length, entry_size;
+	int ti83p_flag, padded86 = 0;
+
     /* We are done finding entries once we reach the end of the data segment
      * as defined in the header.  This works better than magic numbers, as
      * as there exist files in the wild with incorrect magic numbers that
      * transmit correctly with TI's software and with this code.
      *   Adrian Mettler
      */
-	  if(current_offset == -1L) goto tfrr;
-	  if (current_offset >= offset + data_size)
-	    break;
-
-    if(fread_word(f, &tmp) < 0) goto tfrr;
-    if (tmp == 0x0D)
-      ti83p_flag = !0;		// true TI83+ file (2 extra bytes)
-	if(content->model == CALC_TI85)
+	if (offset >= data_size)
+	  break;
+
+	if (i >= n)
 	{
-		// length &  name with no padding
-		if(fskip(f, 3) < 0) goto tfrr;
-		if(fread_byte(f, &name_length) < 0) goto tfrr;
-		if(name_length > 8) return ERR_INVALID_FILE;
-		if(fskip(f, name_length) < 0) goto tfrr;
+	  n *= 2;
+	  content->entries = tifiles_ve_resize_array(content->entries, n);
+	  if (content->entries == NULL) 
+	    return ERR_MALLOC;
 	}
-    else if(content->model == CALC_TI86) 
-	{
-      /* name may follow one of four conventions: padded with SPC bytes
-       * (most correct, generated by TI's software), padded with NULL bytes,
-       * unpadded (like TI85) or partially padded (garbaged).  
-	   * TI's software accepts all four, so we should too.
-       */
-		padded86 = tmp < 0x0C ? 0 : !0;	// TI-85 style file
-		
-		if(fskip(f, 3) < 0) goto tfrr;
-		if(fread_byte(f, &name_length) < 0) goto tfrr;
-		if(name_length > 8) return ERR_INVALID_FILE;
-		if(fskip(f, name_length) < 0) goto tfrr;
-
-		if(padded86)
-			if(fskip(f, 8 - name_length) < 0) goto tfrr;
-    }
-    else if ((content->model == CALC_TI83P) || (content->model == CALC_TI84P) || (content->model == CALC_TI84P_USB))
-		{ if(fskip(f, 13) < 0) goto tfrr; }
-    else
-		{ if(fskip(f, 11) < 0) goto tfrr; }
-    if(fread_word(f, &tmp) < 0) goto tfrr;
-    if(fskip(f, tmp) < 0) goto tfrr;
-  }
-  if(fseek(f, offset, SEEK_SET) < 0) goto tfrr;
-
-  content->num_entries = i;
-  content->entries = g_malloc0((content->num_entries + 1) * sizeof(VarEntry*));
-  if (content->entries == NULL) 
-  {
-    fclose(f);
-    return ERR_MALLOC;
-  }
-
-  for (i = 0; i < content->num_entries; i++) 
-  {
-    VarEntry *entry = content->entries[i] = g_malloc0(sizeof(VarEntry));
-	uint16_t packet_length, entry_size;
+    entry = content->entries[i] = tifiles_ve_create();
+    if (entry == NULL) 
+      return ERR_MALLOC;
+    content->entries[i+1] = NULL;
+    content->num_entries = i + 1;
 
     if(fread_word(f, &packet_length) < 0) goto tfrr;
     if(fread_word(f, &entry_size) < 0) goto tfrr;
     entry->size = entry_size;
     if(fread_byte(f, &(entry->type)) < 0) goto tfrr;
+    offset += 5;
+    ti83p_flag = (packet_length == 0x0D);	// true TI83+ file (2 extra bytes)
     if (is_ti8586(content->model))
+	{
+      // length &  name with no padding
       if(fread_byte(f, &name_length) < 0) goto tfrr;
+      if(name_length > 8) return ERR_INVALID_FILE;
+      offset++;
+
+      /* TI86 name may follow one of four conventions: padded with SPC bytes
+       * (most correct, generated by TI's software), padded with NULL bytes,
+       * unpadded (like TI85) or partially padded (garbaged).  
+	   * TI's software accepts all four, so we should too.
+       */
+      padded86 = (content->model == CALC_TI86) && (packet_length >= 0x0C);
+	}
     if(fread_n_chars(f, name_length, varname) < 0) goto tfrr;
+    offset += name_length;
 	ticonv_varname_from_tifile_s(content->model_dst, varname, entry->name, entry->type);
-	if((content->model == CALC_TI86) && padded86)
+	if(padded86)
 	{
 		for(j = 0; j < 8-name_length; j++)
 			sum += fgetc(f);
+		offset += 8 - name_length;
 	}
     if (ti83p_flag) 
     {
@@ -229,17 +263,19 @@ int ti8x_file_read_regular(const char *filename, Ti8xRegular *content)
       {
         entry->attr = ATTRB_NONE;
       }
+      offset += 2;
     }
     if(fread_word(f, NULL) < 0) goto tfrr;
+    offset += 2;
 
     entry->data = (uint8_t *) g_malloc0(entry->size);
     if (entry->data == NULL) 
 	{
-      fclose(f);
       return ERR_MALLOC;
     }
 
     if(fread(entry->data, 1, entry->size, f) < entry->size) goto tfrr;
+    offset += entry->size;
 
 	sum += packet_length;
     sum += tifiles_checksum((uint8_t *)&(entry->size), 2);
@@ -258,15 +294,159 @@ int ti8x_file_read_regular(const char *filename, Ti8xRegular *content)
 	return ERR_FILE_CHECKSUM;
 #endif
 
-  fclose(f);
   return 0;
 
-tfrr:	// release on exit
-    fclose(f);
-	tifiles_content_delete_regular(content);
+tfrr:	// error on exit
 	return ERR_FILE_IO;
 }
 
+/**
+ * ti8x_file_index_regular:
+ * @filename: name of single/group file to open.
+ * @index: where to store the file index.
+ *
+ * Walk the packet headers of a single/group file in one pass and without
+ * reading the variable data. Entries are created with a NULL data field and
+ * the offset of their data part is stored into the index. The file is left
+ * opened for #ti8x_file_load_entry.
+ *
+ * If error occurs, the index must be released with #tifiles_file_close_regular.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti8x_file_index_regular(const char *filename, FileIndex *index)
+{
+  FileContent *content = index->content;
+  FILE *f;
+  foff_t offset, end;
+  int i, n = 0;
+  uint8_t name_length = 8;	// ti85/86 only
+  uint16_t data_size;
+  char signature[9];
+  char varname[VARNAME_MAX];
+
+  if (!tifiles_file_is_regular(filename))
+    return ERR_INVALID_FILE;
+
+  f = index->f = g_fopen(filename, "rb");
+  if (f == NULL) 
+  {
+    tifiles_warning( "Unable to open this file: %s\n", filename);
+    return ERR_FILE_OPEN;
+  }
+
+  if(fread_8_chars(f, signature) < 0) return ERR_FILE_IO;
+  content->model = tifiles_signature2calctype(signature);
+  if (content->model == CALC_NONE)
+    return ERR_INVALID_FILE;
+  if(content->model_dst == CALC_NONE) content->model_dst = content->model;
+  if(fskip(f, 3) < 0) return ERR_FILE_IO;
+  if(fread_n_chars(f, 42, content->comment) < 0) return ERR_FILE_IO;
+  if(fread_word(f, &data_size) < 0) return ERR_FILE_IO;
+
+  // the position is tracked rather than asked with ftell
+  offset = 8 + 3 + 42 + 2;
+  end = offset + data_size;
+
+  for (i = 0; offset < end; i++) 
+  {
+    VarEntry *entry;
+    uint16_t packet_length, entry_size;
+    uint8_t type;
+    int padded86 = 0;
+
+    if (i >= n)
+    {
+      n = n ? 2*n : 16;
+      content->entries = tifiles_ve_resize_array(content->entries, n);
+      index->offsets = g_realloc(index->offsets, (n + 1) * sizeof(*index->offsets));
+      if (content->entries == NULL || index->offsets == NULL)
+        return ERR_MALLOC;
+    }
+
+    if(fread_word(f, &packet_length) < 0) return ERR_FILE_IO;
+    if(fread_word(f, &entry_size) < 0) return ERR_FILE_IO;
+    if(fread_byte(f, &type) < 0) return ERR_FILE_IO;
+    offset += 5;
+
+    if (is_ti8586(content->model))
+    {
+      if(fread_byte(f, &name_length) < 0) return ERR_FILE_IO;
+      if(name_length > 8) return ERR_INVALID_FILE;
+      offset++;
+      // TI86 names may be padded up to 8 chars (see ti8x_file_read_regular)
+      padded86 = (content->model == CALC_TI86) && (packet_length >= 0x0C);
+    }
+    if(fread_n_chars(f, name_length, varname) < 0) return ERR_FILE_IO;
+    offset += name_length;
+    if (padded86)
+    {
+      if(fskip(f, 8 - name_length) < 0) return ERR_FILE_IO;
+      offset += 8 - name_length;
+    }
+
+    entry = content->entries[i] = tifiles_ve_create();
+    if (entry == NULL)
+      return ERR_MALLOC;
+    content->entries[i+1] = NULL;
+    content->num_entries = i + 1;
+
+    ticonv_varname_from_tifile_s(content->model_dst, varname, entry->name, type);
+    entry->type = type;
+    entry->size = entry_size;
+
+    if (packet_length == 0x0D)
+    {
+      uint16_t attribute;
+
+      // true TI83+ file (2 extra bytes)
+      if(fread_word(f, &attribute) < 0) return ERR_FILE_IO;
+      entry->attr = ((attribute & 0x8000) || (attribute & 0x80)) ? ATTRB_ARCHIVED : ATTRB_NONE;
+      offset += 2;
+    }
+    if(fread_word(f, NULL) < 0) return ERR_FILE_IO;
+    offset += 2;
+
+    index->offsets[i] = offset;
+    if(fskip(f, entry_size) < 0) return ERR_FILE_IO;
+    offset += entry_size;
+  }
+
+  return 0;
+}
+
+/**
+ * ti8x_file_load_entry:
+ * @index: an index built by #ti8x_file_index_regular.
+ * @i: the number of the entry to load.
+ *
+ * Load (if not already done) the data of an entry.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti8x_file_load_entry(FileIndex *index, int i)
+{
+  VarEntry *entry = index->content->entries[i];
+  FILE *f = index->f;
+
+  if (entry->data != NULL)
+    return 0;
+
+  entry->data = (uint8_t *)tifiles_ve_alloc_data(entry->size);
+  if (entry->data == NULL) 
+    return ERR_MALLOC;
+
+  if(fseeko(f, index->offsets[i], SEEK_SET) ||
+     fread(entry->data, 1, entry->size, f) < entry->size)
+  {
+    g_free(entry->data);
+    entry->data = NULL;
+    return ERR_FILE_IO;
+  }
+
+  return 0;
+}
+
 /**
  * ti8x_file_read_backup:
  * @filename: name of backup file to open.
@@ -282,8 +462,7 @@ tfrr:	// release on exit
 int ti8x_file_read_backup(const char *filename, Ti8xBackup *content)
 {
   FILE *f;
-  char signature[9];
-  uint16_t sum;
+  int ret;
 
   if (!tifiles_file_is_backup(filename))
     return ERR_INVALID_FILE;
@@ -295,86 +474,82 @@ int ti8x_file_read_backup(const char *filename, Ti8xBackup *content)
     return ERR_FILE_OPEN;
   }
 
-  if(fread_8_chars(f, signature) < 0) goto tfrb;
+  ret = ti8x_fread_backup(f, content);
+  fclose(f);
+  if (ret)
+    tifiles_content_delete_backup(content);
+
+  return ret;
+}
+
+/**
+ * ti8x_fread_backup:
+ * @f: a stream opened for reading and positioned at the file signature.
+ * @content: where to store the file content.
+ *
+ * Same as #ti8x_file_read_backup but read from an already opened stream
+ * (which is not closed). The content is not released on error.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti8x_fread_backup(FILE *f, Ti8xBackup *content)
+{
+  char signature[9];
+  BackupSegment seg[4];
+  uint8_t *p;
+  uint32_t size;
+  int i, n;
+  uint16_t sum;
+
+  if(fread_8_chars(f, signature) < 0) return ERR_FILE_IO;
   content->model = tifiles_signature2calctype(signature);
   if (content->model == CALC_NONE)
     return ERR_INVALID_FILE;
-  if(fskip(f, 3) < 0) goto tfrb;
-  if(fread_n_chars(f, 42, content->comment) < 0) goto tfrb;
-  if(fread_word(f, NULL) < 0) goto tfrb;
-
-  if(fread_word(f, NULL) < 0) goto tfrb;
-  if(fread_word(f, &(content->data_length1)) < 0) goto tfrb;
-  if(fread_byte(f, &(content->type)) < 0) goto tfrb;
-  if(fread_word(f, &(content->data_length2)) < 0) goto tfrb;
-  if(fread_word(f, &(content->data_length3)) < 0) goto tfrb;
+  if(fskip(f, 3) < 0) return ERR_FILE_IO;
+  if(fread_n_chars(f, 42, content->comment) < 0) return ERR_FILE_IO;
+  if(fread_word(f, NULL) < 0) return ERR_FILE_IO;
+
+  if(fread_word(f, NULL) < 0) return ERR_FILE_IO;
+  if(fread_word(f, &(content->data_length1)) < 0) return ERR_FILE_IO;
+  if(fread_byte(f, &(content->type)) < 0) return ERR_FILE_IO;
+  if(fread_word(f, &(content->data_length2)) < 0) return ERR_FILE_IO;
+  if(fread_word(f, &(content->data_length3)) < 0) return ERR_FILE_IO;
   content->data_length4 = 0;
   if (content->model != CALC_TI86)
-	{ if(fread_word(f, &(content->mem_address)) < 0) goto tfrb; }
+	{ if(fread_word(f, &(content->mem_address)) < 0) return ERR_FILE_IO; }
   else
-	{ if(fread_word(f, &(content->data_length4)) < 0) goto tfrb;}
+	{ if(fread_word(f, &(content->data_length4)) < 0) return ERR_FILE_IO; }
 
-  if(fread_word(f, NULL) < 0) goto tfrb;
-  content->data_part1 = (uint8_t *)g_malloc0(content->data_length1);
-  if (content->data_part1 == NULL) 
-  {
-    fclose(f);
-    return ERR_MALLOC;
-  }
-  if(fread(content->data_part1, 1, content->data_length1, f) < content->data_length1) goto tfrb;
+  // all data parts (with their lengths) and checksum are read at once
+  n = get_backup_segments(content, seg);
+  for (size = 2, i = 0; i < n; i++)
+    size += seg[i].length + (SEGMENT_HAS_LENGTH(seg, i) ? 2 : 0);
 
-  if(fread_word(f, NULL) < 0) goto tfrb;
-  content->data_part2 = (uint8_t *)g_malloc0(content->data_length2);
-  if (content->data_part2 == NULL) 
-  {
-    fclose(f);
+  content->data_block = (uint8_t *)g_malloc0(size);
+  if (content->data_block == NULL) 
     return ERR_MALLOC;
-  }
-  if(fread(content->data_part2, 1, content->data_length2, f) < content->data_length2) goto tfrb;
+  if(fread(content->data_block, 1, size, f) < size) return ERR_FILE_IO;
 
-  if (content->data_length3)	// can be 0000 on TI86
-  {
-    if(fread_word(f, NULL) < 0) goto tfrb;
-    content->data_part3 = (uint8_t *)g_malloc0(content->data_length3);
-    if (content->data_part3 == NULL) 
-	{
-      fclose(f);
-      return ERR_MALLOC;
-    }
-    if(fread(content->data_part3, 1, content->data_length3, f) < content->data_length3) goto tfrb;
-  }
-
-  if (content->model == CALC_TI86) 
-  {
-    if(fread_word(f, NULL) < 0) goto tfrb;
-    content->data_part4 = (uint8_t *)g_malloc0(content->data_length4);
-    if (content->data_part4 == NULL) 
-	{
-      fclose(f);
-      return ERR_MALLOC;
-    }
-    if(fread(content->data_part4, 1, content->data_length4, f) < content->data_length4) goto tfrb;
-  } 
-  else 
+  for (p = content->data_block, i = 0; i < n; i++)
   {
-    content->data_length4 = 0;
-    content->data_part4 = NULL;
+    if (SEGMENT_HAS_LENGTH(seg, i))
+      p += 2;
+    seg[i].data = seg[i].length ? p : NULL;
+    p += seg[i].length;
   }
+  content->data_part1 = seg[0].data;
+  content->data_part2 = seg[1].data;
+  content->data_part3 = seg[2].data;
+  content->data_part4 = (n > 3) ? seg[3].data : NULL;
+  content->checksum = p[0] | (p[1] << 8);
 
-  if(fread_word(f, &(content->checksum)) < 0) goto tfrb;
   sum = compute_backup_sum(content);
 #if defined(CHECKSUM_ENABLED)
   if(sum != content->checksum) 
 	return ERR_FILE_CHECKSUM;
 #endif
 
-  fclose(f);
   return 0;
-
-tfrb:	// release on exit
-    fclose(f);
-	tifiles_content_delete_backup(content);
-	return ERR_FILE_IO;
 }
 
 static int check_device_type(uint8_t id)
@@ -416,9 +591,7 @@ static int check_data_type(uint8_t id)
 int ti8x_file_read_flash(const char *filename, Ti8xFlash *head)
 {
   FILE *f;
-  Ti8xFlash *content = head;
-  int i, ret;
-  char signature[9];
+  int ret;
 
   if (!tifiles_file_is_flash(filename))
     return ERR_INVALID_FILE;
@@ -430,10 +603,35 @@ int ti8x_file_read_flash(const char *filename, Ti8xFlash *head)
     return ERR_FILE_OPEN;
   }
 
+  ret = ti8x_fread_flash(f, tifiles_file_get_model(filename), head);
+  fclose(f);
+  if (ret)
+    tifiles_content_delete_flash(head);
+
+  return ret;
+}
+
+/**
+ * ti8x_fread_flash:
+ * @f: a stream opened for reading and positioned at the file signature.
+ * @model: calculator model the file is intended for.
+ * @content: where to store the file content.
+ *
+ * Same as #ti8x_file_read_flash but read from an already opened stream
+ * (which is not closed). The content is not released on error.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti8x_fread_flash(FILE *f, CalcModel model, Ti8xFlash *head)
+{
+  Ti8xFlash *content = head;
+  int i, ret;
+  char signature[9];
+
+  if(fread_8_chars(f, signature) < 0) goto tfrf;
   for (content = head;; content = content->next) 
   {
-	  if(fread_8_chars(f, signature) < 0) goto tfrf;
-	  content->model = tifiles_file_get_model(filename);
+	  content->model = model;
 	  if(fread_byte(f, &(content->revision_major)) < 0) goto tfrf;
 	  if(fread_byte(f, &(content->revision_minor)) < 0) goto tfrf;
 	  if(fread_byte(f, &(content->flags)) < 0) goto tfrf;
@@ -460,7 +658,6 @@ int ti8x_file_read_flash(const char *filename, Ti8xFlash *head)
 		  content->data_part = (uint8_t *)g_malloc0(content->data_length + 256);
 		  if (content->data_part == NULL) 
 		  {
-			fclose(f);
 			return ERR_MALLOC;
 		  }
 
@@ -471,8 +668,10 @@ int ti8x_file_read_flash(const char *filename, Ti8xFlash *head)
 	  }
 	  else if(content->data_type == TI83p_AMS || content->data_type == TI83p_APPL)
 	  {
+		  HexReader hex;
+
 		  // reset/initialize block reader
-		  hex_block_read(f, NULL, NULL, NULL, NULL, NULL);
+		  hex_block_read(f, NULL, NULL, NULL, NULL, NULL, &hex);
 		  content->pages = NULL;
 
 		  // we should determine the number of pages, to do...
@@ -491,7 +690,7 @@ int ti8x_file_read_flash(const char *filename, Ti8xFlash *head)
 				uint8_t data[PAGE_SIZE];
 				FlashPage* fp = content->pages[i] = g_malloc0(sizeof(FlashPage));
 
-				ret = hex_block_read(f, &size, &addr, &flag, data, &page);
+				ret = hex_block_read(f, &size, &addr, &flag, data, &page, &hex);
 
 				fp->data = (uint8_t *) g_malloc0(PAGE_SIZE);
 				memset(fp->data, 0xff, PAGE_SIZE);
@@ -510,27 +709,22 @@ int ti8x_file_read_flash(const char *filename, Ti8xFlash *head)
 		  content->next = NULL;
 	  }
 
-	  // check for end of file
+	  // check for end of file (the signature of the next header is consumed)
 		if(fread_8_chars(f, signature) < 0)
 			break;
 		if(strcmp(signature, "**TIFL**") || feof(f))
 			break;
-		if(fseek(f, -8, SEEK_CUR)) goto tfrf;
 
 		content->next = (Ti8xFlash *)g_malloc0(sizeof(Ti8xFlash));
 		if (content->next == NULL) 
 		{
-			fclose(f);
 			return ERR_MALLOC;
 		}
   }
 
-  fclose(f);
   return 0;
 
-tfrf:	// release on exit
-    fclose(f);
-	tifiles_content_delete_flash(content);
+tfrf:	// error on exit
 	return ERR_FILE_IO;
 }
 
@@ -555,13 +749,9 @@ tfrf:	// release on exit
 int ti8x_file_write_regular(const char *fname, Ti8xRegular *content, char **real_fname)
 {
   FILE *f;
-  int i;
-  uint16_t sum = 0;
   char *filename = NULL;
-  uint32_t data_length;
-  uint16_t packet_length = 0x0B;
-  uint8_t name_length = 8;
-  uint16_t attr;
+  char *tmpname;
+  int ret;
 
   if (fname != NULL) 
   {
@@ -576,49 +766,90 @@ int ti8x_file_write_regular(const char *fname, Ti8xRegular *content, char **real
       *real_fname = g_strdup(filename);
   }
 
-  f = g_fopen(filename, "wb");
+  f = fopen_atomic(filename, &tmpname);
   if (f == NULL) 
   {
     tifiles_info( "Unable to open this file: %s", filename);
     g_free(filename);
     return ERR_FILE_OPEN;
   }
+
+  ret = ti8x_fwrite_regular(f, content);
+  if(fclose_atomic(f, filename, tmpname, !ret) && !ret)
+    ret = ERR_FILE_CLOSE;
+
   g_free(filename);
+  return ret;
+}
 
-  // write header
-  if(fwrite_8_chars(f, tifiles_calctype2signature(content->model)) < 0) goto tfwr;
-  if(fwrite(content->model == CALC_TI85 ? fsignature85 : fsignature8x, 1, 3, f) < 3) goto tfwr;
-  if(fwrite_n_bytes(f, 42, (uint8_t *)content->comment) < 0) goto tfwr;
+/**
+ * ti8x_fwrite_regular:
+ * @f: a stream opened for writing.
+ * @content: the file content to write.
+ *
+ * Same as #ti8x_file_write_regular but write to an already opened stream
+ * (which is not closed). Used to build files in memory.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti8x_fwrite_regular(FILE *f, Ti8xRegular *content)
+{
+  int i;
+  uint32_t data_length;
+  uint16_t packet_length = 0x0B;
+  uint8_t name_length = 8;
+  uint8_t *buffer, *p;
+  size_t size;
+  int ret;
+
+  // compute the length of the data section
   for (i = 0, data_length = 0; i < content->num_entries; i++) 
   {
     VarEntry *entry = content->entries[i];
+    char varname[VARNAME_MAX];
 
-	if(content->model == CALC_TI82 || content->model == CALC_TI73)
-      data_length += entry->size + 15;
-	if(content->model == CALC_TI83)
-      data_length += entry->size + 15;
-	else if(content->model == CALC_TI85)
-		data_length += entry->size + 8 + strlen(entry->name);
-	else if(content->model == CALC_TI86)
+    if(content->model == CALC_TI85)
+    {
+      memset(varname, 0, sizeof(varname));
+      ticonv_varname_to_tifile_s(content->model_dst, entry->name, varname, entry->type);
+      data_length += entry->size + 8 + strlen(varname);
+    }
+    else if(content->model == CALC_TI86)
       data_length += entry->size + 16;
     else if (is_ti83p(content->model))
       data_length += entry->size + 17;
+    else
+      data_length += entry->size + 15;
   }
 
   if (data_length > 65535)
     return ERR_GROUP_SIZE;
-  if(fwrite_word(f, (uint16_t) data_length) < 0) goto tfwr;
+
+  // serialize the whole file into a buffer: header, data section & checksum
+  size = 8 + 3 + 42 + 2 + data_length + 2;
+  p = buffer = (uint8_t *)g_malloc0(size);
+  if (buffer == NULL)
+    return ERR_MALLOC;
+
+  // write header
+  if(mwrite_8_chars(&p, tifiles_calctype2signature(content->model)) < 0) goto tfwr;
+  mwrite_n_bytes(&p, 3, content->model == CALC_TI85 ? fsignature85 : fsignature8x);
+  mwrite_n_bytes(&p, 42, (uint8_t *)content->comment);
+  mwrite_word(&p, (uint16_t) data_length);
 
   // write data section
-  for (i = 0, sum = 0; i < content->num_entries; i++) 
+  for (i = 0; i < content->num_entries; i++) 
   {
     VarEntry *entry = content->entries[i];
 	char varname[VARNAME_MAX];
 
+	memset(varname, 0, sizeof(varname));
+	ticonv_varname_to_tifile_s(content->model_dst, entry->name, varname, entry->type);
+
 	switch (content->model) 
 	  {
 	  case CALC_TI85:
-		packet_length = 4 + strlen(entry->name);	//offset to data length
+		packet_length = 4 + strlen(varname);	//offset to data length
 		break;
 	  case CALC_TI86:
 		packet_length = 0x0C;
@@ -637,58 +868,39 @@ int ti8x_file_write_regular(const char *fname, Ti8xRegular *content, char **real
 		break;
 	  }
 
-    if(fwrite_word(f, packet_length) < 0) goto tfwr;
-    if(fwrite_word(f, (uint16_t)entry->size) < 0) goto tfwr;
-    if(fwrite_byte(f, entry->type) < 0) goto tfwr;
-	memset(varname, 0, sizeof(varname));
-	ticonv_varname_to_tifile_s(content->model_dst, entry->name, varname, entry->type);
+    mwrite_word(&p, packet_length);
+    mwrite_word(&p, (uint16_t)entry->size);
+    mwrite_byte(&p, entry->type);
     if (is_ti8586(content->model)) 
 	{
       name_length = strlen(varname);
-      if(fwrite_byte(f, (uint8_t)name_length) < 0) goto tfwr;
+      mwrite_byte(&p, (uint8_t)name_length);
 	  if(content->model == CALC_TI85)
-		{ if(fwrite_n_chars(f, name_length, varname) < 0) goto tfwr; }
+		{ if(mwrite_n_chars(&p, name_length, varname) < 0) goto tfwr; }
 	  else
-		{ if(fwrite_n_chars2(f, 8, varname) < 0) goto tfwr; } // space padded
+		{ if(mwrite_n_chars2(&p, 8, varname) < 0) goto tfwr; } // space padded
     }
     else
-    	if(fwrite_n_chars(f, 8, varname) < 0) goto tfwr;
+    	if(mwrite_n_chars(&p, 8, varname) < 0) goto tfwr;
     // XXX non-zero version byte not handled (noted by Benjamin Moody).
     if (is_ti83p(content->model))
-    {        
-      attr = (uint16_t)((entry->attr == ATTRB_ARCHIVED) ? 0x8000 : 0x00);
-      if(fwrite_word(f, attr) < 0) goto tfwr;
-    }
-    if(fwrite_word(f, (uint16_t)entry->size) < 0) goto tfwr;
-    if(fwrite(entry->data, 1, entry->size, f) < entry->size) goto tfwr;
-
-    sum += packet_length;
-    sum += MSB(entry->size);
-	sum += LSB(entry->size);
-    sum += entry->type;
-    if (is_ti8586(content->model))
-      sum += strlen(entry->name);
-    sum += tifiles_checksum((uint8_t *)varname, name_length);
-	if(content->model == CALC_TI86)
-		sum += (8 - name_length) * ' ';
-    sum += MSB(entry->size);
-	sum += LSB(entry->size);
-    sum += tifiles_checksum(entry->data, entry->size);
-    if (is_ti83p(content->model))
-    {
-      sum += tifiles_checksum((uint8_t *)&attr, sizeof(attr));
-    }
+      mwrite_word(&p, (uint16_t)((entry->attr == ATTRB_ARCHIVED) ? 0x8000 : 0x00));
+    mwrite_word(&p, (uint16_t)entry->size);
+    mwrite_n_bytes(&p, entry->size, entry->data);
   }
 
   //checksum is the sum of all bytes in the data section
-  content->checksum = sum;
-  if(fwrite_word(f, content->checksum) < 0) goto tfwr;
+  content->checksum = tifiles_checksum(buffer + 8 + 3 + 42 + 2, data_length);
+  mwrite_word(&p, content->checksum);
 
-  fclose(f);
-  return 0;
+  // and write it at once
+  ret = fwrite(buffer, 1, size, f) < size ? ERR_FILE_IO : 0;
+
+  g_free(buffer);
+  return ret;
 
 tfwr:	// release on exit
-    fclose(f);
+	g_free(buffer);
 	return ERR_FILE_IO;
 }
 
@@ -704,58 +916,95 @@ tfwr:	// release on exit
 int ti8x_file_write_backup(const char *filename, Ti8xBackup *content)
 {
   FILE *f;
-  uint16_t data_length;
+  char *tmpname;
+  int ret;
 
-  f = g_fopen(filename, "wb");
+  f = fopen_atomic(filename, &tmpname);
   if (f == NULL) 
   {
     tifiles_info( "Unable to open this file: %s", filename);
     return ERR_FILE_OPEN;
   }
+
+  ret = ti8x_fwrite_backup(f, content);
+  if(fclose_atomic(f, filename, tmpname, !ret) && !ret)
+    ret = ERR_FILE_CLOSE;
+
+  return ret;
+}
+
+/**
+ * ti8x_fwrite_backup:
+ * @f: a stream opened for writing.
+ * @content: the file content to write.
+ *
+ * Same as #ti8x_file_write_backup but write to an already opened stream
+ * (which is not closed).
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti8x_fwrite_backup(FILE *f, Ti8xBackup *content)
+{
+  uint16_t data_length;
+  BackupSegment seg[4];
+  uint8_t header[66], lengths[4][2], checksum[2];
+  const uint8_t *vec_data[10];
+  size_t vec_len[10];
+  uint8_t *p;
+  int i, n, k;
+
   // write header
-  if(fwrite_8_chars(f, tifiles_calctype2signature(content->model)) < 0) goto tfwb;
-  if(fwrite(content->model == CALC_TI85 ? fsignature85 : fsignature8x, 1, 3, f) < 3) goto tfwb;
-  if(fwrite_n_bytes(f, 42, (uint8_t *)content->comment) < 0) goto tfwb;
+  p = header;
+  if(mwrite_8_chars(&p, tifiles_calctype2signature(content->model)) < 0) return ERR_FILE_IO;
+  mwrite_n_bytes(&p, 3, content->model == CALC_TI85 ? fsignature85 : fsignature8x);
+  mwrite_n_bytes(&p, 42, (uint8_t *)content->comment);
   data_length =
       content->data_length1 + content->data_length2 +
       content->data_length3 + 17;
   data_length += content->data_length4;
-  if(fwrite_word(f, data_length) < 0) goto tfwb;
+  mwrite_word(&p, data_length);
 
   // write backup header
-  if(fwrite_word(f, 0x09) < 0) goto tfwb;
-  if(fwrite_word(f, content->data_length1) < 0) goto tfwb;
-  if(fwrite_byte(f, content->type) < 0) goto tfwb;
-  if(fwrite_word(f, content->data_length2) < 0) goto tfwb;
-  if(fwrite_word(f, content->data_length3) < 0) goto tfwb;
+  mwrite_word(&p, 0x09);
+  mwrite_word(&p, content->data_length1);
+  mwrite_byte(&p, content->type);
+  mwrite_word(&p, content->data_length2);
+  mwrite_word(&p, content->data_length3);
   if (content->model != CALC_TI86)
-	{ if(fwrite_word(f, content->mem_address) < 0) goto tfwb; }
+    mwrite_word(&p, content->mem_address);
   else
-	{ if(fwrite_word(f, content->data_length4) < 0) goto tfwb; }
+    mwrite_word(&p, content->data_length4);
+
+  vec_data[0] = header;
+  vec_len[0] = p - header;
+  k = 1;
 
   // write data num_entries
-  if(fwrite_word(f, content->data_length1) < 0) goto tfwb;
-  if(fwrite(content->data_part1, 1, content->data_length1, f) < content->data_length1) goto tfwb;
-  if(fwrite_word(f, content->data_length2) < 0) goto tfwb;
-  if(fwrite(content->data_part2, 1, content->data_length2, f) < content->data_length2) goto tfwb;
-  if (content->data_length3)	// TI86: can be NULL
-    if(fwrite_word(f, content->data_length3) < 0) goto tfwb;
-  if(fwrite(content->data_part3, 1, content->data_length3, f) < content->data_length3) goto tfwb;
-  if (content->model == CALC_TI86) {
-    if(fwrite_word(f, content->data_length4) < 0) goto tfwb;
-    if(fwrite(content->data_part4, 1, content->data_length4, f) < content->data_length4) goto tfwb;
+  n = get_backup_segments(content, seg);
+  for (i = 0; i < n; i++)
+  {
+    if (SEGMENT_HAS_LENGTH(seg, i))	// TI86: can be NULL
+    {
+      p = lengths[i];
+      mwrite_word(&p, seg[i].length);
+      vec_data[k] = lengths[i];
+      vec_len[k++] = 2;
+    }
+    vec_data[k] = seg[i].data;
+    vec_len[k++] = seg[i].length;
   }
 
   // checksum = sum of all bytes in bachup headers and data num_entries
   content->checksum = compute_backup_sum(content);
-  if(fwrite_word(f, content->checksum) < 0) goto tfwb;
+  p = checksum;
+  mwrite_word(&p, content->checksum);
+  vec_data[k] = checksum;
+  vec_len[k++] = 2;
 
-  fclose(f);
-  return 0;
+  // whole file is written at once
+  if(fwrite_vec(f, vec_data, vec_len, k) < 0) return ERR_FILE_IO;
 
-tfwb:	// release on exit
-    fclose(f);
-	return ERR_FILE_IO;
+  return 0;
 }
 
 /**
@@ -772,10 +1021,9 @@ int ti8x_file_write_flash(const char *fname, Ti8xFlash *head, char **real_fname)
 {
   FILE *f;
   Ti8xFlash *content = head;
-  int i;
-  int bytes_written = 0;
-  long pos;
   char *filename;
+  char *tmpname;
+  int ret;
 
   if (fname)
   {
@@ -799,15 +1047,85 @@ int ti8x_file_write_flash(const char *fname, Ti8xFlash *head, char **real_fname)
 		*real_fname = g_strdup(filename);
   }
 
-  f = g_fopen(filename, "wb");
+  f = fopen_atomic(filename, &tmpname);
   if (f == NULL) 
   {
     tifiles_info("Unable to open this file: %s", filename);
+    g_free(filename);
     return ERR_FILE_OPEN;
   }
-  
+
+  ret = ti8x_fwrite_flash(f, head);
+  if(fclose_atomic(f, filename, tmpname, !ret) && !ret)
+    ret = ERR_FILE_CLOSE;
+
+  g_free(filename);
+  return ret;
+}
+
+/*
+  Write a page as Intel hex data (or the final block if 'i' is the number of
+  pages). The last page is written from 'last' (padded copy).
+  - f [in]: a stream or NULL to compute the length only
+  - flag [in/out]: flag of previous block (see hex_block_write)
+  - [out]: the number of chars.
+*/
+static int ti8x_fwrite_page(FILE *f, Ti8xFlash *content, int i, uint8_t *last, uint16_t last_size, int *flag)
+{
+  FlashPage *fp;
+
+  if (i == content->num_pages)
+    return hex_block_write(f, 0, 0, 0, NULL, 0, flag);
+
+  fp = content->pages[i];
+  if (i == content->num_pages - 1)
+    return hex_block_write(f, last_size, fp->addr, fp->flag, last, fp->page, flag);
+
+  return hex_block_write(f, fp->size, fp->addr, fp->flag, fp->data, fp->page, flag);
+}
+
+/**
+ * ti8x_fwrite_flash:
+ * @f: a stream opened for writing.
+ * @content: the file content to write.
+ *
+ * Same as #ti8x_file_write_flash but write to an already opened stream
+ * (which is not closed). Used to build files in memory.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti8x_fwrite_flash(FILE *f, Ti8xFlash *head)
+{
+  Ti8xFlash *content = head;
+  int i;
+  int flag = 0x80;
+  uint8_t *last = NULL;
+  uint16_t last_size = 0;
+  uint32_t hex_length = 0;
+
   for (content = head; content != NULL; content = content->next) 
   {
+	int is_hex = (content->data_type == TI83p_AMS || content->data_type == TI83p_APPL) && content->num_pages > 0;
+
+	// the length of Intel hex data is computed before writing the header
+	// (the encoding is deterministic), hence the stream is written forward only
+	if(is_hex)
+	{
+		FlashPage *fp = content->pages[content->num_pages-1];
+		int old_flag = flag;
+
+		// pad to 32 bytes (the last page is padded with 0xFF, pages are left unchanged)
+		last_size = fp->size + 0x20 - (fp->size & 0x1F);
+		last = (uint8_t *)g_malloc(last_size);
+		if(last == NULL)
+			return ERR_MALLOC;
+		memset(last, 0xff, last_size);
+		memcpy(last, fp->data, fp->size);
+
+		for (i = 0, hex_length = 0; i <= content->num_pages; i++)
+			hex_length += ti8x_fwrite_page(NULL, content, i, last, last_size, &old_flag);
+	}
+
 	  // header
     if(fwrite_8_chars(f, "**TIFL**") < 0) goto tfwf;
     if(fwrite_byte(f, content->revision_major) < 0) goto tfwf;
@@ -823,45 +1141,31 @@ int ti8x_file_write_flash(const char *fname, Ti8xFlash *head, char **real_fname)
     if(fwrite_byte(f, content->device_type) < 0) goto tfwf;
     if(fwrite_byte(f, content->data_type) < 0) goto tfwf;
     if(fwrite_n_chars(f, 24, "") < 0) goto tfwf;
-	pos = ftell(f);
-	if(pos == -1L) goto tfwf;
-    if(fwrite_long(f, content->data_length) < 0) goto tfwf;
+    if(fwrite_long(f, is_hex ? hex_length : content->data_length) < 0) goto tfwf;
 
 	// data
 	if(content->data_type == TI83p_CERT || content->data_type == TI83p_LICENSE)
 	{
 		if(fwrite(content->data_part, 1, content->data_length, f) < content->data_length) goto tfwf;
 	}
-	else if(content->data_type == TI83p_AMS || content->data_type == TI83p_APPL)
+	else if(is_hex)
 	{
-		int r;
-		
-		// pad to 256 bytes
-		r = 0x20 - (content->pages[content->num_pages-1]->size & 0x1F);
-		content->pages[content->num_pages-1]->size += r;
-
-		// write
-		for (i = 0; i < content->num_pages; i++)
-		  {
-			  bytes_written += hex_block_write(f, 
-				  content->pages[i]->size, content->pages[i]->addr,
-				  content->pages[i]->flag, content->pages[i]->data, 
-				  content->pages[i]->page);
-		  }
+		uint32_t n = 0;
 
-		  // final block
-		  bytes_written += hex_block_write(f, 0, 0, 0, NULL, 0);
-		  if(fseek(f, -bytes_written - 4, SEEK_CUR)) goto tfwf;
-		  if(fwrite_long(f, bytes_written) < 0) goto tfwf;
-		  if(fseek(f, SEEK_END, 0L) ) goto tfwf;
+		// pages then final block
+		for (i = 0; i <= content->num_pages; i++)
+			n += ti8x_fwrite_page(f, content, i, last, last_size, &flag);
+		if(n != hex_length || ferror(f)) goto tfwf;
+
+		g_free(last);
+		last = NULL;
 	}
   }  
 
-  fclose(f);
   return 0;
 
 tfwf:	// release on exit
-    fclose(f);
+	g_free(last);
 	return ERR_FILE_IO;
 }
 
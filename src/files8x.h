@@ -54,11 +54,23 @@ int ti8x_file_read_regular(const char *filename, Ti8xRegular *content);
 int ti8x_file_read_backup(const char *filename, Ti8xBackup *content);
 int ti8x_file_read_flash(const char *filename, Ti8xFlash *content);
 
+int ti8x_fread_regular(FILE *f, Ti8xRegular *content);
+int ti8x_fread_backup(FILE *f, Ti8xBackup *content);
+int ti8x_fread_flash(FILE *f, CalcModel model, Ti8xFlash *content);
+
+// lazy reading
+int ti8x_file_index_regular(const char *filename, FileIndex *index);
+int ti8x_file_load_entry(FileIndex *index, int i);
+
 // writing
 int ti8x_file_write_regular(const char *filename, Ti8xRegular *content, char **filename2);
 int ti8x_file_write_backup(const char *filename, Ti8xBackup *content);
 int ti8x_file_write_flash(const char *filename, Ti8xFlash *content, char **filename2);
 
+int ti8x_fwrite_regular(FILE *f, Ti8xRegular *content);
+int ti8x_fwrite_backup(FILE *f, Ti8xBackup *content);
+int ti8x_fwrite_flash(FILE *f, Ti8xFlash *content);
+
 // displaying
 int ti8x_file_display(const char *filename);
 
@@ -44,12 +44,116 @@
 /* Misc */
 /********/
 
-static int fsignature[2] = { 1, 0 };
+static const int fsignature[2] = { 1, 0 };
 
 /***********/
 /* Reading */
 /***********/
 
+/*
+  Read the header and the table of entries of a single/group file.
+  Entries are created without data, the offset of their data part (just
+  after the 4 NULL bytes) is stored into the allocated 'offsets' array and
+  the offset of the end of table into 'end' (if not NULL).
+  The caller must release the content on error.
+*/
+static int read_table(FILE *f, Ti9xRegular *content, int64_t **offsets, foff_t *end)
+{
+  char default_folder[FLDNAME_MAX];
+  char current_folder[FLDNAME_MAX];
+  uint32_t curr_offset = 0;
+  uint32_t prev_offset = 0;
+  VarEntry *prev = NULL;
+  uint16_t tmp;
+  uint8_t type, attr;
+  int i, j;
+  char signature[9];
+  char varname[VARNAME_MAX];
+  foff_t size = fsize(f);
+
+  if(fread_8_chars(f, signature) < 0) return ERR_FILE_IO;
+  content->model = tifiles_signature2calctype(signature);
+  if (content->model == CALC_NONE)
+    return ERR_INVALID_FILE;
+  if(content->model_dst == CALC_NONE) content->model_dst = content->model;
+
+  if(fread_word(f, NULL) < 0) return ERR_FILE_IO;
+  if(fread_8_chars(f, default_folder) < 0) return ERR_FILE_IO;
+  ticonv_varname_from_tifile_s(content->model_dst, default_folder, content->default_folder, -1);
+  strcpy(current_folder, content->default_folder);
+  if(fread_n_chars(f, 40, content->comment) < 0) return ERR_FILE_IO;
+  if(fread_word(f, &tmp) < 0) return ERR_FILE_IO;
+
+  content->entries = g_malloc0((tmp + 1) * sizeof(VarEntry*));
+  *offsets = g_malloc0((tmp + 1) * sizeof(int64_t));
+  if (content->entries == NULL || *offsets == NULL) 
+    return ERR_MALLOC;
+
+  // the table gives the offset of each entry, the size of a variable
+  // is the distance to the offset of the next table record
+  for (i = 0, j = 0; i < tmp; i++) 
+  {
+    if(fread_long(f, &curr_offset) < 0) return ERR_FILE_IO;
+    if(size >= 0 && curr_offset > size) return ERR_INVALID_FILE;
+    if(prev != NULL)
+    {
+      if(curr_offset < prev_offset + 4 + 2) return ERR_INVALID_FILE;
+      prev->size = curr_offset - prev_offset - 4 - 2;
+      prev = NULL;
+    }
+
+    if(fread_8_chars(f, varname) < 0)  return ERR_FILE_IO;
+    if(fread_byte(f, &type) < 0) return ERR_FILE_IO;
+    if(fread_byte(f, &attr) < 0) return ERR_FILE_IO;
+    if(fread_word(f, NULL) < 0) return ERR_FILE_IO;
+
+    if (type == TI92_DIR) // same as TI89_DIR, TI89t_DIR, ...
+    {
+      ticonv_varname_from_tifile_s(content->model_dst, varname, current_folder, type);
+      continue;			// folder: skip entry
+    }
+    else
+    {
+      VarEntry *entry = content->entries[j] = tifiles_ve_create();
+
+      if (entry == NULL)
+        return ERR_MALLOC;
+      content->num_entries = j + 1;
+
+      ticonv_varname_from_tifile_s(content->model_dst, varname, entry->name, type);
+      strcpy(entry->folder, current_folder);
+      entry->type = type;
+      entry->attr = (attr == 2 || attr == 3) ? ATTRB_ARCHIVED : attr;
+
+      (*offsets)[j++] = curr_offset + 4;	// skip 4 bytes (NULL)
+      prev = entry;
+      prev_offset = curr_offset;
+    }
+  }
+
+  // the table is terminated by the offset of the end of data
+  if(prev != NULL)
+  {
+    if(fread_long(f, &curr_offset) < 0) return ERR_FILE_IO;
+    if(curr_offset < prev_offset + 4 + 2) return ERR_INVALID_FILE;
+    prev->size = curr_offset - prev_offset - 4 - 2;
+  }
+
+  if(end != NULL)
+    *end = 0x3c + 16 * tmp + (prev != NULL ? 4 : 0);
+
+  return 0;
+}
+
+static int compare_offsets(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  const int64_t *offsets = (const int64_t *)user_data;
+  int64_t oa = offsets[*(const int *)a];
+  int64_t ob = offsets[*(const int *)b];
+
+  return (oa > ob) - (oa < ob);
+}
+
 /**
  * ti9x_file_read_regular:
  * @filename: name of single/group file to open.
@@ -57,6 +161,9 @@ static int fsignature[2] = { 1, 0 };
  *
  * Load the single/group file into a Ti9xRegular structure.
  *
+ * The table of entries is read first, then data parts are read in offset
+ * order so that the file is parsed in one forward pass (no seek back).
+ *
  * Structure content must be freed with #tifiles_content_delete_regular when
  * no longer used. If error occurs, the structure content is released for you.
  *
@@ -65,15 +172,7 @@ static int fsignature[2] = { 1, 0 };
 int ti9x_file_read_regular(const char *filename, Ti9xRegular *content)
 {
   FILE *f;
-  long cur_pos = 0;
-  char default_folder[FLDNAME_MAX];
-  char current_folder[FLDNAME_MAX];
-  uint32_t curr_offset = 0;
-  uint32_t next_offset = 0;
-  uint16_t tmp;
-  int i, j;
-  char signature[9];
-  char varname[VARNAME_MAX];
+  int ret;
 
   if (!tifiles_file_is_regular(filename))
     return ERR_INVALID_FILE;
@@ -84,94 +183,201 @@ int ti9x_file_read_regular(const char *filename, Ti9xRegular *content)
     tifiles_info( "Unable to open this file: %s", filename);
     return ERR_FILE_OPEN;
   }
+  // a large buffer gets small files in a single read
+  setvbuf(f, NULL, _IOFBF, 65536);
 
-  if(fread_8_chars(f, signature) < 0) goto tffr;
-  content->model = tifiles_signature2calctype(signature);
-  if (content->model == CALC_NONE)
-    return ERR_INVALID_FILE;
-  if(content->model_dst == CALC_NONE) content->model_dst = content->model;
+  ret = ti9x_fread_regular(f, content);
+  fclose(f);
+  if (ret)
+    tifiles_content_delete_regular(content);
 
-  if(fread_word(f, NULL) < 0) goto tffr;
-  if(fread_8_chars(f, default_folder) < 0) goto tffr;
-  ticonv_varname_from_tifile_s(content->model_dst, default_folder, content->default_folder, -1);
-  strcpy(current_folder, content->default_folder);
-  if(fread_n_chars(f, 40, content->comment) < 0) goto tffr;
-  if(fread_word(f, &tmp) < 0) goto tffr;
-  content->num_entries = tmp;
+  return ret;
+}
 
-  content->entries = g_malloc0((content->num_entries + 1) * sizeof(VarEntry*));
-  if (content->entries == NULL) 
+/**
+ * ti9x_fread_regular:
+ * @f: a stream opened for reading and positioned at the file signature.
+ * @content: where to store the file content.
+ *
+ * Same as #ti9x_file_read_regular but read from an already opened stream
+ * (which is not closed). The content is not released on error.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti9x_fread_regular(FILE *f, Ti9xRegular *content)
+{
+  int64_t *offsets = NULL;
+  int *order = NULL;
+  foff_t pos;
+  uint8_t gap[64];
+  int i, ret;
+
+  ret = read_table(f, content, &offsets, &pos);
+  if(ret) goto tffr;
+
+  // data parts are stored in table order by all known writers but sort
+  // them anyway: the file is then read forward only
+  order = g_malloc((content->num_entries + 1) * sizeof(int));
+  if (order == NULL)
   {
-    fclose(f);
-    return ERR_MALLOC;
+    ret = ERR_MALLOC;
+    goto tffr;
   }
+  for (i = 0; i < content->num_entries; i++)
+    order[i] = i;
+  g_qsort_with_data(order, content->num_entries, sizeof(int), compare_offsets, offsets);
 
-  for (i = 0, j = 0; i < content->num_entries; i++) 
+  // the position is tracked rather than asked with ftell (pipes can't tell)
+  ret = ERR_FILE_IO;
+  for (i = 0; i < content->num_entries; i++) 
   {
-    VarEntry *entry = content->entries[j] = g_malloc0(sizeof(VarEntry));
+    VarEntry *entry = content->entries[order[i]];
+    foff_t offset = offsets[order[i]];
+    uint16_t checksum, sum;
 
-    if(fread_long(f, &curr_offset) < 0) goto tffr;
-    if(fread_8_chars(f, varname) < 0)  goto tffr;
-	ticonv_varname_from_tifile_s(content->model_dst, varname, entry->name, entry->type);
-    if(fread_byte(f, &(entry->type)) < 0) goto tffr;
-    if(fread_byte(f, &(entry->attr)) < 0) goto tffr;
-    entry->attr = (entry->attr == 2 || entry->attr == 3) ? ATTRB_ARCHIVED : entry->attr;
-    if(fread_word(f, NULL) < 0) goto tffr;
+    // 4 bytes (NULL) and any unused area are consumed by reading
+    if (offset > pos && offset - pos <= (foff_t)sizeof(gap))
+    {
+      if(fread_n_bytes(f, (size_t)(offset - pos), gap) < 0) goto tffr;
+    }
+    else if (offset != pos)
+    {
+      if(fskip(f, offset - pos)) goto tffr;
+    }
 
-    if (entry->type == TI92_DIR) // same as TI89_DIR, TI89t_DIR, ...
-	{
-      strcpy(current_folder, entry->name);
-      g_free(entry);
-      continue;			// folder: skip entry
-    } 
-	else 
-	{
-	  uint16_t checksum, sum = 0;
+    entry->data = (uint8_t *)tifiles_ve_alloc_data(entry->size);
+    if (entry->data == NULL) 
+    {
+      ret = ERR_MALLOC;
+      goto tffr;
+    }
 
-      j++;
-      strcpy(entry->folder, current_folder);
-      cur_pos = ftell(f);
-	  if(cur_pos == -1L) goto tffr;
-      if(fread_long(f, &next_offset) < 0) goto tffr;
-      entry->size = next_offset - curr_offset - 4 - 2;
-      entry->data = (uint8_t *)g_malloc0(entry->size);
-      if (entry->data == NULL) 
-	  {
-		fclose(f);
-		tifiles_content_delete_regular(content);
-		return ERR_MALLOC;
-      }
-
-      if(fseek(f, curr_offset, SEEK_SET)) goto tffr;
-      if(fread_long(f, NULL) < 0) goto tffr;	// 4 bytes (NULL)
-      if(fread(entry->data, 1, entry->size, f) < entry->size) goto tffr;
-
-      if(fread_word(f, &checksum) < 0) goto tffr;
-      if(fseek(f, cur_pos, SEEK_SET)) goto tffr;
-
-	  sum = tifiles_checksum(entry->data, entry->size);
-	  if(sum != checksum)
-	  {
-		  fclose(f);
-		  tifiles_content_delete_regular(content);
-	      return ERR_FILE_CHECKSUM;
-	  }
-	  content->checksum += sum;	// sum of all checksums but unused
+    if(fread(entry->data, 1, entry->size, f) < entry->size) goto tffr;
+    if(fread_word(f, &checksum) < 0) goto tffr;
+    pos = offset + entry->size + 2;
+
+    sum = tifiles_checksum(entry->data, entry->size);
+    if(sum != checksum)
+    {
+      ret = ERR_FILE_CHECKSUM;
+      goto tffr;
     }
+    content->checksum += sum;	// sum of all checksums but unused
   }
-  content->num_entries = j;
-  content->entries = realloc(content->entries, content->num_entries * sizeof(VarEntry*));
-  //fread_long(f, &next_offset);
-  //fseek(f, next_offset - 2, SEEK_SET);
-  //fread_word(f, &(content->checksum));
 
-  fclose(f);
+  g_free(order);
+  g_free(offsets);
   return 0;
 
 tffr:	// release on exit
-    fclose(f);
-	tifiles_content_delete_regular(content);
-	return ERR_FILE_IO;
+  g_free(order);
+  g_free(offsets);
+  return ret;
+}
+
+/**
+ * ti9x_file_index_regular:
+ * @filename: name of single/group file to open.
+ * @index: where to store the file index.
+ *
+ * Read the header and the table of entries of a single/group file but not
+ * the variable data. Entries are created with a NULL data field and the
+ * offset of their data part is stored into the index. The file is left
+ * opened for #ti9x_file_load_entry.
+ *
+ * If error occurs, the index must be released with #tifiles_file_close_regular.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti9x_file_index_regular(const char *filename, FileIndex *index)
+{
+  if (!tifiles_file_is_regular(filename))
+    return ERR_INVALID_FILE;
+
+  index->f = g_fopen(filename, "rb");
+  if (index->f == NULL) 
+  {
+    tifiles_info( "Unable to open this file: %s", filename);
+    return ERR_FILE_OPEN;
+  }
+
+  return read_table(index->f, index->content, &index->offsets, NULL);
+}
+
+/**
+ * ti9x_file_load_entry:
+ * @index: an index built by #ti9x_file_index_regular.
+ * @i: the number of the entry to load.
+ *
+ * Load (if not already done) the data of an entry and verify its checksum.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti9x_file_load_entry(FileIndex *index, int i)
+{
+  VarEntry *entry = index->content->entries[i];
+  FILE *f = index->f;
+  uint16_t checksum, sum;
+
+  if (entry->data != NULL)
+    return 0;
+
+  entry->data = (uint8_t *)tifiles_ve_alloc_data(entry->size);
+  if (entry->data == NULL) 
+    return ERR_MALLOC;
+
+  if(fseeko(f, index->offsets[i], SEEK_SET)) goto tfle;
+  if(fread(entry->data, 1, entry->size, f) < entry->size) goto tfle;
+  if(fread_word(f, &checksum) < 0) goto tfle;
+
+  sum = tifiles_checksum(entry->data, entry->size);
+  if(sum != checksum)
+  {
+    g_free(entry->data);
+    entry->data = NULL;
+    return ERR_FILE_CHECKSUM;
+  }
+
+  return 0;
+
+tfle:	// release on exit
+  g_free(entry->data);
+  entry->data = NULL;
+  return ERR_FILE_IO;
+}
+
+/*
+  Read the header of a backup file (everything before data).
+  - [out]: an error code, 0 otherwise.
+*/
+static int ti9x_fread_backup_header(FILE *f, Ti9xBackup *content)
+{
+  uint32_t file_size;
+  char signature[9];
+
+  if(fread_8_chars(f, signature) < 0) return ERR_FILE_IO;
+  content->model = tifiles_signature2calctype(signature);
+  if (content->model == CALC_NONE)
+    return ERR_INVALID_FILE;
+
+  if(fread_word(f, NULL) < 0) return ERR_FILE_IO;
+  if(fread_8_chars(f, NULL) < 0) return ERR_FILE_IO;
+  if(fread_n_chars(f, 40, content->comment) < 0) return ERR_FILE_IO;
+  if(fread_word(f, NULL) < 0) return ERR_FILE_IO;
+  if(fread_long(f, NULL) < 0) return ERR_FILE_IO;
+  if(fread_8_chars(f, content->rom_version) < 0) return ERR_FILE_IO;
+  if(fread_byte(f, &(content->type)) < 0) return ERR_FILE_IO;
+  if(fread_byte(f, NULL) < 0) return ERR_FILE_IO;
+  if(fread_word(f, NULL) < 0) return ERR_FILE_IO;
+  if(fread_long(f, &file_size) < 0) return ERR_FILE_IO;
+  if(file_size < 0x52 + 2) return ERR_INVALID_FILE;
+  content->data_length = file_size - 0x52 - 2;
+  if(fread_word(f, NULL) < 0) return ERR_FILE_IO;
+
+  // data and checksum, don't trust the header before allocating memory
+  if(fcheck_length(f, (foff_t)content->data_length + 2) < 0) return ERR_INVALID_FILE;
+
+  return 0;
 }
 
 /**
@@ -189,9 +395,7 @@ tffr:	// release on exit
 int ti9x_file_read_backup(const char *filename, Ti9xBackup *content)
 {
   FILE *f;
-  uint32_t file_size;
-  char signature[9];
-  uint16_t sum;
+  int ret;
 
   if (!tifiles_file_is_backup(filename))
     return ERR_INVALID_FILE;
@@ -203,52 +407,123 @@ int ti9x_file_read_backup(const char *filename, Ti9xBackup *content)
     return ERR_FILE_OPEN;
   }
 
-  if(fread_8_chars(f, signature) < 0) goto tfrb;
-  content->model = tifiles_signature2calctype(signature);
-  if (content->model == CALC_NONE)
-    return ERR_INVALID_FILE;
+  ret = ti9x_fread_backup(f, content);
+  fclose(f);
+  if (ret)
+    tifiles_content_delete_backup(content);
 
-  if(fread_word(f, NULL) < 0) goto tfrb;
-  if(fread_8_chars(f, NULL) < 0) goto tfrb;
-  if(fread_n_chars(f, 40, content->comment) < 0) goto tfrb;
-  if(fread_word(f, NULL) < 0) goto tfrb;
-  if(fread_long(f, NULL) < 0) goto tfrb;
-  if(fread_8_chars(f, content->rom_version) < 0) goto tfrb;
-  if(fread_byte(f, &(content->type)) < 0) goto tfrb;
-  if(fread_byte(f, NULL) < 0) goto tfrb;
-  if(fread_word(f, NULL) < 0) goto tfrb;
-  if(fread_long(f, &file_size) < 0) goto tfrb;
-  content->data_length = file_size - 0x52 - 2;
-  if(fread_word(f, NULL) < 0) goto tfrb;
+  return ret;
+}
+
+/**
+ * ti9x_fread_backup:
+ * @f: a stream opened for reading and positioned at the file signature.
+ * @content: where to store the file content.
+ *
+ * Same as #ti9x_file_read_backup but read from an already opened stream
+ * (which is not closed). The content is not released on error.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti9x_fread_backup(FILE *f, Ti9xBackup *content)
+{
+  uint16_t sum;
+  int ret;
+
+  ret = ti9x_fread_backup_header(f, content);
+  if (ret)
+    return ret;
 
   content->data_part = (uint8_t *)g_malloc0(content->data_length);
   if (content->data_part == NULL) 
-  {
-    fclose(f);
-	tifiles_content_delete_backup(content);
     return ERR_MALLOC;
-  }
 
-  if(fread(content->data_part, 1, content->data_length, f) < content->data_length) goto tfrb;
-  if(fread_word(f, &(content->checksum)) < 0) goto tfrb;
+  if(fread(content->data_part, 1, content->data_length, f) < content->data_length) return ERR_FILE_IO;
+  if(fread_word(f, &(content->checksum)) < 0) return ERR_FILE_IO;
 
   sum = tifiles_checksum(content->data_part, content->data_length);
 #if defined(CHECKSUM_ENABLED)
   if(sum != content->checksum)
-  {
-	  fclose(f);
-	  tifiles_content_delete_backup(content);
 	  return ERR_FILE_CHECKSUM;
-  }
 #endif
 
-  fclose(f);
   return 0;
+}
 
-tfrb:	// release on exit
-    fclose(f);
-	tifiles_content_delete_backup(content);
-	return ERR_FILE_IO;
+/**
+ * ti9x_file_open_backup:
+ * @filename: name of backup file to open.
+ * @stream: where to store the header and the opened file.
+ *
+ * Read the header of a backup file and keep the file opened so that data
+ * can be read block by block with #ti9x_file_read_backup_block.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti9x_file_open_backup(const char *filename, BackupStream *stream)
+{
+  if (!tifiles_file_is_backup(filename))
+    return ERR_INVALID_FILE;
+
+  stream->f = g_fopen(filename, "rb");
+  if (stream->f == NULL) 
+  {
+    tifiles_info( "Unable to open this file: %s", filename);
+    return ERR_FILE_OPEN;
+  }
+
+  return ti9x_fread_backup_header(stream->f, stream->content);
+}
+
+/**
+ * ti9x_file_read_backup_block:
+ * @stream: a stream opened with #ti9x_file_open_backup.
+ * @size: maximum size of block.
+ * @block: where to store the address of block.
+ * @length: where to store the size of block (0 at end of data).
+ *
+ * Read the next block of data into the buffer of stream. The checksum
+ * stored in file is read along with the last block.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti9x_file_read_backup_block(BackupStream *stream, uint32_t size, const uint8_t **block, uint32_t *length)
+{
+  Ti9xBackup *content = stream->content;
+  uint32_t n = content->data_length - stream->offset;
+
+  if (n > size)
+    n = size;
+
+  if (n > stream->buffer_size)
+  {
+    g_free(stream->buffer);
+    stream->buffer = (uint8_t *)g_malloc(n);
+    if (stream->buffer == NULL)
+    {
+      stream->buffer_size = 0;
+      return ERR_MALLOC;
+    }
+    stream->buffer_size = n;
+  }
+
+  if(fread(stream->buffer, 1, n, stream->f) < n) return ERR_FILE_IO;
+  stream->checksum += tifiles_checksum(stream->buffer, n);
+  stream->offset += n;
+
+  *block = stream->buffer;
+  *length = n;
+
+  if (n > 0 && stream->offset == content->data_length)
+  {
+    if(fread_word(stream->f, &(content->checksum)) < 0) return ERR_FILE_IO;
+#if defined(CHECKSUM_ENABLED)
+    if(stream->checksum != content->checksum)
+      return ERR_FILE_CHECKSUM;
+#endif
+  }
+
+  return 0;
 }
 
 static int check_device_type(uint8_t id)
@@ -290,9 +565,8 @@ static int check_data_type(uint8_t id)
 int ti9x_file_read_flash(const char *filename, Ti9xFlash *head)
 {
 	FILE *f;
-	Ti9xFlash *content = head;
 	int tib = 0;
-	char signature[9];
+	int ret;
 
 	if (!tifiles_file_is_flash(filename) && !tifiles_file_is_tib(filename))
 		return ERR_INVALID_FILE;
@@ -307,24 +581,48 @@ int ti9x_file_read_flash(const char *filename, Ti9xFlash *head)
 		return ERR_FILE_OPEN;
 	}  
 
+	ret = ti9x_fread_flash(f, tifiles_file_get_model(filename), tib, head);
+	fclose(f);
+	if (ret)
+		tifiles_content_delete_flash(head);
+
+	return ret;
+}
+
+/**
+ * ti9x_fread_flash:
+ * @f: a stream opened for reading and positioned at the file signature.
+ * @model: calculator model the file is intended for.
+ * @tib: set if the stream holds an old-style .tib file.
+ * @content: where to store the file content.
+ *
+ * Same as #ti9x_file_read_flash but read from an already opened stream
+ * (which is not closed). The content is not released on error.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti9x_fread_flash(FILE *f, CalcModel model, int tib, Ti9xFlash *head)
+{
+	Ti9xFlash *content = head;
+	char signature[9];
+
 	if (tib) 
 	{	// tib is an old format but mainly used by developers
-		memset(content, 0, sizeof(Ti9xFlash));
-		if(fseek(f, 0, SEEK_END)) goto tfrf;
-		content->data_length = (uint32_t) ftell(f);
-		if(fseek(f, 0, SEEK_SET)) goto tfrf;
+		size_t size;
 
+		memset(content, 0, sizeof(Ti9xFlash));
 		strcpy(content->name, "basecode");
 		content->data_type = 0x23;	// FLASH os
 
-		content->data_part = (uint8_t *)g_malloc0(content->data_length);
+		// the whole stream is the OS
+		if(fread_all(f, &content->data_part, &size) < 0) goto tfrf;
 		if (content->data_part == NULL) 
 		{
-			fclose(f);
 			return ERR_MALLOC;
 		}
-
-		if(fread(content->data_part, 1, content->data_length, f) < content->data_length) goto tfrf;
+		if((uint64_t)size > 0xFFFFFFFF)
+			return ERR_INVALID_FILE;
+		content->data_length = (uint32_t)size;
 		switch(content->data_part[8])
 		{
 		case 1: content->device_type = DEVICE_TYPE_92P; break;	// TI92+
@@ -339,10 +637,10 @@ int ti9x_file_read_flash(const char *filename, Ti9xFlash *head)
 	} 
 	else 
 	{
+		if(fread_8_chars(f, signature) < 0) goto tfrf;
 		for (content = head;; content = content->next) 
 		{
-		    if(fread_8_chars(f, signature) < 0) goto tfrf;
-		    content->model = tifiles_file_get_model(filename);
+		    content->model = model;
 		    if(fread_byte(f, &(content->revision_major)) < 0) goto tfrf;
 		    if(fread_byte(f, &(content->revision_minor)) < 0) goto tfrf;
 		    if(fread_byte(f, &(content->flags)) < 0) goto tfrf;
@@ -363,41 +661,35 @@ int ti9x_file_read_flash(const char *filename, Ti9xFlash *head)
 				return ERR_INVALID_FILE;
 			if(!check_data_type(content->data_type))
 				return ERR_INVALID_FILE;
+			if(fcheck_length(f, content->data_length) < 0)
+				return ERR_INVALID_FILE;
 
 			content->data_part = (uint8_t *)g_malloc0(content->data_length);
 			if (content->data_part == NULL) 
 			{
-				fclose(f);
-				tifiles_content_delete_flash(content);
 				return ERR_MALLOC;
 			}
 
 			if(fread(content->data_part, 1, content->data_length, f) < content->data_length) goto tfrf;
 			content->next = NULL;
 
-			// check for end of file
+			// check for end of file (the signature of the next header is consumed)
 			if(fread_8_chars(f, signature) < 0)
 				break;
 			if(strcmp(signature, "**TIFL**") || feof(f))
 				break;
-			if(fseek(f, -8, SEEK_CUR)) goto tfrf;
 
 			content->next = (Ti9xFlash *)g_malloc0(sizeof(Ti9xFlash));
 			if (content->next == NULL) 
 			{
-				fclose(f);
-				tifiles_content_delete_flash(content);
 				return ERR_MALLOC;
 			}
 		}
 	}
 
-	fclose(f);
 	return 0;
 
-tfrf:	// release on exit
-    fclose(f);
-	tifiles_content_delete_flash(content);
+tfrf:	// error on exit
 	return ERR_FILE_IO;
 }
 
@@ -422,13 +714,9 @@ tfrf:	// release on exit
 int ti9x_file_write_regular(const char *fname, Ti9xRegular *content, char **real_fname)
 {
   FILE *f;
-  int i;
   char *filename = NULL;
-  uint32_t offset = 0x52;
-  int **table;
-  int num_folders;
-  char default_folder[FLDNAME_MAX];
-  char fldname[FLDNAME_MAX], varname[VARNAME_MAX];
+  char *tmpname;
+  int ret;
 
   if (fname != NULL) 
   {
@@ -443,35 +731,79 @@ int ti9x_file_write_regular(const char *fname, Ti9xRegular *content, char **real
       *real_fname = g_strdup(filename);
   }
 
-  f = g_fopen(filename, "wb");
+  f = fopen_atomic(filename, &tmpname);
   if (f == NULL) 
   {
     tifiles_info( "Unable to open this file: %s", filename);
     g_free(filename);
     return ERR_FILE_OPEN;
   }
+
+  ret = ti9x_fwrite_regular(f, content);
+  if(fclose_atomic(f, filename, tmpname, !ret) && !ret)
+    ret = ERR_FILE_CLOSE;
+
   g_free(filename);
+  return ret;
+}
+
+/**
+ * ti9x_fwrite_regular:
+ * @f: a stream opened for writing.
+ * @content: the file content to write.
+ *
+ * Same as #ti9x_file_write_regular but write to an already opened stream
+ * (which is not closed). Used to build files in memory.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti9x_fwrite_regular(FILE *f, Ti9xRegular *content)
+{
+  int i;
+  uint32_t offset = 0x52;
+  int **table;
+  int num_folders;
+  char default_folder[FLDNAME_MAX];
+  char fldname[FLDNAME_MAX], varname[VARNAME_MAX];
+  uint8_t *buffer = NULL, *p;
+  int ret = ERR_FILE_IO;
 
   // build the table of folder & variable entries  
   table = tifiles_create_table_of_entries((FileContent *)content, &num_folders);
   if (table == NULL)
 	  return ERR_MALLOC;
 
+  // the last offset of the table is the size of the file
+  if (content->num_entries > 1) 
+    offset += 16 * (content->num_entries + num_folders - 1);
+  for (i = 0; i < content->num_entries; i++)
+    offset += content->entries[i]->size + 4 + 2;
+
+  // serialize the whole file into a buffer: header, table & data
+  p = buffer = (uint8_t *)g_malloc0(offset);
+  if (buffer == NULL)
+  {
+    ret = ERR_MALLOC;
+    goto tfwr;
+  }
+  offset = 0x52;
+
   // write header
-  if(fwrite_8_chars(f, tifiles_calctype2signature(content->model)) < 0) goto tfwr;
-  if(fwrite(fsignature, 1, 2, f) < 2) goto tfwr;
+  if(mwrite_8_chars(&p, tifiles_calctype2signature(content->model)) < 0) goto tfwr;
+  mwrite_byte(&p, (uint8_t)fsignature[0]);
+  mwrite_byte(&p, (uint8_t)fsignature[1]);
   if (content->num_entries == 1)	// folder entry for single var is placed here
     strcpy(content->default_folder, content->entries[0]->folder);
   ticonv_varname_to_tifile_s(content->model, content->default_folder, default_folder, -1);
-  if(fwrite_8_chars(f, default_folder) < 0) goto tfwr;
-  if(fwrite_n_bytes(f, 40, (uint8_t *)content->comment) < 0) goto tfwr;
+  if(mwrite_8_chars(&p, default_folder) < 0) goto tfwr;
+  mwrite_n_bytes(&p, 40, (uint8_t *)content->comment);
   if (content->num_entries > 1) 
   {
-    if(fwrite_word(f, (uint16_t) (content->num_entries + num_folders)) < 0) goto tfwr;
+    mwrite_word(&p, (uint16_t) (content->num_entries + num_folders));
     offset += 16 * (content->num_entries + num_folders - 1);
   } 
   else
-    if(fwrite_word(f, 1) < 0) goto tfwr;
+    mwrite_word(&p, 1);
 
   // write table of entries
   for (i = 0; table[i] != NULL; i++) 
@@ -482,13 +814,13 @@ int ti9x_file_write_regular(const char *fname, Ti9xRegular *content, char **real
 
     if (content->num_entries > 1)	// single var does not have folder entry
     {
-      if(fwrite_long(f, offset) < 0) goto tfwr;
+      mwrite_long(&p, offset);
 	  ticonv_varname_to_tifile_s(content->model, fentry->folder, fldname, -1);
-      if(fwrite_8_chars(f, fldname) < 0) goto tfwr;
-      if(fwrite_byte(f, (uint8_t)tifiles_folder_type(content->model)) < 0) goto tfwr;
-      if(fwrite_byte(f, 0x00) < 0) goto tfwr;
+      if(mwrite_8_chars(&p, fldname) < 0) goto tfwr;
+      mwrite_byte(&p, (uint8_t)tifiles_folder_type(content->model));
+      mwrite_byte(&p, 0x00);
       for (j = 0; table[i][j] != -1; j++);
-      if(fwrite_word(f, (uint16_t) j) < 0) goto tfwr;
+      mwrite_word(&p, (uint16_t) j);
     }
 
     for (j = 0; table[i][j] != -1; j++) 
@@ -497,20 +829,20 @@ int ti9x_file_write_regular(const char *fname, Ti9xRegular *content, char **real
       VarEntry *entry = content->entries[idx2];
 	  uint8_t attr = ATTRB_NONE;
 
-      if(fwrite_long(f, offset) < 0) goto tfwr;
+      mwrite_long(&p, offset);
 	  ticonv_varname_to_tifile_s(content->model, entry->name, varname, entry->type);
-      if(fwrite_8_chars(f, varname) < 0) goto tfwr;
-      if(fwrite_byte(f, entry->type) < 0) goto tfwr;
+      if(mwrite_8_chars(&p, varname) < 0) goto tfwr;
+      mwrite_byte(&p, entry->type);
       attr = (entry->attr == ATTRB_ARCHIVED) ? 3 : entry->attr;
-      if(fwrite_byte(f, attr) < 0) goto tfwr;
-      if(fwrite_word(f, 0) < 0) goto tfwr;
+      mwrite_byte(&p, attr);
+      mwrite_word(&p, 0);
 
       offset += entry->size + 4 + 2;
     }
   }
 
-  if(fwrite_long(f, offset) < 0) goto tfwr;
-  if(fwrite_word(f, 0x5aa5) < 0) goto tfwr;
+  mwrite_long(&p, offset);
+  mwrite_word(&p, 0x5aa5);
 
   // write data
   for (i = 0; table[i] != NULL; i++) 
@@ -521,26 +853,43 @@ int ti9x_file_write_regular(const char *fname, Ti9xRegular *content, char **real
 	{
       int idx = table[i][j];
       VarEntry *entry = content->entries[idx];
-      uint16_t sum;
 
-      if(fwrite_long(f, 0) < 0) goto tfwr;
-      if(fwrite(entry->data, 1, entry->size, f) < entry->size) goto tfwr;
-      sum = tifiles_checksum(entry->data, entry->size);
-      if(fwrite_word(f, sum) < 0) goto tfwr;
+      mwrite_long(&p, 0);
+      mwrite_n_bytes(&p, entry->size, entry->data);
+      mwrite_word(&p, tifiles_checksum(entry->data, entry->size));
     }
   }
 
-  // g_free( memory
+  // and write it at once
+  ret = fwrite(buffer, 1, offset, f) < offset ? ERR_FILE_IO : 0;
+
+tfwr:	// release on exit
   for (i = 0; i < num_folders; i++)
     g_free(table[i]);
   g_free(table);
+  g_free(buffer);
+  return ret;
+}
 
-  fclose(f);
-  return 0;
+/*
+  Write the header of a backup file (everything before data).
+  - [out]: -1 if error, 0 otherwise.
+*/
+static int ti9x_fwrite_backup_header(FILE *f, Ti9xBackup *content)
+{
+  if(fwrite_8_chars(f, tifiles_calctype2signature(content->model)) < 0) return -1;
+  if(fwrite(fsignature, 1, 2, f) < 2) return -1;
+  if(fwrite_8_chars(f, "") < 0) return -1;
+  if(fwrite_n_bytes(f, 40, (uint8_t *)content->comment) < 0) return -1;
+  if(fwrite_word(f, 1) < 0) return -1;
+  if(fwrite_long(f, 0x52) < 0) return -1;
+  if(fwrite_8_chars(f, content->rom_version) < 0) return -1;
+  if(fwrite_word(f, content->type) < 0) return -1;
+  if(fwrite_word(f, 0) < 0) return -1;
+  if(fwrite_long(f, content->data_length + 0x52 + 2) < 0) return -1;
+  if(fwrite_word(f, 0x5aa5) < 0) return -1;
 
-tfwr:	// release on exit
-    fclose(f);
-	return ERR_FILE_IO;
+  return 0;
 }
 
 /**
@@ -555,37 +904,134 @@ tfwr:	// release on exit
 int ti9x_file_write_backup(const char *filename, Ti9xBackup *content)
 {
   FILE *f;
+  char *tmpname;
+  int ret;
 
-  f = g_fopen(filename, "wb");
+  f = fopen_atomic(filename, &tmpname);
   if (f == NULL) 
   {
     tifiles_info("Unable to open this file: %s", filename);
     return ERR_FILE_OPEN;
   }
 
-  if(fwrite_8_chars(f, tifiles_calctype2signature(content->model)) < 0) goto tfwb;
-  if(fwrite(fsignature, 1, 2, f) < 2) goto tfwb;
-  if(fwrite_8_chars(f, "") < 0) goto tfwb;
-  if(fwrite_n_bytes(f, 40, (uint8_t *)content->comment) < 0) goto tfwb;
-  if(fwrite_word(f, 1) < 0) goto tfwb;
-  if(fwrite_long(f, 0x52) < 0) goto tfwb;
-  if(fwrite_8_chars(f, content->rom_version) < 0) goto tfwb;
-  if(fwrite_word(f, content->type) < 0) goto tfwb;
-  if(fwrite_word(f, 0) < 0) goto tfwb;
-  if(fwrite_long(f, content->data_length + 0x52 + 2) < 0) goto tfwb;
-  if(fwrite_word(f, 0x5aa5) < 0) goto tfwb;
-  if(fwrite(content->data_part, 1, content->data_length, f) < content->data_length) goto tfwb;
+  ret = ti9x_fwrite_backup(f, content);
+  if(fclose_atomic(f, filename, tmpname, !ret) && !ret)
+    ret = ERR_FILE_CLOSE;
+
+  return ret;
+}
+
+/**
+ * ti9x_fwrite_backup:
+ * @f: a stream opened for writing.
+ * @content: the file content to write.
+ *
+ * Same as #ti9x_file_write_backup but write to an already opened stream
+ * (which is not closed).
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti9x_fwrite_backup(FILE *f, Ti9xBackup *content)
+{
+  if(ti9x_fwrite_backup_header(f, content) < 0) return ERR_FILE_IO;
+  if(fwrite(content->data_part, 1, content->data_length, f) < content->data_length) return ERR_FILE_IO;
 
   content->checksum =
       tifiles_checksum(content->data_part, content->data_length);
-  if(fwrite_word(f, content->checksum) < 0) goto tfwb;
+  if(fwrite_word(f, content->checksum) < 0) return ERR_FILE_IO;
 
-  fclose(f);
   return 0;
+}
 
-tfwb:	// release on exit
-    fclose(f);
-	return ERR_FILE_IO;
+/**
+ * ti9x_file_create_backup:
+ * @filename: name of backup file where to write.
+ * @stream: the header to write and where to store the opened file.
+ *
+ * Write the header of a backup file so that data can be written block by
+ * block with #ti9x_file_write_backup_block. data_length of header may be
+ * 0 if unknown: the size is then written by #ti9x_file_close_backup.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti9x_file_create_backup(const char *filename, BackupStream *stream)
+{
+  stream->f = fopen_atomic(filename, &stream->tmpname);
+  if (stream->f == NULL) 
+  {
+    tifiles_info("Unable to open this file: %s", filename);
+    return ERR_FILE_OPEN;
+  }
+
+  if(ti9x_fwrite_backup_header(stream->f, stream->content) < 0)
+    return ERR_FILE_IO;
+
+  return 0;
+}
+
+/**
+ * ti9x_file_write_backup_block:
+ * @stream: a stream opened with #ti9x_file_create_backup.
+ * @block: data to write.
+ * @length: size of data.
+ *
+ * Write a block of data.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti9x_file_write_backup_block(BackupStream *stream, const uint8_t *block, uint32_t length)
+{
+  if(fwrite(block, 1, length, stream->f) < length) return ERR_FILE_IO;
+  stream->checksum += tifiles_checksum((uint8_t *)block, length);
+  stream->offset += length;
+
+  return 0;
+}
+
+/**
+ * ti9x_file_close_backup:
+ * @stream: a stream opened by #ti9x_file_open_backup or #ti9x_file_create_backup.
+ *
+ * Close the file. When writing, the checksum is appended (and the size in
+ * header is written if it was unknown), then the file is renamed over the
+ * destination unless an error occurred or data_length bytes were not written.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti9x_file_close_backup(BackupStream *stream)
+{
+  Ti9xBackup *content = stream->content;
+  int ret = stream->err;
+
+  if (stream->tmpname == NULL)
+  {
+    if(fclose(stream->f))
+      return ERR_FILE_CLOSE;
+    return 0;
+  }
+
+  if (!ret)
+  {
+    content->checksum = stream->checksum;
+    if(fwrite_word(stream->f, content->checksum) < 0)
+      ret = ERR_FILE_IO;
+  }
+
+  if (!ret && content->data_length != 0 && content->data_length != stream->offset)
+    ret = ERR_FILE_IO;	// missing or extra data
+
+  if (!ret && content->data_length != stream->offset)
+  {
+    content->data_length = stream->offset;
+    if(fseek(stream->f, 0x4c, SEEK_SET) || fwrite_long(stream->f, content->data_length + 0x52 + 2) < 0)
+      ret = ERR_FILE_IO;
+  }
+
+  if(fclose_atomic(stream->f, stream->filename, stream->tmpname, !ret) && !ret)
+    ret = ERR_FILE_CLOSE;
+  stream->tmpname = NULL;
+
+  return ret;
 }
 
 /**
@@ -602,6 +1048,8 @@ int ti9x_file_write_flash(const char *fname, Ti9xFlash *head, char **real_fname)
   FILE *f;
   Ti9xFlash *content = head;
   char *filename;
+  char *tmpname;
+  int ret;
 
   if (fname)
   {
@@ -625,13 +1073,36 @@ int ti9x_file_write_flash(const char *fname, Ti9xFlash *head, char **real_fname)
 		*real_fname = g_strdup(filename);
   }
 
-  f = g_fopen(filename, "wb");
+  f = fopen_atomic(filename, &tmpname);
   if (f == NULL) 
   {
     tifiles_info("Unable to open this file: %s", filename);
+    g_free(filename);
     return ERR_FILE_OPEN;
   }
 
+  ret = ti9x_fwrite_flash(f, head);
+  if(fclose_atomic(f, filename, tmpname, !ret) && !ret)
+    ret = ERR_FILE_CLOSE;
+
+  g_free(filename);
+  return ret;
+}
+
+/**
+ * ti9x_fwrite_flash:
+ * @f: a stream opened for writing.
+ * @content: the file content to write.
+ *
+ * Same as #ti9x_file_write_flash but write to an already opened stream
+ * (which is not closed). Used to build files in memory.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int ti9x_fwrite_flash(FILE *f, Ti9xFlash *head)
+{
+  Ti9xFlash *content = head;
+
   for (content = head; content != NULL; content = content->next) 
   {
     if(fwrite_8_chars(f, "**TIFL**") < 0) goto tfwf;
@@ -653,11 +1124,9 @@ int ti9x_file_write_flash(const char *fname, Ti9xFlash *head, char **real_fname)
     if(fwrite(content->data_part, 1, content->data_length, f) < content->data_length) goto tfwf;
   }
 
-  fclose(f);
   return 0;
 
 tfwf:	// release on exit
-    fclose(f);
 	return ERR_FILE_IO;
 }
 
@@ -53,11 +53,30 @@ int ti9x_file_read_regular(const char *filename, Ti9xRegular *content);
 int ti9x_file_read_backup(const char *filename, Ti9xBackup *content);
 int ti9x_file_read_flash(const char *filename, Ti9xFlash *content);
 
+int ti9x_fread_regular(FILE *f, Ti9xRegular *content);
+int ti9x_fread_backup(FILE *f, Ti9xBackup *content);
+int ti9x_fread_flash(FILE *f, CalcModel model, int tib, Ti9xFlash *content);
+
+// streaming
+int ti9x_file_open_backup(const char *filename, BackupStream *stream);
+int ti9x_file_read_backup_block(BackupStream *stream, uint32_t size, const uint8_t **block, uint32_t *length);
+int ti9x_file_create_backup(const char *filename, BackupStream *stream);
+int ti9x_file_write_backup_block(BackupStream *stream, const uint8_t *block, uint32_t length);
+int ti9x_file_close_backup(BackupStream *stream);
+
+// lazy reading
+int ti9x_file_index_regular(const char *filename, FileIndex *index);
+int ti9x_file_load_entry(FileIndex *index, int i);
+
 // writing
 int ti9x_file_write_regular(const char *filename, Ti9xRegular *content, char **filename2);
 int ti9x_file_write_backup(const char *filename, Ti9xBackup *content);
 int ti9x_file_write_flash(const char *filename, Ti9xFlash *content, char **filename2);
 
+int ti9x_fwrite_regular(FILE *f, Ti9xRegular *content);
+int ti9x_fwrite_backup(FILE *f, Ti9xBackup *content);
+int ti9x_fwrite_flash(FILE *f, Ti9xFlash *content);
+
 // displaying
 int ti9x_file_display(const char *filename);
 
@@ -27,6 +27,7 @@
 #include <glib/gstdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
 
 #include <ticonv.h>
@@ -58,6 +59,7 @@
 int tnsp_file_read_regular(const char *filename, FileContent *content)
 {
   FILE *f;
+  int ret;
 
   if (!tifiles_file_is_regular(filename))
     return ERR_INVALID_FILE;
@@ -69,44 +71,122 @@ int tnsp_file_read_regular(const char *filename, FileContent *content)
     return ERR_FILE_OPEN;
   }
 
+  ret = tnsp_fread_regular(f, filename, content);
+  fclose(f);
+  if (ret)
+    tifiles_content_delete_regular(content);
+
+  return ret;
+}
+
+/*
+  Set up the only entry of a content (named after the file) without data.
+  - [out]: the entry.
+*/
+static VarEntry* tnsp_content_new_entry(const char *filename, FileContent *content)
+{
+  VarEntry *entry;
+  gchar *basename;
+  gchar *ext;
+
   content->model = CALC_NSPIRE;
   content->model_dst = content->model;
 
   content->entries = g_malloc0((content->num_entries + 1) * sizeof(VarEntry*));
-      
-  {
-	  VarEntry *entry = content->entries[0] = g_malloc0(sizeof(VarEntry));
-	  
-	  gchar *basename = g_path_get_basename(filename);
-	  gchar *ext = tifiles_fext_get(basename);
+  entry = content->entries[0] = g_malloc0(sizeof(VarEntry));
 
-	  entry->type = tifiles_fext2vartype(content->model, ext);
-	  if(ext) *(ext-1) = '\0';
+  basename = g_path_get_basename(filename);
+  ext = tifiles_fext_get(basename);
 
-	  strcpy(entry->folder, "");
-	  strcpy(entry->name, basename);
-	  g_free(basename);
+  entry->type = tifiles_fext2vartype(content->model, ext);
+  if(ext) *(ext-1) = '\0';
 
-	  entry->attr = ATTRB_NONE;
-	  fseek(f, 0, SEEK_END);
-	  entry->size = (uint32_t)ftell(f);
-	  fseek(f, 0, SEEK_SET);
+  strcpy(entry->folder, "");
+  strcpy(entry->name, basename);
+  g_free(basename);
+
+  entry->attr = ATTRB_NONE;
+
+  return entry;
+}
+
+/**
+ * tnsp_fread_regular:
+ * @f: a stream opened for reading and positioned at the start of file.
+ * @filename: name of file (used to name the variable).
+ * @content: where to store the file content.
+ *
+ * Same as #tnsp_file_read_regular but read from an already opened stream
+ * (which is not closed). The content is not released on error.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int tnsp_fread_regular(FILE *f, const char *filename, FileContent *content)
+{
+  VarEntry *entry;
+  uint8_t *data;
+  size_t size;
 
-	  entry->data = (uint8_t *)g_malloc0(entry->size);  
-	  if(fread(entry->data, 1, entry->size, f) < entry->size) goto tffr;
+  // documents are opaque: the whole stream is read
+  if(fread_all(f, &data, &size) < 0) goto tffr;
+  if((uint64_t)size > 0xFFFFFFFF)
+  {
+    g_free(data);
+    return ERR_INVALID_FILE;
   }
 
+  // the entry is added once data is known to be valid (nothing to release)
+  entry = tnsp_content_new_entry(filename, content);
+  entry->data = data;
+  entry->size = (uint32_t)size;
   content->num_entries++;
 
-  fclose(f);
   return 0;
 
-tffr:	// release on exit
-    fclose(f);
-	tifiles_content_delete_regular(content);
+tffr:	// error on exit
 	return ERR_FILE_IO;
 }
 
+/**
+ * tnsp_file_map_regular:
+ * @filename: name of file to map.
+ * @content: where to store the file content.
+ * @map: where to store the mapping (NULL if the file could not be mapped).
+ *
+ * Same as #tnsp_file_read_regular but data of the entry points into a
+ * read-only mapping of the file instead of a copy. If the file can't be
+ * mapped, it is loaded with #tnsp_file_read_regular.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int tnsp_file_map_regular(const char *filename, FileContent *content, void **map)
+{
+  VarEntry *entry;
+  const uint8_t *data;
+  size_t len;
+
+  *map = NULL;
+  if (!tifiles_file_is_regular(filename))
+    return ERR_INVALID_FILE;
+
+  *map = fopen_map(filename, &data, &len);
+  if (*map == NULL || len == 0 || (uint64_t)len > 0xFFFFFFFF)
+  {
+    if (*map != NULL)
+      fclose_map(*map);
+    *map = NULL;
+    return tnsp_file_read_regular(filename, content);
+  }
+
+  entry = tnsp_content_new_entry(filename, content);
+  entry->size = (uint32_t)len;
+  entry->data = (uint8_t *)data;
+
+  content->num_entries++;
+
+  return 0;
+}
+
 /**
  * tnsp_file_read_flash:
  * @filename: name of flash file to open.
@@ -122,7 +202,7 @@ tffr:	// release on exit
 int tnsp_file_read_flash(const char *filename, FlashContent *content)
 {
 	FILE *f;
-	int c;
+	int ret;
 
 	if (!tifiles_file_is_tno(filename))
 		return ERR_INVALID_FILE;
@@ -134,40 +214,149 @@ int tnsp_file_read_flash(const char *filename, FlashContent *content)
 		return ERR_FILE_OPEN;
 	}
 
+	ret = tnsp_fread_flash(f, content);
+	fclose(f);
+	if (ret)
+		tifiles_content_delete_flash(content);
+
+	return ret;
+}
+
+/*
+  Read the header of an OS file (version and size of data). The header is
+  part of the data hence the bytes read are kept (no rewind is needed).
+  - head [out]: a buffer of TNSP_HEADER_MAX bytes
+  - [out]: the length of header or -1 if error.
+*/
+#define TNSP_HEADER_MAX	128
+
+static int tnsp_fgetc_header(FILE *f, char *head, int *n)
+{
+	int c;
+
+	if (*n == TNSP_HEADER_MAX - 1 || (c = fgetc(f)) == EOF)
+		return EOF;
+	head[(*n)++] = c;
+
+	return c;
+}
+
+static int tnsp_fread_flash_header(FILE *f, FlashContent *content, char *head)
+{
+	int c, n = 0, len;
+
 	content->model = CALC_NSPIRE;
-	for(c = 0; c != ' '; c=fgetc(f));
-	content->revision_major = fgetc(f);
-	fgetc(f);
-	content->revision_minor = fgetc(f);
-	fgetc(f);
-
-	for(c = 0; c != ' '; c=fgetc(f));
-	if (fscanf(f, "%i", &(content->data_length)) < 1)
+	for(c = 0; c != ' ' && c != EOF; c=tnsp_fgetc_header(f, head, &n));
+	content->revision_major = tnsp_fgetc_header(f, head, &n);
+	tnsp_fgetc_header(f, head, &n);
+	content->revision_minor = tnsp_fgetc_header(f, head, &n);
+	tnsp_fgetc_header(f, head, &n);
+
+	for(c = 0; c != ' ' && c != EOF; c=tnsp_fgetc_header(f, head, &n));
+	if (c == EOF)
+		return -1;
+
+	// the length ends with the first char which is not part of a number
+	len = n;
+	do c = tnsp_fgetc_header(f, head, &n); while (c != EOF && isspace(c));
+	while (c != EOF && isalnum(c)) c = tnsp_fgetc_header(f, head, &n);
+	head[n] = '\0';
+	if (sscanf(head + len, "%i", &(content->data_length)) < 1)
+		return -1;
+
+	// the data (header included) must be in the file
+	if (content->data_length < (uint32_t)n || fcheck_length(f, content->data_length - n) < 0)
+		return -1;
+
+	return n;
+}
+
+/**
+ * tnsp_fread_flash:
+ * @f: a stream opened for reading and positioned at the start of file.
+ * @content: where to store the file content.
+ *
+ * Same as #tnsp_file_read_flash but read from an already opened stream
+ * (which is not closed). The content is not released on error.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int tnsp_fread_flash(FILE *f, FlashContent *content)
+{
+	char head[TNSP_HEADER_MAX];
+	int n;
+
+	n = tnsp_fread_flash_header(f, content, head);
+	if (n < 0)
 	{
 		goto tfrf;
 	}
-	rewind(f);
 
 	content->data_part = (uint8_t *)g_malloc0(content->data_length);
 	if (content->data_part == NULL) 
 	{
-		fclose(f);
-		tifiles_content_delete_flash(content);
 		return ERR_MALLOC;
 	}
 
 	content->next = NULL;
-	if(fread(content->data_part, 1, content->data_length, f) < content->data_length) goto tfrf;
+	memcpy(content->data_part, head, n);
+	if(fread(content->data_part + n, 1, content->data_length - n, f) < content->data_length - n) goto tfrf;
 
-	fclose(f);
 	return 0;
 
-tfrf:	// release on exit
-	fclose(f);
-	tifiles_content_delete_flash(content);
+tfrf:	// error on exit
 	return ERR_FILE_IO;
 }
 
+/**
+ * tnsp_file_open_flash:
+ * @filename: name of OS file to open.
+ * @stream: where to store the header and the means to access data.
+ *
+ * Read the header of an OS file and map the file into memory (or keep it
+ * opened if it can't be mapped) for #tifiles_file_read_flash_block.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int tnsp_file_open_flash(const char *filename, FlashStream *stream)
+{
+	FILE *f;
+	size_t len;
+	char head[TNSP_HEADER_MAX];
+
+	if (!tifiles_file_is_tno(filename))
+		return ERR_INVALID_FILE;
+
+	f = g_fopen(filename, "rb");
+	if (f == NULL) 
+	{
+		tifiles_info("Unable to open this file: %s\n", filename);
+		return ERR_FILE_OPEN;
+	}
+
+	if (tnsp_fread_flash_header(f, stream->content, head) < 0 || fseeko(f, 0, SEEK_SET))
+	{
+		fclose(f);
+		return ERR_INVALID_FILE;
+	}
+
+	// data is read from the mapping if possible
+	stream->map = fopen_map(filename, &stream->data, &len);
+	if (stream->map != NULL && len >= stream->content->data_length)
+	{
+		fclose(f);
+		return 0;
+	}
+	if (stream->map != NULL)
+	{
+		fclose_map(stream->map);
+		stream->map = NULL;
+	}
+
+	stream->f = f;
+	return 0;
+}
+
 /***********/
 /* Writing */
 /***********/
@@ -190,6 +379,8 @@ int tnsp_file_write_regular(const char *fname, FileContent *content, char **real
 {
   FILE *f;
   char *filename = NULL;
+  char *tmpname;
+  int ret;
 
   if (fname != NULL) 
   {
@@ -206,28 +397,92 @@ int tnsp_file_write_regular(const char *fname, FileContent *content, char **real
 		*real_fname = g_strdup(filename);
   }
 
-  f = g_fopen(filename, "wb");
+  f = fopen_atomic(filename, &tmpname);
   if (f == NULL) 
   {
     tifiles_info( "Unable to open this file: %s", filename);
     g_free(filename);
     return ERR_FILE_OPEN;
   }
+
+  ret = tnsp_fwrite_regular(f, content);
+  if(fclose_atomic(f, filename, tmpname, !ret) && !ret)
+    ret = ERR_FILE_CLOSE;
+
   g_free(filename);
+  return ret;
+}
+
+/**
+ * tnsp_fwrite_regular:
+ * @f: a stream opened for writing.
+ * @content: the file content to write.
+ *
+ * Same as #tnsp_file_write_regular but write to an already opened stream
+ * (which is not closed). Used to build files in memory.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int tnsp_fwrite_regular(FILE *f, FileContent *content)
+{
+  VarEntry *entry = content->entries[0];
+
+  if(fwrite(entry->data, 1, entry->size, f) < entry->size) 
+    return ERR_FILE_IO;
+
+  return 0;
+}
 
+/**
+ * tnsp_file_copy_regular:
+ * @src_filename: name of file to copy.
+ * @dst_filename: name of file where to write.
+ *
+ * Copy a document as is (documents are opaque to this library). Data is
+ * copied by the kernel when possible (see fcopy) and the destination is
+ * written atomically like with #tnsp_file_write_regular.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+int tnsp_file_copy_regular(const char *src_filename, const char *dst_filename)
+{
+  FILE *fi, *fo;
+  char *tmpname;
+  foff_t size;
+  int ret = 0;
+
+  if (!tifiles_file_is_regular(src_filename))
+    return ERR_INVALID_FILE;
+
+  fi = g_fopen(src_filename, "rb");
+  if (fi == NULL) 
   {
-	  VarEntry *entry = content->entries[0];
-		
-	  if(fwrite(entry->data, 1, entry->size, f) < entry->size) 
-		  goto tfwr;
+    tifiles_info( "Unable to open this file: %s", src_filename);
+    return ERR_FILE_OPEN;
   }
 
-  fclose(f);
-  return 0;
+  if ((size = fsize(fi)) < 0)
+  {
+    fclose(fi);
+    return ERR_FILE_IO;
+  }
 
-tfwr:	// release on exit
-    fclose(f);
-	return ERR_FILE_IO;
+  fo = fopen_atomic(dst_filename, &tmpname);
+  if (fo == NULL) 
+  {
+    tifiles_info( "Unable to open this file: %s", dst_filename);
+    fclose(fi);
+    return ERR_FILE_OPEN;
+  }
+
+  if (fcopy(fo, fi, (size_t)size))
+    ret = ERR_FILE_IO;
+  fclose(fi);
+
+  if(fclose_atomic(fo, dst_filename, tmpname, !ret) && !ret)
+    ret = ERR_FILE_CLOSE;
+
+  return ret;
 }
 
 /**************/
@@ -43,10 +43,19 @@ int tnsp_content_display_flash(FlashContent *content);
 int tnsp_file_read_regular(const char *filename, FileContent *content);
 int tnsp_file_read_flash(const char *filename, FlashContent *content);
 
+int tnsp_fread_regular(FILE *f, const char *filename, FileContent *content);
+int tnsp_fread_flash(FILE *f, FlashContent *content);
+
+int tnsp_file_map_regular(const char *filename, FileContent *content, void **map);
+int tnsp_file_open_flash(const char *filename, FlashStream *stream);
+
 // writing
+int tnsp_file_copy_regular(const char *src_filename, const char *dst_filename);
 int tnsp_file_write_regular(const char *filename, FileContent *content, char **filename2);
 int tnsp_file_write_flash(const char *filename, FileContent *content, char **filename2);
 
+int tnsp_fwrite_regular(FILE *f, FileContent *content);
+
 // displaying
 int tnsp_file_display(const char *filename);
 
@@ -28,6 +28,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+#ifdef __WIN32__
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 #include "tifiles.h"
 #include "error.h"
@@ -35,6 +43,7 @@
 #include "files9x.h"
 #include "filesnsp.h"
 #include "logging.h"
+#include "rwfile.h"
 
 /**
  * tifiles_content_create_regular:
@@ -51,7 +60,7 @@ TIEXPORT2 FileContent* TICALL tifiles_content_create_regular(CalcModel model)
 	if (content != NULL)
 	{
 		content->model = content->model_dst = model;
-		strcpy(content->comment, tifiles_comment_set_single());
+		tifiles_comment_set_single_r(content->comment);
 	}
 
 	return content;
@@ -137,7 +146,8 @@ TIEXPORT2 FileContent* TICALL tifiles_content_dup_regular(FileContent *content)
  * Load the single/group file into a FileContent structure.
  *
  * Structure content must be freed with #tifiles_content_delete_regular when
- * no longer used.
+ * no longer used. If an error occurs while reading, the structure content
+ * is released for you.
  *
  * Return value: an error code, 0 otherwise.
  **/
@@ -195,6 +205,176 @@ TIEXPORT2 int tifiles_file_write_regular(const char *filename, FileContent *cont
 	return 0;
 }
 
+/**
+ * tifiles_fread_regular:
+ * @f: a stream opened for reading and positioned at the file signature.
+ * @filename: name of the file held by the stream (gives the calculator model
+ * like with #tifiles_file_read_regular, and names TI-Nspire documents).
+ * @content: where to store the file content.
+ *
+ * Same as #tifiles_file_read_regular but read from an already opened stream
+ * (which is not closed). The stream is read forward only: it may be a pipe
+ * or a socket. TiGroup archives need random access and can't be read this
+ * way (ERR_UNSUPPORTED): use #tifiles_file_read_tigroup.
+ *
+ * Unlike #tifiles_file_read_regular, the content is not released on error:
+ * it must be freed with #tifiles_content_delete_regular in any case.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_fread_regular(FILE *f, const char *filename, FileContent *content)
+{
+	if (f == NULL || filename == NULL || content == NULL)
+	{
+		tifiles_critical("tifiles_fread_regular(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+
+	if (!g_ascii_strcasecmp(tifiles_fext_get(filename), "tig"))
+		return ERR_UNSUPPORTED;
+
+#if !defined(DISABLE_TI8X)
+	if (tifiles_calc_is_ti8x(tifiles_file_get_model(filename)))
+		return ti8x_fread_regular(f, (Ti8xRegular *)content);
+	else 
+#endif
+#if !defined(DISABLE_TI9X)
+	if (tifiles_calc_is_ti9x(tifiles_file_get_model(filename)))
+		return ti9x_fread_regular(f, (Ti9xRegular *)content);
+	else
+#endif
+	if(content->model == CALC_NSPIRE)
+		return tnsp_fread_regular(f, filename, (FileContent *)content);
+	else
+		return ERR_BAD_CALC;
+
+	return 0;
+}
+
+/**
+ * tifiles_fwrite_regular:
+ * @f: a stream opened for writing.
+ * @content: the file content to write.
+ *
+ * Same as #tifiles_file_write_regular but write to an already opened stream
+ * (which is not closed). The stream is written forward only: it may be a pipe
+ * or a socket.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_fwrite_regular(FILE *f, FileContent *content)
+{
+	if (f == NULL || content == NULL)
+	{
+		tifiles_critical("tifiles_fwrite_regular(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+
+#if !defined(DISABLE_TI8X)
+	if (tifiles_calc_is_ti8x(content->model))
+		return ti8x_fwrite_regular(f, (Ti8xRegular *)content);
+	else 
+#endif
+#if !defined(DISABLE_TI9X)
+	if (tifiles_calc_is_ti9x(content->model))
+		return ti9x_fwrite_regular(f, (Ti9xRegular *)content);
+	else
+#endif
+	if(content->model == CALC_NSPIRE)
+		return tnsp_fwrite_regular(f, (FileContent *)content);
+	else
+		return ERR_BAD_CALC;
+
+	return 0;
+}
+
+/**
+ * tifiles_file_map_regular:
+ * @filename: name of single/group file to open.
+ * @content: where to store the file content.
+ * @map: address of a pointer where to store the mapping (NULL if none).
+ *
+ * Same as #tifiles_file_read_regular but TI-Nspire documents are not copied:
+ * data of the entry points into a read-only mapping of the file. This data
+ * must not be modified, released or kept after #tifiles_file_unmap_regular.
+ * Other files (or documents which can't be mapped) are loaded as usual.
+ *
+ * Structure content must be freed with #tifiles_file_unmap_regular (and not
+ * #tifiles_content_delete_regular) when no longer used.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_map_regular(const char *filename, FileContent *content, void **map)
+{
+	if (map == NULL)
+	{
+		tifiles_critical("tifiles_file_map_regular(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+	*map = NULL;
+
+	if (tifiles_file_get_model(filename) == CALC_NSPIRE)
+		return tnsp_file_map_regular(filename, content, map);
+
+	return tifiles_file_read_regular(filename, content);
+}
+
+/**
+ * tifiles_file_unmap_regular:
+ * @content: a content loaded by #tifiles_file_map_regular.
+ * @map: the mapping returned by #tifiles_file_map_regular.
+ *
+ * Free the whole content and unmap the file.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_unmap_regular(FileContent *content, void *map)
+{
+	int i;
+
+	if (content != NULL && map != NULL)
+	{
+		// data belongs to the mapping
+		for (i = 0; i < content->num_entries; i++)
+		{
+			if (content->entries[i] != NULL)
+				content->entries[i]->data = NULL;
+		}
+	}
+
+	tifiles_content_delete_regular(content);
+	if (map != NULL)
+		fclose_map(map);
+
+	return 0;
+}
+
+/**
+ * tifiles_file_copy_regular:
+ * @src_filename: name of TI-Nspire document to copy.
+ * @dst_filename: name of file where to write.
+ *
+ * Copy a TI-Nspire document without loading it: data is copied by the
+ * kernel (copy_file_range or sendfile) when possible so that mirroring
+ * documents does not go through user space. The destination is written
+ * atomically like with #tifiles_file_write_regular.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_copy_regular(const char *src_filename, const char *dst_filename)
+{
+	if (src_filename == NULL || dst_filename == NULL)
+	{
+		tifiles_critical("tifiles_file_copy_regular(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+
+	if (tifiles_file_get_model(src_filename) == CALC_NSPIRE)
+		return tnsp_file_copy_regular(src_filename, dst_filename);
+
+	return ERR_BAD_CALC;
+}
+
 /**
  * tifiles_file_display_regular:
  * @content: the file content to show.
@@ -223,6 +403,138 @@ TIEXPORT2 int TICALL tifiles_file_display_regular(FileContent *content)
 	return 0;
 }
 
+/**
+ * tifiles_file_open_regular:
+ * @filename: name of single/group file to open.
+ * @index: address of a pointer where to store the allocated index.
+ *
+ * Read the table of entries of a single/group file without loading the
+ * variable data (TI-8x files have no table so packet headers are walked).
+ * Data of an entry is loaded on demand with #tifiles_file_load_entry
+ * so that accessing a few variables of a huge group file is cheap.
+ *
+ * The index must be freed with #tifiles_file_close_regular when no longer used.
+ * If error occurs, the index is released for you.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_open_regular(const char *filename, FileIndex **index)
+{
+	FileIndex *fi;
+	CalcModel model = tifiles_file_get_model(filename);
+	int ret;
+
+	if (index == NULL)
+	{
+		tifiles_critical("tifiles_file_open_regular(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+	*index = NULL;
+
+	fi = g_malloc0(sizeof(FileIndex));
+	if (fi == NULL)
+		return ERR_MALLOC;
+	fi->filename = g_strdup(filename);
+	fi->content = tifiles_content_create_regular(CALC_NONE);
+	if (fi->content == NULL)
+	{
+		tifiles_file_close_regular(fi);
+		return ERR_MALLOC;
+	}
+
+#if !defined(DISABLE_TI8X)
+	if (tifiles_calc_is_ti8x(model))
+		ret = ti8x_file_index_regular(filename, fi);
+	else 
+#endif
+#if !defined(DISABLE_TI9X)
+	if (tifiles_calc_is_ti9x(model))
+		ret = ti9x_file_index_regular(filename, fi);
+	else
+#endif
+		ret = ERR_BAD_CALC;
+
+	if (ret)
+	{
+		tifiles_file_close_regular(fi);
+		return ret;
+	}
+
+	*index = fi;
+	return 0;
+}
+
+/**
+ * tifiles_file_load_entry:
+ * @index: an index returned by #tifiles_file_open_regular.
+ * @ve: an entry of the indexed content.
+ *
+ * Load the data of an entry if not already loaded. Only the data of this
+ * entry is read from file.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_load_entry(FileIndex *index, VarEntry *ve)
+{
+	FileContent *content;
+	int i;
+
+	if (index == NULL || ve == NULL)
+	{
+		tifiles_critical("tifiles_file_load_entry(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+
+	content = index->content;
+	for (i = 0; i < content->num_entries; i++)
+		if (content->entries[i] == ve)
+			break;
+	if (i == content->num_entries)
+		return ERR_INVALID_FILE;
+
+	if (ve->data != NULL)
+		return 0;
+
+#if !defined(DISABLE_TI8X)
+	if (tifiles_calc_is_ti8x(content->model))
+		return ti8x_file_load_entry(index, i);
+	else 
+#endif
+#if !defined(DISABLE_TI9X)
+	if (tifiles_calc_is_ti9x(content->model))
+		return ti9x_file_load_entry(index, i);
+	else
+#endif
+	return ERR_BAD_CALC;
+
+	return 0;
+}
+
+/**
+ * tifiles_file_close_regular:
+ * @index: an index returned by #tifiles_file_open_regular.
+ *
+ * Close the file and free the index with its content (including loaded data).
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_close_regular(FileIndex *index)
+{
+	int ret = 0;
+
+	if (index != NULL)
+	{
+		if (index->f != NULL && fclose(index->f))
+			ret = ERR_FILE_CLOSE;
+		tifiles_content_delete_regular(index->content);
+		g_free(index->offsets);
+		g_free(index->filename);
+		g_free(index);
+	}
+
+	return ret;
+}
+
 /**
  * tifiles_content_create_backup:
  * @model: a calculator model or CALC_NONE.
@@ -238,7 +550,7 @@ TIEXPORT2 BackupContent* TICALL tifiles_content_create_backup(CalcModel model)
 	if (content != NULL)
 	{
 		content->model = model;
-		strcpy(content->comment, tifiles_comment_set_backup());
+		tifiles_comment_set_backup_r(content->comment);
 	}
 
 	return content;
@@ -249,6 +561,9 @@ TIEXPORT2 BackupContent* TICALL tifiles_content_create_backup(CalcModel model)
  *
  * Free the whole content of a BackupContent structure.
  *
+ * The data parts of a TI8x backup read from file are released all at once
+ * with #BackupContent.data_block (see #BackupContent).
+ *
  * Return value: none.
  **/
 TIEXPORT2 int TICALL tifiles_content_delete_backup(BackupContent *content)
@@ -257,6 +572,8 @@ TIEXPORT2 int TICALL tifiles_content_delete_backup(BackupContent *content)
 	{
 		if (tifiles_calc_is_ti9x(content->model))
 			g_free(content->data_part);
+		else if (tifiles_calc_is_ti8x(content->model) && content->data_block != NULL)
+			g_free(content->data_block);
 		else if (tifiles_calc_is_ti8x(content->model))
 		{
 			g_free(content->data_part1);
@@ -283,7 +600,8 @@ TIEXPORT2 int TICALL tifiles_content_delete_backup(BackupContent *content)
  * Load the backup file into a BackupContent structure.
  *
  * Structure content must be freed with #tifiles_content_delete_backup when
- * no longer used.
+ * no longer used. If an error occurs while reading, the structure content
+ * is released for you.
  *
  * Return value: an error code, 0 otherwise.
  **/
@@ -331,23 +649,70 @@ TIEXPORT2 int tifiles_file_write_backup(const char *filename, BackupContent *con
 }
 
 /**
- * tifiles_file_display_backup:
- * @content: the file content to show.
+ * tifiles_fread_backup:
+ * @f: a stream opened for reading and positioned at the file signature.
+ * @filename: name of the file held by the stream (gives the calculator model
+ * like with #tifiles_file_read_backup).
+ * @content: where to store the file content.
  *
- * Display file content informations.
+ * Same as #tifiles_file_read_backup but read from an already opened stream
+ * (which is not closed). The stream is read forward only: it may be a pipe
+ * or a socket.
+ *
+ * Unlike #tifiles_file_read_backup, the content is not released on error:
+ * it must be freed with #tifiles_content_delete_backup in any case.
  *
  * Return value: an error code, 0 otherwise.
  **/
-TIEXPORT2 int TICALL tifiles_file_display_backup(BackupContent *content)
+TIEXPORT2 int TICALL tifiles_fread_backup(FILE *f, const char *filename, BackupContent *content)
 {
+	if (f == NULL || filename == NULL || content == NULL)
+	{
+		tifiles_critical("tifiles_fread_backup(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+
 #if !defined(DISABLE_TI8X)
-	if (tifiles_calc_is_ti8x(content->model))
-		return ti8x_content_display_backup(content);
-	else 
+	if (tifiles_calc_is_ti8x(tifiles_file_get_model(filename)))
+		return ti8x_fread_backup(f, content);
+	else
+#endif 
+#if !defined(DISABLE_TI9X)
+	if (tifiles_calc_is_ti9x(tifiles_file_get_model(filename)))
+		return ti9x_fread_backup(f, content);
+	else
 #endif
+	return ERR_BAD_CALC;
+
+	return 0;
+}
+
+/**
+ * tifiles_fwrite_backup:
+ * @f: a stream opened for writing.
+ * @content: the file content to write.
+ *
+ * Same as #tifiles_file_write_backup but write to an already opened stream
+ * (which is not closed).
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_fwrite_backup(FILE *f, BackupContent *content)
+{
+	if (f == NULL || content == NULL)
+	{
+		tifiles_critical("tifiles_fwrite_backup(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+
+#if !defined(DISABLE_TI8X)
+	if (tifiles_calc_is_ti8x(content->model))
+		return ti8x_fwrite_backup(f, content);
+	else
+#endif 
 #if !defined(DISABLE_TI9X)
 	if (tifiles_calc_is_ti9x(content->model))
-		return ti9x_content_display_backup(content);
+		return ti9x_fwrite_backup(f, content);
 	else
 #endif
 	return ERR_BAD_CALC;
@@ -356,64 +721,313 @@ TIEXPORT2 int TICALL tifiles_file_display_backup(BackupContent *content)
 }
 
 /**
- * tifiles_content_create_flash:
- * @model: a calculator model (compulsory).
+ * tifiles_file_open_backup:
+ * @filename: name of backup file to open.
+ * @stream: address of a pointer where to store the allocated stream.
  *
- * Allocates a #FlashContent structure.
+ * Read the header of a backup file without loading its data, which is read
+ * block by block with #tifiles_file_read_backup_block. Only TI-9x backups
+ * are supported.
  *
- * Return value: the allocated block.
+ * The stream must be freed with #tifiles_file_close_backup when no longer used.
+ * If error occurs, the stream is released for you.
+ *
+ * Return value: an error code, 0 otherwise.
  **/
-TIEXPORT2 FlashContent* TICALL tifiles_content_create_flash(CalcModel model)
+TIEXPORT2 int TICALL tifiles_file_open_backup(const char *filename, BackupStream **stream)
 {
-	FlashContent* content = g_malloc0(sizeof(FlashContent));
+	BackupStream *bs;
+	int ret;
 
-	if (content != NULL)
+	if (stream == NULL)
 	{
-		content->model = model;
-		if(tifiles_calc_is_ti9x(content->model))
-		{
-			time_t tt;
-			struct tm *lt;
+		tifiles_critical("tifiles_file_open_backup(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+	*stream = NULL;
 
-			time(&tt);
-			lt = localtime(&tt);
-			content->revision_major = 1;
-			content->revision_minor = 0;
-			content->flags = 0;
-			content->object_type = 0;
-			content->revision_day = lt->tm_mday;
-			content->revision_month = lt->tm_mon;
-			content->revision_year = lt->tm_year + 1900;
-		}
+	bs = g_malloc0(sizeof(BackupStream));
+	if (bs == NULL)
+		return ERR_MALLOC;
+	bs->filename = g_strdup(filename);
+	bs->content = tifiles_content_create_backup(CALC_NONE);
+
+#if !defined(DISABLE_TI9X)
+	if (tifiles_calc_is_ti9x(tifiles_file_get_model(filename)))
+		ret = ti9x_file_open_backup(filename, bs);
+	else
+#endif
+	ret = ERR_BAD_CALC;
+
+	if (ret)
+	{
+		if (bs->f != NULL)
+			fclose(bs->f);
+		tifiles_content_delete_backup(bs->content);
+		g_free(bs->filename);
+		g_free(bs);
+		return ret;
 	}
 
-	return content;
+	*stream = bs;
+	return 0;
 }
 
 /**
- * tifiles_content_delete_flash:
+ * tifiles_file_read_backup_block:
+ * @stream: a stream returned by #tifiles_file_open_backup.
+ * @size: maximum size of block.
+ * @block: address of a pointer where to store the address of block.
+ * @length: where to store the size of block (0 at end of data).
  *
- * Free the whole content of a #FlashContent structure.
+ * Get the next block of data of a backup file. The block is owned by the
+ * stream and is valid until the next call or until the stream is closed.
+ * The running checksum of data is kept in the stream and is checked against
+ * the one of file with the last block.
  *
- * Return value: none.
+ * Return value: an error code, 0 otherwise.
  **/
-TIEXPORT2 int TICALL tifiles_content_delete_flash(FlashContent *content)
+TIEXPORT2 int TICALL tifiles_file_read_backup_block(BackupStream *stream, uint32_t size, const uint8_t **block, uint32_t *length)
 {
-	int i;
-	if (content != NULL)
+	if (stream == NULL || block == NULL || length == NULL)
 	{
-#if !defined(DISABLE_TI8X) && !defined(DISABLE_TI9X)
-		{
-			FlashContent *ptr;
-
-			g_free(content->data_part);
+		tifiles_critical("tifiles_file_read_backup_block(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
 
-			ptr = content->next;
-			while (ptr != NULL) 
-			{
-				FlashContent *next = ptr->next;
+#if !defined(DISABLE_TI9X)
+	if (tifiles_calc_is_ti9x(stream->content->model))
+		return ti9x_file_read_backup_block(stream, size, block, length);
+	else
+#endif
+	return ERR_BAD_CALC;
+}
 
-				g_free(ptr->data_part);
+/**
+ * tifiles_file_create_backup:
+ * @filename: name of backup file where to write.
+ * @content: the header to write (data_part is not used, data_length may be 0 if unknown).
+ * @stream: address of a pointer where to store the allocated stream.
+ *
+ * Start writing a backup file whose data is given block by block with
+ * #tifiles_file_write_backup_block. The file is written atomically: it
+ * replaces the destination only when closed without error.
+ * Only TI-9x backups are supported.
+ *
+ * The stream must be freed with #tifiles_file_close_backup when no longer used.
+ * If error occurs, the stream is released for you.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_create_backup(const char *filename, BackupContent *content, BackupStream **stream)
+{
+	BackupStream *bs;
+	int ret;
+
+	if (content == NULL || stream == NULL)
+	{
+		tifiles_critical("tifiles_file_create_backup(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+	*stream = NULL;
+
+	bs = g_malloc0(sizeof(BackupStream));
+	if (bs == NULL)
+		return ERR_MALLOC;
+	bs->filename = g_strdup(filename);
+	bs->content = tifiles_content_create_backup(content->model);
+	if (bs->content != NULL)
+	{
+		memcpy(bs->content, content, sizeof(BackupContent));
+		bs->content->data_part = NULL;
+		bs->content->data_part1 = bs->content->data_part2 = NULL;
+		bs->content->data_part3 = bs->content->data_part4 = NULL;
+		bs->content->data_block = NULL;
+	}
+
+#if !defined(DISABLE_TI9X)
+	if (tifiles_calc_is_ti9x(content->model))
+		ret = ti9x_file_create_backup(filename, bs);
+	else
+#endif
+	ret = ERR_BAD_CALC;
+
+	if (ret)
+	{
+		if (bs->f == NULL)
+		{
+			tifiles_content_delete_backup(bs->content);
+			g_free(bs->filename);
+			g_free(bs);
+		}
+		else
+		{
+			bs->err = ret;
+			tifiles_file_close_backup(bs);
+		}
+		return ret;
+	}
+
+	*stream = bs;
+	return 0;
+}
+
+/**
+ * tifiles_file_write_backup_block:
+ * @stream: a stream returned by #tifiles_file_create_backup.
+ * @block: data to write.
+ * @length: size of data.
+ *
+ * Append a block of data to a backup file. If error occurs, the file will
+ * be discarded by #tifiles_file_close_backup.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_write_backup_block(BackupStream *stream, const uint8_t *block, uint32_t length)
+{
+	int ret;
+
+	if (stream == NULL || block == NULL)
+	{
+		tifiles_critical("tifiles_file_write_backup_block(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+	if (stream->err)
+		return stream->err;
+
+#if !defined(DISABLE_TI9X)
+	if (tifiles_calc_is_ti9x(stream->content->model))
+		ret = ti9x_file_write_backup_block(stream, block, length);
+	else
+#endif
+	ret = ERR_BAD_CALC;
+
+	stream->err = ret;
+	return ret;
+}
+
+/**
+ * tifiles_file_close_backup:
+ * @stream: a stream returned by #tifiles_file_open_backup or #tifiles_file_create_backup.
+ *
+ * Close the file and free the stream. When writing, the checksum of data
+ * is appended and the file replaces the destination unless an error occurred
+ * or the size of data differs from the data_length given in header (if the
+ * size was unknown, the header is updated with the actual size).
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_close_backup(BackupStream *stream)
+{
+	int ret = 0;
+
+	if (stream == NULL)
+	{
+		tifiles_critical("tifiles_file_close_backup(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+
+#if !defined(DISABLE_TI9X)
+	if (tifiles_calc_is_ti9x(stream->content->model))
+		ret = ti9x_file_close_backup(stream);
+#endif
+
+	tifiles_content_delete_backup(stream->content);
+	g_free(stream->buffer);
+	g_free(stream->filename);
+	g_free(stream);
+
+	return ret;
+}
+
+/**
+ * tifiles_file_display_backup:
+ * @content: the file content to show.
+ *
+ * Display file content informations.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_display_backup(BackupContent *content)
+{
+#if !defined(DISABLE_TI8X)
+	if (tifiles_calc_is_ti8x(content->model))
+		return ti8x_content_display_backup(content);
+	else 
+#endif
+#if !defined(DISABLE_TI9X)
+	if (tifiles_calc_is_ti9x(content->model))
+		return ti9x_content_display_backup(content);
+	else
+#endif
+	return ERR_BAD_CALC;
+
+	return 0;
+}
+
+/**
+ * tifiles_content_create_flash:
+ * @model: a calculator model (compulsory).
+ *
+ * Allocates a #FlashContent structure.
+ *
+ * Return value: the allocated block.
+ **/
+TIEXPORT2 FlashContent* TICALL tifiles_content_create_flash(CalcModel model)
+{
+	FlashContent* content = g_malloc0(sizeof(FlashContent));
+
+	if (content != NULL)
+	{
+		content->model = model;
+		if(tifiles_calc_is_ti9x(content->model))
+		{
+			time_t tt;
+			struct tm lt;
+
+			time(&tt);
+#ifdef __WIN32__
+			lt = *localtime(&tt);	// thread-local storage in the C runtime
+#else
+			localtime_r(&tt, &lt);
+#endif
+			content->revision_major = 1;
+			content->revision_minor = 0;
+			content->flags = 0;
+			content->object_type = 0;
+			content->revision_day = lt.tm_mday;
+			content->revision_month = lt.tm_mon;
+			content->revision_year = lt.tm_year + 1900;
+		}
+	}
+
+	return content;
+}
+
+/**
+ * tifiles_content_delete_flash:
+ *
+ * Free the whole content of a #FlashContent structure.
+ *
+ * Return value: none.
+ **/
+TIEXPORT2 int TICALL tifiles_content_delete_flash(FlashContent *content)
+{
+	int i;
+	if (content != NULL)
+	{
+#if !defined(DISABLE_TI8X) && !defined(DISABLE_TI9X)
+		{
+			FlashContent *ptr;
+
+			g_free(content->data_part);
+
+			ptr = content->next;
+			while (ptr != NULL) 
+			{
+				FlashContent *next = ptr->next;
+
+				g_free(ptr->data_part);
 				g_free(ptr);
 
 				for(i = 0; i < content->num_pages; i++)
@@ -448,7 +1062,8 @@ TIEXPORT2 int TICALL tifiles_content_delete_flash(FlashContent *content)
  * Load the FLASH file into a FlashContent structure.
  *
  * Structure content must be freed with #tifiles_content_delete_flash when
- * no longer used.
+ * no longer used. If an error occurs while reading, the structure content
+ * is released for you.
  *
  * Return value: an error code, 0 otherwise.
  **/
@@ -472,6 +1087,136 @@ TIEXPORT2 int tifiles_file_read_flash(const char *filename, FlashContent *conten
 	return 0;
 }
 
+/**
+ * tifiles_file_open_flash:
+ * @filename: name of FLASH file to open.
+ * @stream: address of a pointer where to store the allocated stream.
+ *
+ * Read the header of a FLASH file without loading its data, which is read 
+ * block by block with #tifiles_file_read_flash_block. The file is mapped 
+ * into memory when possible so that blocks are not even copied. 
+ * Only TI-Nspire OS files are supported.
+ *
+ * The stream must be freed with #tifiles_file_close_flash when no longer used.
+ * If error occurs, the stream is released for you.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_open_flash(const char *filename, FlashStream **stream)
+{
+	FlashStream *fs;
+	int ret;
+
+	if (stream == NULL)
+	{
+		tifiles_critical("tifiles_file_open_flash(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+	*stream = NULL;
+
+	fs = g_malloc0(sizeof(FlashStream));
+	if (fs == NULL)
+		return ERR_MALLOC;
+	fs->filename = g_strdup(filename);
+	fs->content = tifiles_content_create_flash(CALC_NONE);
+
+	if (tifiles_file_get_model(filename) == CALC_NSPIRE)
+		ret = tnsp_file_open_flash(filename, fs);
+	else
+		ret = ERR_BAD_CALC;
+
+	if (ret)
+	{
+		tifiles_file_close_flash(fs);
+		return ret;
+	}
+
+	*stream = fs;
+	return 0;
+}
+
+/**
+ * tifiles_file_read_flash_block:
+ * @stream: a stream returned by #tifiles_file_open_flash.
+ * @size: maximum size of block.
+ * @block: address of a pointer where to store the address of block.
+ * @length: where to store the size of block (0 at end of data).
+ *
+ * Get the next block of data of a FLASH file. The block is owned by the 
+ * stream and is valid until the next call or until the stream is closed.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_read_flash_block(FlashStream *stream, uint32_t size, const uint8_t **block, uint32_t *length)
+{
+	uint32_t n;
+
+	if (stream == NULL || block == NULL || length == NULL)
+	{
+		tifiles_critical("tifiles_file_read_flash_block(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+
+	n = stream->content->data_length - stream->offset;
+	if (n > size)
+		n = size;
+
+	if (stream->map != NULL)
+	{
+		*block = stream->data + stream->offset;
+	}
+	else
+	{
+		if (n > stream->buffer_size)
+		{
+			g_free(stream->buffer);
+			stream->buffer = g_malloc(n);
+			if (stream->buffer == NULL)
+			{
+				stream->buffer_size = 0;
+				return ERR_MALLOC;
+			}
+			stream->buffer_size = n;
+		}
+
+		if (fread(stream->buffer, 1, n, stream->f) < n)
+			return ERR_FILE_IO;
+		*block = stream->buffer;
+	}
+
+	stream->offset += n;
+	*length = n;
+
+	return 0;
+}
+
+/**
+ * tifiles_file_close_flash:
+ * @stream: a stream returned by #tifiles_file_open_flash.
+ *
+ * Close the file and free the stream with its content.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_close_flash(FlashStream *stream)
+{
+	int ret = 0;
+
+	if (stream != NULL)
+	{
+		if (stream->map != NULL)
+			fclose_map(stream->map);
+		if (stream->f != NULL && fclose(stream->f))
+			ret = ERR_FILE_CLOSE;
+		tifiles_content_delete_flash(stream->content);
+		g_free(stream->buffer);
+		g_free(stream->filename);
+		g_free(stream);
+	}
+
+	return ret;
+}
+
 /**
  * tifiles_file_write_flash2:
  * @filename: name of flash file where to write or NULL.
@@ -522,6 +1267,92 @@ TIEXPORT2 int tifiles_file_write_flash(const char *filename, FlashContent *conte
 	return tifiles_file_write_flash2(filename, content, NULL);
 }
 
+/**
+ * tifiles_fread_flash:
+ * @f: a stream opened for reading and positioned at the file signature.
+ * @filename: name of the file held by the stream (gives the calculator model
+ * like with #tifiles_file_read_flash).
+ * @content: where to store the file content.
+ *
+ * Same as #tifiles_file_read_flash but read from an already opened stream
+ * (which is not closed). The stream is read forward only: it may be a pipe
+ * or a socket. TiGroup archives need random access and can't be read this
+ * way (ERR_UNSUPPORTED): use #tifiles_file_read_tigroup.
+ *
+ * Unlike #tifiles_file_read_flash, the content is not released on error:
+ * it must be freed with #tifiles_content_delete_flash in any case.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_fread_flash(FILE *f, const char *filename, FlashContent *content)
+{
+	CalcModel model;
+	int tib;
+
+	if (f == NULL || filename == NULL || content == NULL)
+	{
+		tifiles_critical("tifiles_fread_flash(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+
+	// the stream can't be read twice: tib files are told by extension
+	if (!g_ascii_strcasecmp(tifiles_fext_get(filename), "tig"))
+		return ERR_UNSUPPORTED;
+	model = tifiles_file_get_model(filename);
+	tib = !g_ascii_strcasecmp(tifiles_fext_get(filename), "tib");
+
+#if !defined(DISABLE_TI8X)
+	if (tifiles_calc_is_ti8x(model))
+		return ti8x_fread_flash(f, model, content);
+	else 
+#endif
+#if !defined(DISABLE_TI9X)
+	if (tifiles_calc_is_ti9x(model) || tib)
+		return ti9x_fread_flash(f, model, tib, content);
+	else
+#endif
+	if(content->model == CALC_NSPIRE)
+		return tnsp_fread_flash(f, content);
+	else
+		return ERR_BAD_CALC;
+
+	return 0;
+}
+
+/**
+ * tifiles_fwrite_flash:
+ * @f: a stream opened for writing.
+ * @content: the file content to write.
+ *
+ * Same as #tifiles_file_write_flash but write to an already opened stream
+ * (which is not closed). The stream is written forward only: it may be a pipe
+ * or a socket.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_fwrite_flash(FILE *f, FlashContent *content)
+{
+	if (f == NULL || content == NULL)
+	{
+		tifiles_critical("tifiles_fwrite_flash(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+
+#if !defined(DISABLE_TI8X)
+	if (tifiles_calc_is_ti8x(content->model))
+		return ti8x_fwrite_flash(f, content);
+	else 
+#endif
+#if !defined(DISABLE_TI9X)
+	if (tifiles_calc_is_ti9x(content->model))
+		return ti9x_fwrite_flash(f, content);
+	else
+#endif
+	return ERR_BAD_CALC;
+
+	return 0;
+}
+
 /**
  * tifiles_content_dup_flash:
  *
@@ -635,6 +1466,444 @@ TIEXPORT2 int TICALL tifiles_file_display(const char *filename)
 	return 0;
 }
 
+/*********/
+/* Batch */
+/*********/
+
+/**
+ * tifiles_batch_create:
+ *
+ * Allocates a #FileBatch structure used to write many files and make them
+ * durable at once (see #tifiles_batch_add_file).
+ *
+ * Return value: the allocated block.
+ **/
+TIEXPORT2 FileBatch* TICALL tifiles_batch_create(void)
+{
+	return g_malloc0(sizeof(FileBatch));
+}
+
+/**
+ * tifiles_batch_add_file:
+ * @batch: a batch.
+ * @filename: name of the file to write.
+ *
+ * Add a file to the batch. The returned name of a temporary file (placed in
+ * the same folder) must be passed to the tifiles_file_write_* function instead
+ * of %filename. Files are renamed when the batch is committed.
+ *
+ * Return value: the name of the file to write (owned by the batch) or NULL.
+ **/
+TIEXPORT2 const char* TICALL tifiles_batch_add_file(FileBatch *batch, const char *filename)
+{
+	char *tmpname;
+	int fd;
+
+	if (batch == NULL || filename == NULL)
+	{
+		tifiles_critical("tifiles_batch_add_file(NULL)\n");
+		return NULL;
+	}
+
+	// reserve the name
+	fd = fcreate_sibling(filename, &tmpname);
+	if (fd == -1)
+	{
+		tifiles_info("Unable to open this file: %s", filename);
+		return NULL;
+	}
+	close(fd);
+
+	batch->filenames = g_realloc(batch->filenames, (batch->n_files + 1) * sizeof(char *));
+	batch->tmpnames = g_realloc(batch->tmpnames, (batch->n_files + 1) * sizeof(char *));
+	batch->filenames[batch->n_files] = g_strdup(filename);
+	batch->tmpnames[batch->n_files] = tmpname;
+	batch->n_files++;
+
+	return tmpname;
+}
+
+/**
+ * tifiles_batch_commit:
+ * @batch: a batch.
+ *
+ * Flush the written files to disk, rename them to their final names, and
+ * flush each folder once. The batch is freed.
+ *
+ * Each file is still flushed (fsync) but writing of all files is started
+ * before waiting for the first one (with sync_file_range where available) so
+ * that the flushes mostly wait for data which is already being written.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_batch_commit(FileBatch *batch)
+{
+	char **dirs;
+	int n_dirs = 0;
+	int i, j;
+	int ret = 0;
+
+	if (batch == NULL)
+	{
+		tifiles_critical("tifiles_batch_commit(NULL)\n");
+		return ERR_FILE_IO;
+	}
+
+	dirs = g_malloc0((batch->n_files + 1) * sizeof(char *));
+
+	// list folders
+	for (i = 0; i < batch->n_files; i++)
+	{
+		char *dir = g_path_get_dirname(batch->filenames[i]);
+
+		for (j = 0; j < n_dirs; j++)
+			if (!strcmp(dirs[j], dir))
+				break;
+		if (j == n_dirs)
+			dirs[n_dirs++] = dir;
+		else
+			g_free(dir);
+	}
+
+	// flush data (files which are not regular ones are written directly):
+	// writing of all files is started first so that waiting for each one
+	// does not wait for the disk again and again
+	for (i = 0; i < batch->n_files && !ret; i++)
+		if (strcmp(batch->tmpnames[i], batch->filenames[i]) && fsync_start(batch->tmpnames[i]))
+			ret = ERR_FILE_IO;
+	for (i = 0; i < batch->n_files && !ret; i++)
+		if (strcmp(batch->tmpnames[i], batch->filenames[i]) && fsync_file(batch->tmpnames[i]))
+			ret = ERR_FILE_IO;
+
+	// rename (or remove if failed)
+	for (i = 0; i < batch->n_files; i++)
+	{
+		if (fcommit_sibling(batch->tmpnames[i], batch->filenames[i], !ret) && !ret)
+			ret = ERR_FILE_IO;
+		g_free(batch->filenames[i]);
+	}
+
+	// and flush folders
+	for (j = 0; j < n_dirs; j++)
+	{
+		if (!ret && fsync_dir(dirs[j]))
+			ret = ERR_FILE_IO;
+		g_free(dirs[j]);
+	}
+
+	g_free(dirs);
+	g_free(batch->filenames);
+	g_free(batch->tmpnames);
+	g_free(batch);
+
+	return ret;
+}
+
+/**
+ * tifiles_batch_abort:
+ * @batch: a batch.
+ *
+ * Remove the written files and free the batch.
+ *
+ * Return value: an error code, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_batch_abort(FileBatch *batch)
+{
+	int i;
+
+	if (batch != NULL)
+	{
+		for (i = 0; i < batch->n_files; i++)
+		{
+			fcommit_sibling(batch->tmpnames[i], batch->filenames[i], 0);
+			g_free(batch->filenames[i]);
+		}
+		g_free(batch->filenames);
+		g_free(batch->tmpnames);
+		g_free(batch);
+	}
+
+	return 0;
+}
+
+/**************/
+/* Conversion */
+/**************/
+
+#define CONVERT_MEMORY	(64 << 20)
+
+typedef struct
+{
+	char*			dst;
+	int				err;
+	int				done;		// protected by mutex
+} ConvertFile;
+
+typedef struct
+{
+	char**			src;
+	const char*		dst_dir;
+	CalcModel		model;
+
+	ConvertFile*	files;
+	int				n_files;
+
+	size_t			max_memory;
+	size_t			in_flight;	// bytes reserved by workers, protected by mutex
+	int				next;		// index of next file to process, protected by mutex
+
+	GMutex			mutex;
+	GCond			cond;		// signaled when a file is done
+} ConvertJob;
+
+/*
+  Build the name of the converted file: the name of the source file in the 
+  destination folder with the extension of the target model. It only depends 
+  on the name and class of the source file so that names can be checked 
+  before files are converted.
+*/
+static char* convert_filename(ConvertJob *job, const char *src)
+{
+	char *base, *dot, *name, *dst;
+	const char *ext;
+
+	if(tifiles_file_is_group(src))
+		ext = tifiles_fext_of_group(job->model);
+	else
+		ext = tifiles_vartype2fext(job->model, 
+			tifiles_fext2vartype(tifiles_file_get_model(src), tifiles_fext_get(src)));
+
+	base = g_path_get_basename(src);
+	dot = strrchr(base, '.');
+	if(dot != NULL)
+		*dot = '\0';
+
+	name = g_strconcat(base, ".", ext, NULL);
+	dst = g_build_filename(job->dst_dir, name, NULL);
+	g_free(name);
+	g_free(base);
+
+	return dst;
+}
+
+/*
+  Read a file, convert it to the target model and write it.
+  - src [in]: source filename
+  - dst [in]: destination filename (see convert_filename)
+  - [out]: an error code, 0 otherwise.
+*/
+static int convert_file(ConvertJob *job, const char *src, const char *dst)
+{
+	CalcModel model = tifiles_file_get_model(src);
+	FileContent *content;
+	FILE *f;
+	int err;
+
+	if(!tifiles_file_is_regular(src))
+		return ERR_BAD_FILE;
+	if(!tifiles_calc_are_compat(model, job->model))
+		return ERR_BAD_CALC;
+
+	f = g_fopen(src, "rb");
+	if(f == NULL)
+		return ERR_FILE_OPEN;
+
+	// variable names are converted by the reader
+	content = tifiles_content_create_regular(model);
+	if(content == NULL)
+	{
+		fclose(f);
+		return ERR_MALLOC;
+	}
+	content->model_dst = job->model;
+
+	// unlike the file reader, the stream one never releases the content
+	err = tifiles_fread_regular(f, src, content);
+	fclose(f);
+	if(!err)
+	{
+		content->model = job->model;
+		err = tifiles_file_write_regular(dst, content, NULL);
+	}
+	tifiles_content_delete_regular(content);
+
+	return err;
+}
+
+static gpointer convert_worker(gpointer data)
+{
+	ConvertJob *job = (ConvertJob *)data;
+
+	for(;;)
+	{
+		ConvertFile *f;
+		struct stat st;
+		size_t size;
+		int i;
+
+		g_mutex_lock(&job->mutex);
+		i = job->next < job->n_files ? job->next++ : -1;
+		g_mutex_unlock(&job->mutex);
+		if(i < 0)
+			break;
+		f = &job->files[i];
+		if(f->done)
+			continue;	// rejected before starting
+
+		// a file is in memory twice: content and output buffer
+		size = g_stat(job->src[i], &st) ? 0 : 2 * (size_t)st.st_size;
+		if(size > job->max_memory)
+			size = job->max_memory;
+
+		g_mutex_lock(&job->mutex);
+		while(job->in_flight > 0 && job->in_flight + size > job->max_memory)
+			g_cond_wait(&job->cond, &job->mutex);
+		job->in_flight += size;
+		g_mutex_unlock(&job->mutex);
+
+		f->err = convert_file(job, job->src[i], f->dst);
+
+		g_mutex_lock(&job->mutex);
+		job->in_flight -= size;
+		f->done = 1;
+		g_cond_broadcast(&job->cond);
+		g_mutex_unlock(&job->mutex);
+	}
+
+	return NULL;
+}
+
+/**
+ * tifiles_convert_batch:
+ * @src_filenames: a NULL-terminated array of strings (list of files to convert).
+ * @dst_dir: folder where to write converted files.
+ * @model: the calculator model to convert files to.
+ * @options: conversion options or NULL for defaults.
+ *
+ * Convert regular files to another calculator model of the same family (such 
+ * as TI83 to TI84+): files are read, their variable names are converted and 
+ * they are written to @dst_dir with the extension of @model.
+ *
+ * Files which would be written to the same place (like a/prog.83p and 
+ * b/prog.83p) are not overwritten: the first one is converted and the others
+ * fail with ERR_FILE_OPEN.
+ *
+ * Files are converted concurrently by several threads. The number of files
+ * being converted at once is bounded so that they don't take more than
+ * @options->max_memory bytes. A failure doesn't stop the batch: the error 
+ * code of each file is stored in @options->errors and passed to @options->done 
+ * which is called by the calling thread in the order of @src_filenames.
+ *
+ * The GLib thread system must have been initialized (this is done by 
+ * #tifiles_library_init).
+ *
+ * Return value: the error code of the first file which could not be converted, 
+ * 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_convert_batch(char **src_filenames, const char *dst_dir, CalcModel model, ConvertOptions *options)
+{
+	ConvertOptions defaults;
+	ConvertJob job;
+	GHashTable *names;
+	GThread **threads;
+	int n_threads;
+	int ret = 0;
+	int i, n;
+
+	if (src_filenames == NULL || dst_dir == NULL)
+	{
+		tifiles_critical("tifiles_convert_batch(NULL)\n");
+		return ERR_INVALID_FILE;
+	}
+
+	if (options == NULL)
+	{
+		memset(&defaults, 0, sizeof(defaults));
+		options = &defaults;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.src = src_filenames;
+	job.dst_dir = dst_dir;
+	job.model = model;
+	job.max_memory = options->max_memory ? options->max_memory : CONVERT_MEMORY;
+	for(job.n_files = 0; src_filenames[job.n_files] != NULL; job.n_files++);
+	job.files = (ConvertFile *)g_malloc0((job.n_files + 1) * sizeof(ConvertFile));
+	g_mutex_init(&job.mutex);
+	g_cond_init(&job.cond);
+
+	// Destinations must be unique: files can't be written twice
+	names = g_hash_table_new(g_str_hash, g_str_equal);
+	for(i = 0; i < job.n_files; i++)
+	{
+		ConvertFile *f = &job.files[i];
+		const char *src = src_filenames[i];
+
+		if(!tifiles_file_is_regular(src) || 
+			!tifiles_calc_are_compat(tifiles_file_get_model(src), model))
+			continue;	// rejected by convert_file
+
+		f->dst = convert_filename(&job, src);
+		if(g_hash_table_lookup(names, f->dst) != NULL)
+		{
+			f->err = ERR_FILE_OPEN;
+			f->done = 1;
+		}
+		else
+			g_hash_table_insert(names, f->dst, f);
+	}
+	g_hash_table_destroy(names);
+
+	// Start workers
+	n_threads = options->n_threads;
+	if(n_threads <= 0)
+		n_threads = cpu_count();
+	if(n_threads > job.n_files)
+		n_threads = job.n_files;
+
+	threads = (GThread **)g_malloc0((n_threads + 1) * sizeof(GThread *));
+	for(n = 0; n < n_threads; n++)
+	{
+		threads[n] = g_thread_try_new("convert", convert_worker, &job, NULL);
+		if(threads[n] == NULL)
+			break;
+	}
+	if(n == 0)
+		convert_worker(&job);	// no thread at all: do it ourselves
+
+	// Report files as soon as they are done
+	for(i = 0; i < job.n_files; i++)
+	{
+		ConvertFile *f = &job.files[i];
+
+		g_mutex_lock(&job.mutex);
+		while(!f->done)
+			g_cond_wait(&job.cond, &job.mutex);
+		g_mutex_unlock(&job.mutex);
+
+		if(f->err)
+			tifiles_warning("Unable to convert this file: %s (error %i)", src_filenames[i], f->err);
+		if(f->err && !ret)
+			ret = f->err;
+		if(options->errors != NULL)
+			options->errors[i] = f->err;
+		if(options->done != NULL)
+			options->done(src_filenames[i], f->dst, f->err, options->user_data);
+
+		g_free(f->dst);
+	}
+
+	for(i = 0; i < n; i++)
+		g_thread_join(threads[i]);
+	g_free(threads);
+
+	g_free(job.files);
+	g_mutex_clear(&job.mutex);
+	g_cond_clear(&job.cond);
+
+	return ret;
+}
+
 /*****************/
 /* Miscellaneous */
 /*****************/
@@ -658,6 +1927,9 @@ TIEXPORT2 int TICALL tifiles_file_display(const char *filename)
  * This function may be difficult to understand but it avoids to use trees (and
  * linked list) which will require an implementation.
  *
+ * Folders are found with a hash table in a single pass and arrays are allocated
+ * once with their final size.
+ *
  * Return value: a 2-dimensions allocated integer array. Must be freed when no
  * longer used.
  **/
@@ -665,64 +1937,51 @@ TIEXPORT2 int** tifiles_create_table_of_entries(FileContent *content, int *nfold
 {
 	int num_folders = 0;
 	int i, j;
-	char **ptr, *folder_list[32768] = { 0 };
+	GHashTable *folders;
+	int *folder_of, *count;
 	int **table;
 
-	// determine how many folders we have
+	folder_of = (int *) g_malloc0((content->num_entries + 1) * sizeof(int));
+	count = (int *) g_malloc0((content->num_entries + 1) * sizeof(int));
+	folders = g_hash_table_new(g_str_hash, g_str_equal);
+
+	// determine folders (in order of appearance) and count their variables
 	for (i = 0; i < content->num_entries; i++) 
 	{
 		VarEntry *entry = content->entries[i];
+		int idx = GPOINTER_TO_INT(g_hash_table_lookup(folders, entry->folder));
 
-		// scan for an existing folder entry
-		for (ptr = folder_list; *ptr != NULL; ptr++) 
-		{
-			if (!strcmp(*ptr, entry->folder)) 
-			{
-				//printf("break: %s\n", entry->folder);
-				break;
-			}
-		}
-		if (*ptr == NULL) 
+		if (idx == 0)
 		{		// add new folder entry
-			folder_list[num_folders] = (char *) g_malloc0(257);
-			//printf("%i: adding '%s'\n", num_folders, entry->folder);
-			strcpy(folder_list[num_folders], entry->folder);
-			folder_list[num_folders + 1] = NULL;
-			num_folders++;
+			idx = ++num_folders;
+			g_hash_table_insert(folders, entry->folder, GINT_TO_POINTER(idx));
 		}
+		folder_of[i] = idx - 1;
+		count[idx - 1]++;
 	}
-	if (tifiles_calc_is_ti8x(content->model))
-		num_folders++;
-	*nfolders = num_folders;
+	g_hash_table_destroy(folders);
 
-	// allocate the folder list
-	table = (int **) g_malloc0((num_folders + 1) * sizeof(int *));
-	table[num_folders] = NULL;
+	// allocate the folder list (TI8x: one more, unused)
+	*nfolders = num_folders + (tifiles_calc_is_ti8x(content->model) ? 1 : 0);
+	table = (int **) g_malloc0((*nfolders + 1) * sizeof(int *));
 
-	// for each folder, determine how many variables we have
-	// and allocate array with indexes
+	// for each folder, allocate array with indexes
 	for (j = 0; j < num_folders; j++) 
 	{
-		int k;
-
-		for (i = 0, k = 0; i < content->num_entries; i++) 
-		{
-			VarEntry *entry = content->entries[i];
+		table[j] = (int *) g_malloc((count[j] + 1) * sizeof(int));
+		table[j][count[j]] = -1;
+		count[j] = 0;
+	}
 
-			if (!strcmp(folder_list[j], entry->folder)) 
-			{
-				table[j] = (int *) realloc(table[j], (k + 2) * sizeof(int));
-				table[j][k] = i;
-				//printf("%i %i: adding %i\n", j, k, i); 
-				table[j][k + 1] = -1;
-				k++;
-			}
-		}
+	// and fill them
+	for (i = 0; i < content->num_entries; i++) 
+	{
+		j = folder_of[i];
+		table[j][count[j]++] = i;
 	}
 
-	// g_free( memory
-	for (j = 0; j < num_folders + 1; j++)
-		g_free(folder_list[j]);
+	g_free(folder_of);
+	g_free(count);
 
 	return table;
 }
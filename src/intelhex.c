@@ -102,23 +102,29 @@ static int hex_packet_read(FILE *f, uint8_t *size, uint16_t *addr, uint8_t *type
     return -3;
 
   {
-	  // check for end of file without mangling data checksum
+	  // check for end of file without mangling data checksum: one char
+	  // at most is pushed back, hence the stream doesn't need to seek
 	  int c1, c2, c3;
-	  long pos = ftell(f);
 
 	  c1 = fgetc(f);
+	  if(c1 != 0x0d)
+	  {
+		// end of file (or **TIFL** signature of next header)
+		*type = HEX_EOF;
+		if(c1 != EOF)
+			ungetc(c1, f);
+		return 0;
+	  }
+
 	  c2 = fgetc(f);
 	  c3 = fgetc(f);	//EOF checking is set to keep compatibility with old generated FLASH files (buggy)
-
-	  if(((c1 != 0x0d) && (c2 != 0x0a)) || (c3 == EOF))	
+	  if((c2 == EOF) || (c3 == EOF))
 	  {
 		// end of file
 		*type = HEX_EOF;
-		fseek(f, pos, SEEK_SET);
 		return 0;
 	  }
-
-	  fseek(f, pos+2, SEEK_SET);
+	  ungetc(c3, f);
   }
 
   return 0;
@@ -132,34 +138,32 @@ static int hex_packet_read(FILE *f, uint8_t *size, uint16_t *addr, uint8_t *type
 	@type : a flag (0x80 or 0x00)
 	@page : page of block	
 	@data : the buffer where block is placed (16KB max)
+	@state : state of the parser (kept by the caller, one per stream)
 
 	Read a data block (page or segment) from FLASH file. 
-	If all args are set to NULL, this resets the parser.
+	If all args but state are set to NULL, this resets the parser.
 
 	Returns : 0 if success, EOF if end of file has been reached.
 */
-int hex_block_read(FILE *f, uint16_t *size, uint16_t *addr, uint8_t *type, uint8_t *data, uint16_t *page)
+int hex_block_read(FILE *f, uint16_t *size, uint16_t *addr, uint8_t *type, uint8_t *data, uint16_t *page, HexReader *state)
 {
-	static int flag = 0x80;
-	static uint16_t flash_page;
-	static uint16_t flash_addr;
 	int i;
 	int new_page = 0;
 
 	// reset condition: all args set to NULL
 	if(!size && !addr && !type && !data && !page)
 	{
-		flag = 0x80;
-		flash_page = flash_addr = 0;
+		state->flag = 0x80;
+		state->page = state->addr = 0;
 		return 0;
 	}
 
 	// fill-up buffer with 0xff (flash)
 	memset(data, 0xff, BLK_MAX);
 
-	*addr = flash_addr;
-	*type = flag;
-	*page = flash_page;
+	*addr = state->addr;
+	*type = state->flag;
+	*page = state->page;
 	*size = 0;
 
 	// load data
@@ -177,14 +181,14 @@ int hex_block_read(FILE *f, uint16_t *size, uint16_t *addr, uint8_t *type, uint8
 		// new block ? Set address
 		if(new_page)
 		{
-			flash_addr = pkt_addr;
+			state->addr = pkt_addr;
 			new_page = 0;
 		}
 
 		// returned values
-		*addr = flash_addr;
-		*type = flag;
-		*page = flash_page;
+		*addr = state->addr;
+		*type = state->flag;
+		*page = state->page;
 		
 		// determine what to do
 		switch(pkt_type)
@@ -198,9 +202,9 @@ int hex_block_read(FILE *f, uint16_t *size, uint16_t *addr, uint8_t *type, uint8
 
 		case HEX_END: 
 			// new section
-			flash_addr = 0;
-			flash_page = 0;
-			flag ^= 0x80;
+			state->addr = 0;
+			state->page = 0;
+			state->flag ^= 0x80;
 			if(i == 0)
 				break;
 			else
@@ -208,7 +212,7 @@ int hex_block_read(FILE *f, uint16_t *size, uint16_t *addr, uint8_t *type, uint8
 
 		case HEX_PAGE: 
 			// new page
-			flash_page = (pkt_data[0] << 8) | pkt_data[1];
+			state->page = (pkt_data[0] << 8) | pkt_data[1];
 			new_page = !0;
 			break;
 
@@ -244,6 +248,8 @@ static int write_byte(uint8_t b, FILE * f)
 	- ': 00 0000 01 FF'
 	- ': 02 0000 02 0000 FC'
 
+	If @f is NULL, nothing is written (the length of packet is computed).
+
 	Returns : number of chars written to file.
 */
 static int hex_packet_write(FILE *f, uint8_t size, uint16_t addr, uint8_t type_, uint8_t *data)
@@ -253,6 +259,10 @@ static int hex_packet_write(FILE *f, uint8_t size, uint16_t addr, uint8_t type_,
   int num = 0;
   uint8_t type = (type_ == HEX_EOF ? HEX_END : type_);
 
+  // ':', size, address, type, data and checksum as hexadecimal, then CR/LF
+  if(f == NULL)
+	  return 1 + 2 * (1 + 2 + 1 + size + 1) + (type_ != HEX_EOF ? 2 : 0);
+
   fputc(':', f); num++;
   num += write_byte((uint8_t)size, f);
   num += write_byte(MSB(addr), f);
@@ -285,15 +295,16 @@ static int hex_packet_write(FILE *f, uint8_t size, uint16_t addr, uint8_t type_,
 	@type : a flag (0x80 or 0x00)
 	@page : page of block	
 	@data : the buffer where block is placed (16KB max)
+	@flag : flag of previous block (0x80 before first block), updated
 
-	Write a data block (page/segment) to FLASH file. 
+	Write a data block (page/segment) to FLASH file. If @f is NULL, nothing 
+	is written: the length of the Intel hex data is known before writing.
 
 	Returns : number of chars written to file.
 */
-int hex_block_write(FILE *f, uint16_t size, uint16_t addr, uint8_t type, uint8_t *data, uint16_t page)
+int hex_block_write(FILE *f, uint16_t size, uint16_t addr, uint8_t type, uint8_t *data, uint16_t page, int *flag)
 {
 	int i, bytes_written = 0;
-	static int old_flag = 0x80;
 	int n = size / PKT_MAX;
 	int r = size % PKT_MAX;
 	uint8_t buf[3];
@@ -304,12 +315,12 @@ int hex_block_write(FILE *f, uint16_t size, uint16_t addr, uint8_t type, uint8_t
 		return hex_packet_write(f, 0, 0x0000, HEX_EOF, NULL);
 
 	// new section (FLASH OS only)
-	if(old_flag == 0x80 && type == 0x00)
+	if(*flag == 0x80 && type == 0x00)
 		new_section = !0;
 
-	if(old_flag != type)
+	if(*flag != type)
 	{
-		old_flag = type;
+		*flag = type;
 		bytes_written += hex_packet_write(f, 0, 0x0000, HEX_END, NULL);
 	}
 
@@ -26,7 +26,16 @@
 
 #define PAGE_SIZE	16384	//(= FLASH_PAGE_SIZE)
 
-int hex_block_read(FILE *f, uint16_t *size, uint16_t *addr, uint8_t *type, uint8_t *data, uint16_t *page);
-int hex_block_write(FILE *f, uint16_t size, uint16_t  addr, uint8_t  type, uint8_t *data, uint16_t  page);
+// state of the reader: one per stream (there is no static state, several 
+// files can be parsed at the same time)
+typedef struct
+{
+	int			flag;
+	uint16_t	page;
+	uint16_t	addr;
+} HexReader;
+
+int hex_block_read(FILE *f, uint16_t *size, uint16_t *addr, uint8_t *type, uint8_t *data, uint16_t *page, HexReader *state);
+int hex_block_write(FILE *f, uint16_t size, uint16_t  addr, uint8_t  type, uint8_t *data, uint16_t  page, int *flag);
 
 #endif
@@ -146,9 +146,9 @@ TIEXPORT2 int TICALL tifiles_has_backup(CalcModel calc_type)
  *
  * Return value: the ckecksum.
  **/
-TIEXPORT2 uint16_t TICALL tifiles_checksum(uint8_t * buffer, int size)
+TIEXPORT2 uint16_t TICALL tifiles_checksum(uint8_t * buffer, uint32_t size)
 {
-	int i;
+	uint32_t i;
 	uint16_t c = 0;
 
 	if (buffer == NULL)
@@ -183,17 +183,42 @@ char *TICALL tifiles_get_varname(const char *full_name)
 		return (++bs);
 }
 
+// buffer of tifiles_get_fldname: one per thread
+static GPrivate folder_key = G_PRIVATE_INIT(g_free);
+
 /**
  * tifiles_get_fldname:
  * @full_name: a calculator path such as 'fldname\varname'.
  *
  * Returns the folder within the variable is located..
+ * The string is private to the calling thread; see #tifiles_get_fldname_r.
  *
  * Return value: folder name as string. It should not be modified (static).
  **/
 char *TICALL tifiles_get_fldname(const char *full_name)
 {
-	static char folder[FLDNAME_MAX];
+	char *folder = g_private_get(&folder_key);
+
+	if (folder == NULL)
+	{
+		folder = g_malloc0(FLDNAME_MAX);
+		g_private_set(&folder_key, folder);
+	}
+
+	return tifiles_get_fldname_r(full_name, folder);
+}
+
+/**
+ * tifiles_get_fldname_r:
+ * @full_name: a calculator path such as 'fldname\varname'.
+ * @folder: a buffer of FLDNAME_MAX bytes where to store the folder name.
+ *
+ * Reentrant version of #tifiles_get_fldname.
+ *
+ * Return value: @folder.
+ **/
+TIEXPORT2 char* TICALL tifiles_get_fldname_r(const char *full_name, char *folder)
+{
 	char *bs = strchr(full_name, '\\');
 	int i;
 
@@ -23,14 +23,36 @@
   This unit contains some miscellaneous but useful functions.
 */
 
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE	// fmemopen, open_memstream, copy_file_range
+#endif
+
 #include <glib/gstdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "stdints2.h"
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef __WIN32__
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+#ifndef O_BINARY
+# define O_BINARY 0
+#endif
 
 #include "tifiles.h"
 #include "logging.h"
+#include "macros.h"
+#include "rwfile.h"
 
 /*
   Dump into hexadecimal format the content of a buffer
@@ -63,15 +85,15 @@ int hexdump(uint8_t * ptr, int len)
    - f [in]: a file descriptor
    - [out]: -1 if error, 0 otherwise.
 */
-int fread_n_bytes(FILE * f, int n, uint8_t *s)
+int fread_n_bytes(FILE * f, size_t n, uint8_t *s)
 {
-  int i;
+  size_t i;
 
   if (s == NULL) 
     for (i = 0; i < n; i++)
       fgetc(f);
   else 
-	if(fread(s, 1, n, f) < (size_t)n)
+	if(fread(s, 1, n, f) < n)
 		return -1;
 
   return 0;
@@ -83,9 +105,9 @@ int fread_n_bytes(FILE * f, int n, uint8_t *s)
   - f [in]: a file descriptor
   - [out]: -1 if error, 0 otherwise.
 */
-int fwrite_n_bytes(FILE * f, int n, const uint8_t *s)
+int fwrite_n_bytes(FILE * f, size_t n, const uint8_t *s)
 {
-  if(fwrite(s, 1, n, f) < (size_t)n)
+  if(fwrite(s, 1, n, f) < n)
 	  return -1;
 
   return 0;
@@ -121,15 +143,13 @@ int fread_n_chars(FILE * f, int n, char *s)
 }
 
 /*
-  Write a string of 'n' chars max (NULL padded) to a file
-  - s [in]: a string
-  - f [in]: a file descriptor
-  - [out]: -1 if error, 0 otherwise.
+  Write a string of 'n' chars max padded with 'pad' to a file. The string
+  and the padding are written as blocks, not char by char.
 */
-int fwrite_n_chars(FILE * f, int n, const char *s)
+static int fwrite_padded(FILE * f, int n, const char *s, uint8_t pad)
 {
-  int i;
-  int l = n;
+  uint8_t padding[64];
+  int l;
 
   l = strlen(s);
   if (l > n) 
@@ -140,16 +160,32 @@ int fwrite_n_chars(FILE * f, int n, const char *s)
     return -1;
   }
 
-  for (i = 0; i < l; i++)
-    if(fputc(s[i], f) == EOF)
-		return -1;
-  for (i = l; i < n; i++) 
-    if(fputc(0x00, f) == EOF)
-		return -1;
+  if(fwrite(s, 1, l, f) < (size_t)l)
+    return -1;
+
+  memset(padding, pad, sizeof(padding));
+  for (n -= l; n > 0; n -= sizeof(padding))
+  {
+    int k = (n < (int)sizeof(padding)) ? n : (int)sizeof(padding);
+
+    if(fwrite(padding, 1, k, f) < (size_t)k)
+      return -1;
+  }
 
   return 0;
 }
 
+/*
+  Write a string of 'n' chars max (NULL padded) to a file
+  - s [in]: a string
+  - f [in]: a file descriptor
+  - [out]: -1 if error, 0 otherwise.
+*/
+int fwrite_n_chars(FILE * f, int n, const char *s)
+{
+  return fwrite_padded(f, n, s, 0x00);
+}
+
 /*
   Write a string of 'n' chars max (SPC padded) to a file
   - s [in]: a string
@@ -158,26 +194,7 @@ int fwrite_n_chars(FILE * f, int n, const char *s)
 */
 int fwrite_n_chars2(FILE * f, int n, const char *s)
 {
-  int i;
-  int l = n;
-
-  l = strlen(s);
-  if (l > n) 
-  {
-    tifiles_critical("string passed in 'write_string8' is too long (>n chars).\n");
-    tifiles_critical( "s = %s, len(s) = %i\n", s, l);
-    hexdump((uint8_t *) s, (l < 9) ? 9 : l);
-    return -1;
-  }
-
-  for (i = 0; i < l; i++)
-    if(fputc(s[i], f) == EOF)
-		return -1;
-  for (i = l; i < n; i++) 
-    if(fputc(0x20, f) == EOF)
-		return -1;
-
-  return 0;
+  return fwrite_padded(f, n, s, 0x20);
 }
 
 
@@ -191,9 +208,113 @@ int fwrite_8_chars(FILE * f, const char *s)
   return fwrite_n_chars(f, 8, s);
 }
 
-int fskip(FILE * f, int n)
+int fskip(FILE * f, foff_t n)
 {
-  return fseek(f, n, SEEK_CUR);
+  uint8_t buf[256];
+  size_t m;
+
+  if (!fseeko(f, n, SEEK_CUR))
+    return 0;
+  if (n < 0 || errno != ESPIPE)
+    return -1;
+
+  // pipes and sockets can't seek: data is read and dropped
+  while (n > 0)
+  {
+    m = (n < (foff_t)sizeof(buf)) ? (size_t)n : sizeof(buf);
+    if (fread(buf, 1, m, f) < m)
+      return -1;
+    n -= m;
+  }
+
+  return 0;
+}
+
+/*
+  Get the size of a file (the position is kept).
+  - [out]: the size or -1 if the stream can't seek.
+*/
+foff_t fsize(FILE * f)
+{
+  foff_t pos, size;
+
+  if ((pos = ftello(f)) < 0 || fseeko(f, 0, SEEK_END) || 
+      (size = ftello(f)) < 0 || fseeko(f, pos, SEEK_SET))
+    return -1;
+
+  return size;
+}
+
+/*
+  Check that a size field read from file does not go beyond the end of file,
+  before allocating memory for it.
+  - length [in]: number of bytes which must follow the current position
+  - [out]: -1 if the file is too short, 0 otherwise (or if size is unknown).
+*/
+int fcheck_length(FILE * f, foff_t length)
+{
+  foff_t pos, size;
+
+  if ((pos = ftello(f)) < 0 || (size = fsize(f)) < 0)
+    return 0;
+
+  return (length > size - pos) ? -1 : 0;
+}
+
+/*
+  Read a stream up to the end of file. The size of the stream is not needed
+  (pipes and sockets can't tell it): the buffer grows as data arrives.
+  - data [out]: the data, to be freed with g_free (NULL if nothing read)
+  - len [out]: the number of bytes read
+  - [out]: -1 if error, 0 otherwise.
+*/
+int fread_all(FILE * f, uint8_t **data, size_t *len)
+{
+  foff_t size = fsize(f);
+  size_t n = 0, max;
+  uint8_t *buf = NULL, *tmp;
+
+  if (size >= 0)
+  {
+    size -= ftello(f);
+    max = (size > 0) ? (size_t)size + 1 : 1;	// +1: EOF is seen at once
+  }
+  else
+    max = 65536;
+
+  for (;;)
+  {
+    if (n == max || buf == NULL)
+    {
+      if (buf != NULL)
+        max *= 2;
+      tmp = g_realloc(buf, max);
+      if (tmp == NULL)
+        goto frae;
+      buf = tmp;
+    }
+
+    n += fread(buf + n, 1, max - n, f);
+    if (n < max)
+    {
+      if (ferror(f))
+        goto frae;
+      break;
+    }
+  }
+
+  if (n == 0)
+  {
+    g_free(buf);
+    buf = NULL;
+  }
+  *data = buf;
+  *len = n;
+  return 0;
+
+frae:	// release on exit
+  g_free(buf);
+  return -1;
 }
 
 /***************************/
@@ -260,3 +381,557 @@ int fwrite_long(FILE * f, uint32_t data)
 	data = GUINT32_TO_LE(data);
   return (fwrite(&data, sizeof(uint32_t), 1, f) < 1) ? -1 : 0;
 }
+
+/*******************/
+/* Write to memory */
+/*******************/
+
+/*
+  The mwrite_* functions store data with the same layout as the fwrite_*
+  ones into a buffer and advance the buffer pointer 'p'. They are used to
+  serialize a whole file before writing it at once.
+  - p [in/out]: address of the current position in buffer
+  - [out]: -1 if error, 0 otherwise.
+*/
+int mwrite_n_bytes(uint8_t **p, int n, const uint8_t *s)
+{
+  memcpy(*p, s, n);
+  *p += n;
+
+  return 0;
+}
+
+static int mwrite_padded(uint8_t **p, int n, const char *s, uint8_t pad)
+{
+  int l;
+
+  l = strlen(s);
+  if (l > n) 
+  {
+    tifiles_critical("string passed in 'write_string8' is too long (>n chars).\n");
+    tifiles_critical( "s = %s, len(s) = %i\n", s, l);
+    hexdump((uint8_t *) s, (l < 9) ? 9 : l);
+    return -1;
+  }
+
+  memcpy(*p, s, l);
+  memset(*p + l, pad, n - l);
+  *p += n;
+
+  return 0;
+}
+
+int mwrite_n_chars(uint8_t **p, int n, const char *s)
+{
+  return mwrite_padded(p, n, s, 0x00);
+}
+
+int mwrite_n_chars2(uint8_t **p, int n, const char *s)
+{
+  return mwrite_padded(p, n, s, 0x20);
+}
+
+int mwrite_8_chars(uint8_t **p, const char *s)
+{
+  return mwrite_n_chars(p, 8, s);
+}
+
+int mwrite_byte(uint8_t **p, uint8_t data)
+{
+  *(*p)++ = data;
+
+  return 0;
+}
+
+int mwrite_word(uint8_t **p, uint16_t data)
+{
+  *(*p)++ = LSB(data);
+  *(*p)++ = MSB(data);
+
+  return 0;
+}
+
+int mwrite_long(uint8_t **p, uint32_t data)
+{
+  *(*p)++ = LSB(LSW(data));
+  *(*p)++ = MSB(LSW(data));
+  *(*p)++ = LSB(MSW(data));
+  *(*p)++ = MSB(MSW(data));
+
+  return 0;
+}
+
+/******************/
+/* Memory streams */
+/******************/
+
+/*
+  Open a buffer as a read-only stream so that file readers can parse data
+  which is already in memory (an archive member for instance). Without
+  fmemopen, the buffer is copied into an anonymous temporary file.
+  - buf [in]: the data (must not be released before the stream is closed)
+  - len [in]: size of data (non null)
+  - [out]: a file pointer to close with fclose or NULL if error.
+*/
+FILE* fopen_buffer(void *buf, size_t len)
+{
+#if defined(HAVE_FMEMOPEN)
+  return fmemopen(buf, len, "rb");
+#else
+  FILE *f = tmpfile();
+
+  if (f == NULL)
+    return NULL;
+
+  if (fwrite(buf, 1, len, f) < len || fseek(f, 0L, SEEK_SET))
+  {
+    fclose(f);
+    return NULL;
+  }
+
+  return f;
+#endif
+}
+
+/*
+  Open a stream which writes into a growing memory buffer, so that file
+  writers can build a file in memory. Without open_memstream, data goes
+  into an anonymous temporary file which is loaded by #fclose_memstream.
+  - buf, len [in]: where #fclose_memstream stores the data and its size
+  - [out]: a file pointer to close with #fclose_memstream or NULL if error.
+*/
+FILE* fopen_memstream(uint8_t **buf, size_t *len)
+{
+  *buf = NULL;
+  *len = 0;
+#if defined(HAVE_OPEN_MEMSTREAM)
+  return open_memstream((char **)buf, len);
+#else
+  return tmpfile();
+#endif
+}
+
+/*
+  Close a stream opened with #fopen_memstream and get its data.
+  - buf [out]: the data, to be freed with free()
+  - len [out]: size of data
+  - [out]: -1 if error (no data is returned), 0 otherwise.
+*/
+int fclose_memstream(FILE *f, uint8_t **buf, size_t *len)
+{
+#if defined(HAVE_OPEN_MEMSTREAM)
+  if (fclose(f))
+  {
+    free(*buf);
+    *buf = NULL;
+    return -1;
+  }
+#else
+  foff_t size;
+
+  if (fflush(f) || fseeko(f, 0, SEEK_END) || (size = ftello(f)) < 0 || fseeko(f, 0, SEEK_SET))
+  {
+    fclose(f);
+    return -1;
+  }
+
+  *len = (size_t)size;
+  *buf = (uint8_t *)malloc(*len + 1);
+  if (*buf == NULL || fread(*buf, 1, *len, f) < *len)
+  {
+    free(*buf);
+    *buf = NULL;
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+#endif
+
+  return 0;
+}
+
+/*
+  Write several buffers at once: with a single writev call when available
+  (the stream is flushed first), one fwrite per buffer otherwise (memory
+  streams have no file descriptor).
+  - data, len [in]: arrays of buffers and of their sizes
+  - n [in]: number of buffers
+  - [out]: -1 if error, 0 otherwise.
+*/
+#define FWRITE_VEC_MAX	16
+int fwrite_vec(FILE *f, const uint8_t **data, const size_t *len, int n)
+{
+  int i;
+#if !defined(__WIN32__)
+  struct iovec iov[FWRITE_VEC_MAX];
+  ssize_t r;
+
+  if (n <= FWRITE_VEC_MAX && fileno(f) != -1)
+  {
+    if (fflush(f))
+      return -1;
+
+    for (i = 0; i < n; i++)
+    {
+      iov[i].iov_base = (void *)data[i];
+      iov[i].iov_len = len[i];
+    }
+
+    for (i = 0; i < n; )
+    {
+      if (iov[i].iov_len == 0)
+      {
+        i++;
+        continue;
+      }
+
+      r = writev(fileno(f), iov + i, n - i);
+      if (r <= 0)
+      {
+        if (r < 0 && errno == EINTR)
+          continue;
+        return -1;
+      }
+
+      // skip what has been written (writes may be partial)
+      for (; i < n && (size_t)r >= iov[i].iov_len; i++)
+        r -= iov[i].iov_len;
+      if (i < n)
+      {
+        iov[i].iov_base = (uint8_t *)iov[i].iov_base + r;
+        iov[i].iov_len -= r;
+      }
+    }
+
+    return 0;
+  }
+#endif
+
+  for (i = 0; i < n; i++)
+    if (fwrite(data[i], 1, len[i], f) < len[i])
+      return -1;
+
+  return 0;
+}
+
+/****************/
+/* Mapped files */
+/****************/
+
+/*
+  Map a whole file into memory (read-only).
+  - data [out]: address of file content
+  - len [out]: size of file
+  - [out]: a handle to release with #fclose_map or NULL if the file can't
+    be mapped (or if mapping is not available).
+*/
+void* fopen_map(const char *filename, const uint8_t **data, size_t *len)
+{
+#if GLIB_CHECK_VERSION(2, 8, 0)
+  GMappedFile *map = g_mapped_file_new(filename, FALSE, NULL);
+
+  if (map == NULL)
+    return NULL;
+
+  *data = (const uint8_t *)g_mapped_file_get_contents(map);
+  *len = g_mapped_file_get_length(map);
+  return map;
+#else
+  return NULL;
+#endif
+}
+
+/*
+  Unmap a file mapped with #fopen_map.
+*/
+void fclose_map(void *map)
+{
+#if GLIB_CHECK_VERSION(2, 22, 0)
+  g_mapped_file_unref((GMappedFile *)map);
+#elif GLIB_CHECK_VERSION(2, 8, 0)
+  g_mapped_file_free((GMappedFile *)map);
+#endif
+}
+
+/*
+  Copy bytes from a stream to another one (both at their current position).
+  The copy is done by the kernel with copy_file_range or sendfile when
+  available so that data does not go through user space. Streams which
+  can't tell their position (pipes, terminals) are copied the usual way.
+  - dst [in]: a stream opened for writing
+  - src [in]: a stream opened for reading
+  - len [in]: number of bytes to copy
+  - [out]: -1 if error, 0 otherwise.
+*/
+int fcopy(FILE *dst, FILE *src, foff_t len)
+{
+  uint8_t buf[4096];
+  size_t n;
+#if !defined(__WIN32__) && (defined(HAVE_COPY_FILE_RANGE) || (defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)))
+  int fd_in = fileno(src);
+  int fd_out = fileno(dst);
+  off_t off_in, off_out;
+  size_t chunk;
+  ssize_t r;
+
+  if (fflush(dst))
+    return -1;
+  off_in = ftello(src);
+  off_out = ftello(dst);
+
+  while (len > 0 && off_in >= 0 && off_out >= 0)
+  {
+    r = -1;
+    chunk = (len > 0x40000000) ? 0x40000000 : (size_t)len;
+#if defined(HAVE_COPY_FILE_RANGE)
+    r = copy_file_range(fd_in, &off_in, fd_out, &off_out, chunk, 0);
+#endif
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+    // copy_file_range may be missing or refuse these files (pipe, other filesystem, ...)
+    if (r < 0 && lseek(fd_out, off_out, SEEK_SET) == off_out)
+    {
+      r = sendfile(fd_out, fd_in, &off_in, chunk);
+      if (r > 0)
+        off_out += r;
+    }
+#endif
+    if (r <= 0)
+      break;
+    len -= r;
+  }
+
+  // streams are positioned after the copied data
+  if (off_in >= 0 && off_out >= 0 &&
+      (fseeko(src, off_in, SEEK_SET) || fseeko(dst, off_out, SEEK_SET)))
+    return -1;
+#endif
+
+  // remaining data (if any) is copied the usual way
+  while (len > 0)
+  {
+    n = (len < (foff_t)sizeof(buf)) ? (size_t)len : sizeof(buf);
+    if (fread(buf, 1, n, src) < n || fwrite(buf, 1, n, dst) < n)
+      return -1;
+    len -= n;
+  }
+
+  return 0;
+}
+
+/*****************/
+/* Atomic writes */
+/*****************/
+
+/*
+  Create a new and empty file with a unique name next to 'filename' (same
+  directory, hence same filesystem: it can be renamed over 'filename'). It
+  gets the permissions of 'filename' if this one exists.
+
+  If 'filename' exists but is not a regular file (a symbolic link, which
+  would be replaced by the rename, a FIFO or a device like /dev/stdout), it
+  is written directly: it is opened and 'tmpname' is a copy of 'filename'.
+  - filename [in]: name of the final file
+  - tmpname [out]: name of the created file, to be freed
+  - [out]: a file descriptor opened for writing, -1 if error.
+*/
+int fcreate_sibling(const char *filename, char **tmpname)
+{
+  int i, fd = -1;
+#ifndef __WIN32__
+  struct stat st;
+  int exists = !g_lstat(filename, &st);
+
+  if (exists && !S_ISREG(st.st_mode))
+  {
+    fd = g_open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    *tmpname = (fd == -1) ? NULL : g_strdup(filename);
+    return fd;
+  }
+#endif
+
+  for (i = 0; i < 100 && fd == -1; i++)
+  {
+    *tmpname = g_strdup_printf("%s.%08x", filename, g_random_int());
+    fd = g_open(*tmpname, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0666);
+    if (fd == -1)
+    {
+      g_free(*tmpname);
+      *tmpname = NULL;
+      if (errno != EEXIST)
+        break;
+    }
+  }
+
+#ifndef __WIN32__
+  // the rename must not change permissions of an existing file
+  if (fd != -1 && exists)
+    fchmod(fd, st.st_mode & 07777);
+#endif
+
+  return fd;
+}
+
+/*
+  Open a file for writing in atomic mode: data goes to a sibling temporary
+  file which replaces 'filename' in #fclose_atomic only if writing succeeded.
+  Hence, 'filename' never appears truncated, even if the program crashes
+  (unless it is not a regular file, see #fcreate_sibling).
+  - filename [in]: name of the file to write
+  - tmpname [out]: name of the temporary file, to pass to fclose_atomic
+  - [out]: a file pointer or NULL if error.
+*/
+FILE* fopen_atomic(const char *filename, char **tmpname)
+{
+  FILE *f;
+  int fd;
+
+  fd = fcreate_sibling(filename, tmpname);
+  if (fd == -1)
+    return NULL;
+
+  f = fdopen(fd, "wb");
+  if (f == NULL)
+  {
+    close(fd);
+    fcommit_sibling(*tmpname, filename, 0);
+    *tmpname = NULL;
+  }
+
+  return f;
+}
+
+/*
+  Close a file opened with #fopen_atomic. If 'commit' is set and no error
+  occured, the temporary file is renamed as 'filename', it is removed otherwise.
+  - [out]: -1 if error or not committed, 0 otherwise.
+*/
+int fclose_atomic(FILE *f, const char *filename, char *tmpname, int commit)
+{
+  if (fclose(f))
+    commit = 0;
+
+  return fcommit_sibling(tmpname, filename, commit);
+}
+
+/*
+  Rename a file created by #fcreate_sibling as 'filename' if 'commit' is
+  set, remove it otherwise. 'tmpname' is freed.
+  - [out]: -1 if error or not committed, 0 otherwise.
+*/
+int fcommit_sibling(char *tmpname, const char *filename, int commit)
+{
+  // written directly (see fcreate_sibling): nothing to rename nor remove
+  if (!strcmp(tmpname, filename))
+  {
+    g_free(tmpname);
+    return commit ? 0 : -1;
+  }
+
+  if (commit)
+  {
+#ifdef __WIN32__
+    // rename does not overwrite on Win32 and removing the file first would
+    // leave nothing if the program crashes in between
+    gunichar2 *src = g_utf8_to_utf16(tmpname, -1, NULL, NULL, NULL);
+    gunichar2 *dst = g_utf8_to_utf16(filename, -1, NULL, NULL, NULL);
+
+    if (src == NULL || dst == NULL ||
+        !MoveFileExW(src, dst, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+      commit = 0;
+    g_free(src);
+    g_free(dst);
+#else
+    if (g_rename(tmpname, filename))
+      commit = 0;
+#endif
+  }
+  if (!commit)
+    g_unlink(tmpname);
+  g_free(tmpname);
+
+  return commit ? 0 : -1;
+}
+
+/*
+  Start writing the content of a file to disk without waiting for it. Used
+  before flushing many files so that their data is written at once and
+  #fsync_file has mostly nothing left to do but wait.
+  - [out]: -1 if error, 0 otherwise (or if not supported).
+*/
+int fsync_start(const char *filename)
+{
+  int ret = 0;
+#if defined(HAVE_SYNC_FILE_RANGE) && defined(SYNC_FILE_RANGE_WRITE)
+  int fd = g_open(filename, O_RDONLY, 0);
+
+  if (fd == -1)
+    return -1;
+  ret = sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+  close(fd);
+#endif
+
+  return ret ? -1 : 0;
+}
+
+/*
+  Flush the content of a file to disk.
+  - [out]: -1 if error, 0 otherwise.
+*/
+int fsync_file(const char *filename)
+{
+  int ret = 0;
+#if defined(__WIN32__)
+  int fd = g_open(filename, O_RDWR | O_BINARY, 0);
+
+  if (fd == -1)
+    return -1;
+  ret = _commit(fd);
+  close(fd);
+#elif defined(HAVE_FSYNC)
+  int fd = g_open(filename, O_RDONLY, 0);
+
+  if (fd == -1)
+    return -1;
+  ret = fsync(fd);
+  close(fd);
+#endif
+
+  return ret ? -1 : 0;
+}
+
+/*
+  Flush a directory (its entries, ie renames) to disk.
+  - [out]: -1 if error, 0 otherwise.
+*/
+int fsync_dir(const char *dirname)
+{
+  int ret = 0;
+#if !defined(__WIN32__) && defined(HAVE_FSYNC)
+  int fd = g_open(dirname, O_RDONLY, 0);
+
+  if (fd == -1)
+    return -1;
+  ret = fsync(fd);
+  close(fd);
+#endif
+
+  return ret ? -1 : 0;
+}
+
+/*
+  Number of processors (used as default number of worker threads).
+*/
+int cpu_count(void)
+{
+#ifdef __WIN32__
+  SYSTEM_INFO si;
+
+  GetSystemInfo(&si);
+  return si.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+#else
+  return 1;
+#endif
+}
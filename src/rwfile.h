@@ -22,8 +22,21 @@
 #ifndef __TIFILES_MISC__
 #define __TIFILES_MISC__
 
-int fread_n_bytes(FILE * f, int n, uint8_t *s);
-int fwrite_n_bytes(FILE * f, int n, const uint8_t *s);
+/*
+  File offsets are 64-bit: off_t with fseeko/ftello (the library is built
+  with _FILE_OFFSET_BITS=64) or the MSVC equivalents.
+*/
+#if defined(_MSC_VER)
+typedef __int64 foff_t;
+# define fseeko(f, o, w)	_fseeki64(f, o, w)
+# define ftello(f)		_ftelli64(f)
+#else
+# include <sys/types.h>
+typedef off_t foff_t;
+#endif
+
+int fread_n_bytes(FILE * f, size_t n, uint8_t *s);
+int fwrite_n_bytes(FILE * f, size_t n, const uint8_t *s);
 
 int fread_n_chars(FILE * f, int n, char *s);
 int fwrite_n_chars(FILE * f, int n, const char *s);
@@ -32,7 +45,10 @@ int fwrite_n_chars2(FILE * f, int n, const char *s);
 int fread_8_chars(FILE * f, char *s);
 int fwrite_8_chars(FILE * f, const char *s);
 
-int fskip(FILE * f, int n);
+int fskip(FILE * f, foff_t n);
+foff_t fsize(FILE * f);
+int fcheck_length(FILE * f, foff_t length);
+int fread_all(FILE * f, uint8_t **data, size_t *len);
 
 int fread_byte(FILE * f, uint8_t * data);
 int fread_word(FILE * f, uint16_t * data);
@@ -42,6 +58,35 @@ int fwrite_byte(FILE * f, uint8_t data);
 int fwrite_word(FILE * f, uint16_t data);
 int fwrite_long(FILE * f, uint32_t data);
 
+int mwrite_n_bytes(uint8_t **p, int n, const uint8_t *s);
+int mwrite_n_chars(uint8_t **p, int n, const char *s);
+int mwrite_n_chars2(uint8_t **p, int n, const char *s);
+int mwrite_8_chars(uint8_t **p, const char *s);
+
+int mwrite_byte(uint8_t **p, uint8_t data);
+int mwrite_word(uint8_t **p, uint16_t data);
+int mwrite_long(uint8_t **p, uint32_t data);
+
+FILE* fopen_buffer(void *buf, size_t len);
+FILE* fopen_memstream(uint8_t **buf, size_t *len);
+int fclose_memstream(FILE *f, uint8_t **buf, size_t *len);
+int fwrite_vec(FILE *f, const uint8_t **data, const size_t *len, int n);
+
+void* fopen_map(const char *filename, const uint8_t **data, size_t *len);
+void fclose_map(void *map);
+int fcopy(FILE *dst, FILE *src, foff_t len);
+
+int fcreate_sibling(const char *filename, char **tmpname);
+FILE* fopen_atomic(const char *filename, char **tmpname);
+int fclose_atomic(FILE *f, const char *filename, char *tmpname, int commit);
+int fcommit_sibling(char *tmpname, const char *filename, int commit);
+
+int fsync_start(const char *filename);
+int fsync_file(const char *filename);
+int fsync_dir(const char *dirname);
+
+int cpu_count(void);
+
 int hexdump(uint8_t * ptr, int len);
 
 #endif
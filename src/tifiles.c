@@ -38,6 +38,7 @@
 
 #include "gettext.h"
 #include "tifiles.h"
+#include "async.h"
 #include "logging.h"
 
 /****************/
@@ -51,6 +52,14 @@ int tifiles_instance = 0;	// counts # of instances
  * tifiles_library_init:
  *
  * This function must be the first one to call. It inits library internals.
+ * It is not thread-safe: call it (and #tifiles_library_exit) from one thread
+ * before any other thread uses the library.
+ *
+ * Once initialized, all functions can be called from several threads at
+ * once, provided that a given content, index or stream is used by one
+ * thread at a time. Functions returning a string stored by the library
+ * (such as #tifiles_get_fldname or #tifiles_comment_set_single) use a
+ * buffer private to the calling thread; the _r variants take one instead.
  *
  * Return value: the handle count.
  **/
@@ -104,6 +113,10 @@ TIEXPORT2 int TICALL tifiles_library_init()
  **/
 TIEXPORT2 int TICALL tifiles_library_exit()
 {
+	// workers of asynchronous operations are stopped with the last instance
+	if (tifiles_instance == 1)
+		async_exit();
+
   	return (--tifiles_instance);
 }
 
@@ -26,6 +26,8 @@
 #  include <config.h>
 #endif
 
+#include <stdio.h>
+
 #include "export2.h"
 #include "stdints2.h"
 #include "typesxx.h"
@@ -175,13 +177,77 @@ typedef struct
 
 } FileContent;
 
+/**
+ * FileIndex:
+ * @filename: name of the indexed single/group file
+ * @content: file content whose entries have their data loaded on demand
+ * @offsets: offset in file of the data part of each entry
+ * @f: file kept opened for loading data (private)
+ *
+ * A structure used to access the variables of a single/group file without
+ * loading the whole file. Entries have a NULL data field until loaded with
+ * #tifiles_file_load_entry.
+ **/
+typedef struct
+{
+  char*			filename;
+  FileContent*	content;
+  int64_t*		offsets;
+  FILE*			f;
+
+} FileIndex;
+
+/**
+ * FileBatch:
+ * @n_files: number of files in the batch
+ * @filenames: final names of files
+ * @tmpnames: names of files to write (renamed on commit)
+ *
+ * A structure used to write many files and make them durable at once.
+ **/
+typedef struct
+{
+  int			n_files;
+  char**		filenames;
+  char**		tmpnames;
+
+} FileBatch;
+
+/**
+ * ConvertOptions:
+ * @n_threads: number of worker threads or 0 for one per processor
+ * @max_memory: bytes of files being converted at once or 0 for a default of 64 MB
+ * @errors: array where to store the error code of each file (may be NULL)
+ * @done: function called by the calling thread once a file is converted (may be NULL)
+ * @user_data: passed to @done
+ *
+ * Options of #tifiles_convert_batch.
+ **/
+typedef struct
+{
+  int			n_threads;
+  size_t		max_memory;
+
+  int*			errors;
+  void			(*done)(const char *src, const char *dst, int err, void *user_data);
+  void*			user_data;
+
+} ConvertOptions;
+
 /**
  * BackupContent:
  * @model: calculator model
  * @comment: comment embedded in file (like "Backup file received by TiLP")
  * @checksum: checksum of file
+ * @data_block: TI8x backups read from file have their data parts in a single
+ * allocation. This field is NULL when parts are allocated separately.
  *
  * A generic structure used to store the content of a backup file.
+ *
+ * When @data_block is not NULL, @data_part1 to @data_part4 point into it and
+ * #tifiles_content_delete_backup releases @data_block only: the parts must 
+ * not be freed or replaced one by one. To handle them separately, replace 
+ * all of them with copies, free @data_block and set it to NULL.
  **/
 typedef struct 
 {
@@ -211,8 +277,41 @@ typedef struct
 
   uint16_t	checksum;
 
+  uint8_t*	data_block;		// TI8x only: allocation holding all data parts (or NULL)
+
 } BackupContent;
 
+/**
+ * BackupStream:
+ * @filename: name of the backup file
+ * @content: header of backup (data is not loaded)
+ * @offset: number of data bytes read or written so far
+ * @checksum: checksum of data read or written so far
+ * @f: opened file (private)
+ * @tmpname: file renamed as filename when closed (writing only, private)
+ * @buffer: block buffer (reading only, private)
+ * @buffer_size: size of block buffer (private)
+ * @err: error which occurred while writing (private)
+ *
+ * A structure used to read or write the data of a backup file block by block
+ * with a fixed-size buffer. See #tifiles_file_open_backup and
+ * #tifiles_file_create_backup.
+ **/
+typedef struct
+{
+  char*			filename;
+  BackupContent*	content;
+  uint32_t		offset;
+  uint16_t		checksum;
+
+  FILE*			f;
+  char*			tmpname;
+  uint8_t*		buffer;
+  uint32_t		buffer_size;
+  int			err;
+
+} BackupStream;
+
 #define FLASH_PAGE_SIZE	16384
 
 /**
@@ -314,6 +413,34 @@ struct _FlashContent
   FlashContent*	next;		// TI9x only
 };
 
+/**
+ * FlashStream:
+ * @filename: name of the opened FLASH file
+ * @content: header of FLASH file (data_part is not loaded)
+ * @offset: offset in data of the next block
+ * @map: mapping of file (private)
+ * @data: mapped content of file (private)
+ * @f: file kept opened if it can't be mapped (private)
+ * @buffer: block buffer if file can't be mapped (private)
+ * @buffer_size: size of block buffer (private)
+ *
+ * A structure used to read the data of a FLASH file block by block without
+ * loading it into memory. See #tifiles_file_open_flash.
+ **/
+typedef struct
+{
+  char*			filename;
+  FlashContent*	content;
+  uint32_t		offset;
+
+  void*			map;
+  const uint8_t*	data;
+  FILE*			f;
+  uint8_t*		buffer;
+  uint32_t		buffer_size;
+
+} FlashStream;
+
 typedef struct
 {
 	char*		filename;
@@ -329,11 +456,23 @@ typedef struct
  * TigContent:
  * @model: a calculator model
  * @comment: a global comment for archive
- * @comp_level: compression level (0: store, 1 to 4: slow to fast)
+ * @comp_level: compression level (0: store, 1 to 4: slow to fast, 5: adaptive)
  * @num_entries: the number of entries
  * @entries: a NULL-terminated array of #TigEntry structures
+ * @dedup: store entries with identical content only once when writing
  *
  * A generic structure used to store the content of a TiGroup file.
+ *
+ * In adaptive mode, members which are tiny or don't compress (measured on a
+ * sample) are stored, others are compressed with level 2.
+ *
+ * All levels use the default zlib strategy: on calculator files, Z_FILTERED
+ * gives the same size at fast levels and larger ones otherwise, and Z_RLE
+ * is about 20% larger for little gain in speed.
+ *
+ * With deduplication, an entry whose content is the same as a previous one 
+ * is not stored but listed in a manifest member. It is restored as a copy
+ * of the previous one when reading (and placed after other entries).
  **/
 typedef struct 
 {
@@ -349,8 +488,147 @@ typedef struct
 
   CalcModel			model_dst;
 
+  int				dedup;
+
 } TigContent;
 
+/**
+ * TigIndexEntry:
+ * @filename: name of member in archive
+ * @type: class of member guessed from its name (confirmed when read)
+ * @size: uncompressed size of member
+ * @compressed_size: compressed size of member
+ *
+ * A structure used to describe a member of a TiGroup file without reading it.
+ * Other fields are private to the library.
+ **/
+typedef struct
+{
+  char*				filename;
+  FileClass			type;
+  unsigned long		size;
+  unsigned long		compressed_size;
+
+  /*< private >*/
+  unsigned long		pos[2];		// position of member in archive
+
+} TigIndexEntry;
+
+/**
+ * TigIndex:
+ * @filename: name of the indexed TiGroup file
+ * @model: calculator model
+ * @comment: comment of archive
+ * @entries: a NULL-terminated array of #TigIndexEntry structures (archive order)
+ * @n_entries: number of entries
+ *
+ * A structure used to access the members of a TiGroup file without 
+ * uncompressing the whole archive. See #tifiles_tigroup_open. Other fields
+ * are private to the library.
+ **/
+typedef struct
+{
+  char*				filename;
+  CalcModel			model;
+  char*				comment;
+
+  TigIndexEntry**	entries;
+  int				n_entries;
+
+  /*< private >*/
+  void*				uf;			// archive kept opened for reading members
+  void*				names;		// members by name
+
+} TigIndex;
+
+/**
+ * TigWriter:
+ * @filename: name of the TiGroup file being written
+ * @model: calculator model (used to name members)
+ * @comp_level: compression level (see #TigContent)
+ * @n_vars: number of variables written so far
+ * @n_apps: number of applications written so far
+ * @tmpname: name of the file being written, renamed on close (private)
+ * @zf: archive being written (private)
+ * @err: first error which damaged the archive (private)
+ *
+ * A structure used to write a TiGroup file one entry at a time. See 
+ * #tifiles_tigroup_writer_open.
+ **/
+typedef struct
+{
+  char*				filename;
+  CalcModel			model;
+  int				comp_level;
+
+  int				n_vars;
+  int				n_apps;
+
+  char*				tmpname;
+  void*				zf;
+  int				err;
+
+} TigWriter;
+
+typedef struct _FileAsync FileAsync;
+
+/**
+ * AsyncCallbacks:
+ * @context: a GMainContext where to call callbacks or NULL to call them from the worker thread
+ * @progress: called as data is read or written with the number of bytes done so far and the
+ * size of file (may be NULL)
+ * @done: called once the operation has completed, failed or been cancelled (may be NULL)
+ * @user_data: passed to callbacks
+ *
+ * Callbacks of an asynchronous operation (see #tifiles_file_read_regular_async).
+ **/
+typedef struct
+{
+  void*			context;
+
+  void			(*progress)(FileAsync *op, uint64_t done, uint64_t total, void *user_data);
+  void			(*done)(FileAsync *op, int err, void *user_data);
+  void*			user_data;
+
+} AsyncCallbacks;
+
+/**
+ * FileAsync:
+ * @filename: name of the file being read or written
+ * @content: content being read or written (#FileContent, #BackupContent or #FlashContent)
+ * @err: error code of operation (set once completed)
+ * @type: kind of operation (private)
+ * @callbacks: callbacks (private)
+ * @total: size of file (private, see #tifiles_async_get_progress)
+ * @done: number of bytes read or written so far (private)
+ * @cancelled: set by #tifiles_async_cancel (private)
+ * @completed: set once the done callback has returned (private)
+ * @pending: a progress notification is pending in context (private)
+ * @ref_count: reference count (private)
+ * @mutex: protects progress and completion (private)
+ * @cond: signaled on completion (private)
+ *
+ * An asynchronous operation on a file, run by a pool of worker threads.
+ **/
+struct _FileAsync
+{
+  char*				filename;
+  void*				content;
+  int				err;
+
+  int				type;
+  AsyncCallbacks	callbacks;
+  uint64_t			total;
+  uint64_t			done;
+  int				cancelled;
+  int				completed;
+  int				pending;
+  int				ref_count;
+  void*				mutex;
+  void*				cond;
+
+};
+
 /* Functions */
 
 // namespace scheme: library_class_function like tifiles_fext_get
@@ -443,11 +721,12 @@ extern "C" {
   TIEXPORT2 int TICALL tifiles_is_flash (CalcModel model);
   TIEXPORT2 int TICALL tifiles_has_backup(CalcModel model);
 
-  TIEXPORT2 uint16_t TICALL tifiles_checksum(uint8_t * buffer, int size);
+  TIEXPORT2 uint16_t TICALL tifiles_checksum(uint8_t * buffer, uint32_t size);
   TIEXPORT2 int             tifiles_hexdump(uint8_t* ptr, unsigned int length);
 
   TIEXPORT2 char* TICALL tifiles_get_varname(const char *full_name);
   TIEXPORT2 char* TICALL tifiles_get_fldname(const char *full_name);
+  TIEXPORT2 char* TICALL tifiles_get_fldname_r(const char *full_name, char *folder);
   TIEXPORT2 char* TICALL tifiles_build_fullname(CalcModel model,
 	                     char *full_name,
 					     const char *fldname,
@@ -459,19 +738,40 @@ extern "C" {
   TIEXPORT2 int          TICALL tifiles_content_delete_regular(FileContent *content);
   TIEXPORT2 int TICALL tifiles_file_read_regular(const char *filename, FileContent *content);
   TIEXPORT2 int TICALL tifiles_file_write_regular(const char *filename, FileContent *content, char **filename2);
+  TIEXPORT2 int TICALL tifiles_fread_regular(FILE *f, const char *filename, FileContent *content);
+  TIEXPORT2 int TICALL tifiles_fwrite_regular(FILE *f, FileContent *content);
+  TIEXPORT2 int TICALL tifiles_file_map_regular(const char *filename, FileContent *content, void **map);
+  TIEXPORT2 int TICALL tifiles_file_unmap_regular(FileContent *content, void *map);
+  TIEXPORT2 int TICALL tifiles_file_copy_regular(const char *src_filename, const char *dst_filename);
   TIEXPORT2 int TICALL tifiles_file_display_regular(FileContent *content);
 
+  TIEXPORT2 int TICALL tifiles_file_open_regular(const char *filename, FileIndex **index);
+  TIEXPORT2 int TICALL tifiles_file_load_entry(FileIndex *index, VarEntry *ve);
+  TIEXPORT2 int TICALL tifiles_file_close_regular(FileIndex *index);
+
   TIEXPORT2 BackupContent* TICALL tifiles_content_create_backup(CalcModel model);
   TIEXPORT2 int            TICALL tifiles_content_delete_backup(BackupContent *content);
   TIEXPORT2 int TICALL tifiles_file_read_backup(const char *filename, BackupContent *content);
   TIEXPORT2 int TICALL tifiles_file_write_backup(const char *filename, BackupContent *content);
+  TIEXPORT2 int TICALL tifiles_fread_backup(FILE *f, const char *filename, BackupContent *content);
+  TIEXPORT2 int TICALL tifiles_fwrite_backup(FILE *f, BackupContent *content);
+  TIEXPORT2 int TICALL tifiles_file_open_backup(const char *filename, BackupStream **stream);
+  TIEXPORT2 int TICALL tifiles_file_read_backup_block(BackupStream *stream, uint32_t size, const uint8_t **block, uint32_t *length);
+  TIEXPORT2 int TICALL tifiles_file_create_backup(const char *filename, BackupContent *content, BackupStream **stream);
+  TIEXPORT2 int TICALL tifiles_file_write_backup_block(BackupStream *stream, const uint8_t *block, uint32_t length);
+  TIEXPORT2 int TICALL tifiles_file_close_backup(BackupStream *stream);
   TIEXPORT2 int TICALL tifiles_file_display_backup(BackupContent *content);
 
   TIEXPORT2 FlashContent* TICALL tifiles_content_create_flash(CalcModel model);
   TIEXPORT2 int           TICALL tifiles_content_delete_flash(FlashContent *content);
   TIEXPORT2 int TICALL tifiles_file_read_flash(const char *filename, FlashContent *content);
+  TIEXPORT2 int TICALL tifiles_file_open_flash(const char *filename, FlashStream **stream);
+  TIEXPORT2 int TICALL tifiles_file_read_flash_block(FlashStream *stream, uint32_t size, const uint8_t **block, uint32_t *length);
+  TIEXPORT2 int TICALL tifiles_file_close_flash(FlashStream *stream);
   TIEXPORT2 int TICALL tifiles_file_write_flash (const char *filename, FlashContent *content);
   TIEXPORT2 int TICALL tifiles_file_write_flash2(const char *filename, FlashContent *content, char **filename2);
+  TIEXPORT2 int TICALL tifiles_fread_flash(FILE *f, const char *filename, FlashContent *content);
+  TIEXPORT2 int TICALL tifiles_fwrite_flash(FILE *f, FlashContent *content);
   TIEXPORT2 int TICALL tifiles_file_display_flash(FlashContent *content);
 
   TIEXPORT2 FileContent*  TICALL tifiles_content_dup_regular(FileContent *content);
@@ -479,6 +779,26 @@ extern "C" {
 
   TIEXPORT2 int TICALL tifiles_file_display(const char *filename);
 
+  TIEXPORT2 FileBatch*  TICALL tifiles_batch_create(void);
+  TIEXPORT2 const char* TICALL tifiles_batch_add_file(FileBatch *batch, const char *filename);
+  TIEXPORT2 int         TICALL tifiles_batch_commit(FileBatch *batch);
+  TIEXPORT2 int         TICALL tifiles_batch_abort(FileBatch *batch);
+
+  TIEXPORT2 int TICALL tifiles_convert_batch(char **src_filenames, const char *dst_dir, CalcModel model, ConvertOptions *options);
+
+  // async.c
+  TIEXPORT2 int TICALL tifiles_file_read_regular_async(const char *filename, FileContent *content, AsyncCallbacks *callbacks, FileAsync **op);
+  TIEXPORT2 int TICALL tifiles_file_write_regular_async(const char *filename, FileContent *content, AsyncCallbacks *callbacks, FileAsync **op);
+  TIEXPORT2 int TICALL tifiles_file_read_backup_async(const char *filename, BackupContent *content, AsyncCallbacks *callbacks, FileAsync **op);
+  TIEXPORT2 int TICALL tifiles_file_write_backup_async(const char *filename, BackupContent *content, AsyncCallbacks *callbacks, FileAsync **op);
+  TIEXPORT2 int TICALL tifiles_file_read_flash_async(const char *filename, FlashContent *content, AsyncCallbacks *callbacks, FileAsync **op);
+  TIEXPORT2 int TICALL tifiles_file_write_flash_async(const char *filename, FlashContent *content, AsyncCallbacks *callbacks, FileAsync **op);
+
+  TIEXPORT2 int TICALL tifiles_async_cancel(FileAsync *op);
+  TIEXPORT2 int TICALL tifiles_async_get_progress(FileAsync *op, uint64_t *done, uint64_t *total);
+  TIEXPORT2 int TICALL tifiles_async_wait(FileAsync *op);
+  TIEXPORT2 int TICALL tifiles_async_free(FileAsync *op);
+
   // grouped.c
   TIEXPORT2 FileContent** TICALL tifiles_content_create_group(int n_entries);
   TIEXPORT2 int           TICALL tifiles_content_delete_group(FileContent **array);
@@ -501,9 +821,20 @@ extern "C" {
   TIEXPORT2 int         TICALL tifiles_content_delete_tigroup(TigContent *content);
 
   TIEXPORT2 int TICALL tifiles_file_read_tigroup(const char *filename, TigContent *content);
+  TIEXPORT2 int TICALL tifiles_file_read_tigroup2(const char *filename, TigContent *content, int n_threads);
   TIEXPORT2 int TICALL tifiles_file_write_tigroup(const char *filename, TigContent *content);
+  TIEXPORT2 int TICALL tifiles_file_write_tigroup2(const char *filename, TigContent *content, int n_threads);
   TIEXPORT2 int TICALL tifiles_file_display_tigroup(const char *filename);
 
+  TIEXPORT2 int TICALL tifiles_tigroup_open(const char *filename, TigIndex **index);
+  TIEXPORT2 int TICALL tifiles_tigroup_read_entry(TigIndex *index, const char *name, TigEntry **entry);
+  TIEXPORT2 int TICALL tifiles_tigroup_close(TigIndex *index);
+
+  TIEXPORT2 int TICALL tifiles_tigroup_writer_open(const char *filename, CalcModel model, int comp_level, TigWriter **writer);
+  TIEXPORT2 int TICALL tifiles_tigroup_writer_add_regular(TigWriter *writer, FileContent *content);
+  TIEXPORT2 int TICALL tifiles_tigroup_writer_add_flash(TigWriter *writer, FlashContent *content);
+  TIEXPORT2 int TICALL tifiles_tigroup_writer_close(TigWriter *writer);
+
   /// tigroup.c -> grouped.c
   TIEXPORT2 int TICALL tifiles_tigroup_contents(FileContent **src_contents1, FlashContent **src_contents2, TigContent **dst_content);
   TIEXPORT2 int TICALL tifiles_untigroup_content(TigContent *src_content, FileContent ***dst_contents1, FlashContent ***dst_contents2);
@@ -532,6 +863,10 @@ extern "C" {
   TIEXPORT2 const char* TICALL tifiles_comment_set_group(void);
   TIEXPORT2 const char* TICALL tifiles_comment_set_backup(void);
   TIEXPORT2 const char* TICALL tifiles_comment_set_tigroup(void);
+  TIEXPORT2 char* TICALL tifiles_comment_set_single_r(char *comment);
+  TIEXPORT2 char* TICALL tifiles_comment_set_group_r(char *comment);
+  TIEXPORT2 char* TICALL tifiles_comment_set_backup_r(char *comment);
+  TIEXPORT2 char* TICALL tifiles_comment_set_tigroup_r(char *comment);
 
   // ve_fp.c
   TIEXPORT2 VarEntry*	TICALL tifiles_ve_create(void);
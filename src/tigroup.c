@@ -35,6 +35,14 @@
 #include <glib/gstdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
+#ifdef __WIN32__
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 
 #include "minizip/zip.h"
 #include "minizip/unzip.h"
@@ -51,63 +59,26 @@
 #include "logging.h"
 #include "error.h"
 #include "rwfile.h"
+#include "files8x.h"
+#include "files9x.h"
+#include "filesnsp.h"
 
-#define WRITEBUFFERSIZE (8192)
-
-extern uLong filetime(char *f, tm_zip *tmzip, uLong *dt);
-extern int do_list(unzFile uf);
-
-#if !GLIB_CHECK_VERSION(2, 8, 0)
-#include <errno.h>
-// Code taken from Glib
-int g_chdir (const gchar *path)
-{
-#ifdef __WIN32__
-  if (G_WIN32_HAVE_WIDECHAR_API ())
-    {
-      wchar_t *wpath = g_utf8_to_utf16 (path, -1, NULL, NULL, NULL);
-      int retval;
-      int save_errno;
-
-      if (wpath == NULL)
-	{
-	  errno = EINVAL;
-	  return -1;
-	}
-
-      retval = _wchdir (wpath);
-      save_errno = errno;
-
-      g_free (wpath);
-      
-      errno = save_errno;
-      return retval;
-    }
-  else
-    {
-      gchar *cp_path = g_locale_from_utf8 (path, -1, NULL, NULL, NULL);
-      int retval;
-      int save_errno;
+#define DEFAULT_COMP_LEVEL	4
+#define ADAPTIVE_COMP_LEVEL	5
 
-      if (cp_path == NULL)
-	{
-	  errno = EINVAL;
-	  return -1;
-	}
+// adaptive mode: members smaller than ADAPTIVE_MIN_SIZE bytes or whose sample
+// doesn't shrink below ADAPTIVE_MAX_RATIO percent are stored
+#define ADAPTIVE_MIN_SIZE	128
+#define ADAPTIVE_SAMPLE		4096
+#define ADAPTIVE_MAX_RATIO	90
 
-      retval = chdir (cp_path);
-      save_errno = errno;
+// lists members stored as a copy of another one: a "name\tname of original\n" line each
+#define DEDUP_MANIFEST		"tifiles-dedup.txt"
 
-      g_free (cp_path);
+#define TIB_SIGNATURE	"Advanced Mathematics Software"
+#define TNO_SIGNATURE	"TI-Nspire."
 
-      errno = save_errno;
-      return retval;
-    }
-#else
-  return chdir (path);
-#endif
-}
-#endif
+extern int do_list(unzFile uf);
 
 // ---------------------------------------------------------------------------
 
@@ -350,6 +321,49 @@ TIEXPORT2 int TICALL tifiles_content_del_te(TigContent *content, TigEntry *te)
 # define stricmp strcasecmp
 #endif
 
+static int tigroup_write_member(TigEntry *entry, uint8_t **data, size_t *len);
+static int zip_write(zipFile *zf, const char *filenameinzip, const uint8_t *data, size_t len, int comp_level);
+static int zip_copy_raw(unzFile uf, zipFile *zf, const char *filenameinzip, unz_file_info *fi);
+static int tigroup_extract_current(unzFile uf, unsigned long size, uint8_t **data);
+
+/*
+  Tell whether an archive has a member named 'name', either stored or listed
+  as a copy in the deduplication manifest (see #TigContent).
+*/
+static int tigroup_has_member(const char *filename, const char *name)
+{
+	unzFile uf;
+	unz_file_info file_info;
+	uint8_t *data;
+	size_t len = strlen(name);
+	int found = 0;
+
+	uf = unzOpen(filename);
+	if (uf == NULL)
+		return 0;
+
+	if (unzLocateFile(uf, name, 1) == UNZ_OK)
+		found = 1;
+	else if (unzLocateFile(uf, DEDUP_MANIFEST, 1) == UNZ_OK &&
+		unzGetCurrentFileInfo(uf,&file_info,NULL,0,NULL,0,NULL,0) == UNZ_OK &&
+		tigroup_extract_current(uf, file_info.uncompressed_size, &data) == UNZ_OK)
+	{
+		const char *line;
+
+		data[file_info.uncompressed_size] = '\0';
+		for (line = (char *)data; line != NULL && !found; line = strchr(line, '\n'))
+		{
+			if (*line == '\n')
+				line++;
+			found = !strncmp(line, name, len) && line[len] == '\t';
+		}
+		g_free(data);
+	}
+
+	unzClose(uf);
+	return found;
+}
+
 /**
  * tifiles_tigroup_add_file:
  * @src_filename: the file to add to TiGroup file
@@ -357,6 +371,10 @@ TIEXPORT2 int TICALL tifiles_content_del_te(TigContent *content, TigEntry *te)
  *
  * Add src_filename content to dst_filename content and write to dst_filename.
  *
+ * The new member is appended to the archive in place: other members are
+ * neither read nor rewritten. If the archive already has a member of the 
+ * same name, it is removed first (see #tifiles_tigroup_del_file).
+ *
  * Return value: 0 if successful, an error code otherwise.
  **/
 TIEXPORT2 int TICALL tifiles_tigroup_add_file(const char *src_filename, const char *dst_filename)
@@ -365,6 +383,10 @@ TIEXPORT2 int TICALL tifiles_tigroup_add_file(const char *src_filename, const ch
 	FileClass type;
 	TigEntry *te;
 	TigContent *content = NULL;
+	zipFile zf;
+	char *fname = NULL;
+	uint8_t *data = NULL;
+	size_t len;
 	int ret = 0;
 
 	// group file is created if non existent
@@ -399,25 +421,81 @@ TIEXPORT2 int TICALL tifiles_tigroup_add_file(const char *src_filename, const ch
 		if(ret) goto ttaf;
 	}
 
-	// load dst file
-	content = tifiles_content_create_tigroup(CALC_NONE, 0);
-	ret = tifiles_file_read_tigroup(dst_filename, content);
+	// build TI file into memory
+	ret = tigroup_write_member(te, &data, &len);
 	if(ret) goto ttaf;
 
-	tifiles_content_add_te(content, te);
-	ret = tifiles_file_write_tigroup(dst_filename, content);
-	if(ret) goto ttaf;
+	// ZIP archives don't like greek chars
+	fname = ticonv_gfe_to_zfe(model, te->filename);
 
-	tifiles_content_delete_tigroup(content);
+	// a member of the same name would hide the new one: replace it
+	if (tigroup_has_member(dst_filename, fname))
+	{
+		TigEntry old = { 0 };
 
-	return 0;
+		old.filename = (char *)g_basename(fname);
+		ret = tifiles_tigroup_del_file(&old, dst_filename);
+		if(ret) goto ttaf;
+	}
+
+	// and add it at end of archive
+	zf = zipOpen(dst_filename, APPEND_STATUS_ADDINZIP);
+	if (zf == NULL)
+	{
+		printf("Can't open this file: %s\n", dst_filename);
+		ret = ERR_FILE_ZIP;
+		goto ttaf;
+	}
+
+	ret = zip_write(&zf, fname, data, len, DEFAULT_COMP_LEVEL);
+
+	if (zipClose(zf,NULL) != ZIP_OK && !ret)
+		ret = ERR_FILE_ZIP;
 
 ttaf:	// release on exit
+	g_free(fname);
+	free(data);
     tifiles_te_delete(te);
-	tifiles_content_delete_tigroup(content);
 	return ret;
 }
 
+/*
+  Remove a member from the lines of a deduplication manifest (see #TigContent)
+  and make its first duplicate, if any, the original of the others.
+  - dups [in/out]: lines of manifest ("name\tname of original"), removed ones are emptied
+  - name [in]: name in archive of the removed member
+  - [out]: name of the duplicate which must take the place of the member (to
+  be freed) or NULL if none
+*/
+static char* tigroup_dedup_promote(char **dups, const char *name)
+{
+	char *promoted = NULL;
+	int k;
+
+	for (k = 0; dups != NULL && dups[k] != NULL; k++)
+	{
+		char *tab = strchr(dups[k], '\t');
+
+		if (tab == NULL || strcmp(tab + 1, name))
+			continue;
+
+		if (promoted == NULL)
+		{
+			promoted = g_strndup(dups[k], tab - dups[k]);
+			dups[k][0] = '\0';
+		}
+		else
+		{
+			char *line = g_strdup_printf("%.*s\t%s", (int)(tab - dups[k]), dups[k], promoted);
+
+			g_free(dups[k]);
+			dups[k] = line;
+		}
+	}
+
+	return promoted;
+}
+
 /**
  * tifiles_tigroup_del_file:
  * @src_filename: the file to remove from TiGroup file
@@ -425,27 +503,174 @@ ttaf:	// release on exit
  *
  * Search for entry and remove it from file.
  *
+ * The other members are copied as is (still compressed) into a new archive
+ * which replaces the TiGroup file. The deduplication manifest (see
+ * #TigContent) is rewritten: an entry stored as a copy is removed from it and
+ * an entry which has copies is replaced by the first of them.
+ *
  * Return value: 0 if successful, an error code otherwise.
  **/
 TIEXPORT2 int TICALL tifiles_tigroup_del_file(TigEntry *entry,          const char *filename)
 {
-	TigContent* content = NULL;
+	unzFile uf;
+	zipFile zf;
+	unz_global_info gi;
+	unz_file_info file_info;
+	char filename_inzip[256];
+	char *comment = NULL;
+	char **dups = NULL;
+	GString *manifest;
+	char *tmpname;
+	int deleted = 0;
 	int err = 0;
+	int fd;
+	unsigned i;
+	int k;
+
+	uf = unzOpen(filename);
+	if (uf == NULL)
+	{
+		printf("Can't open this file: %s\n", filename);
+		return ERR_FILE_ZIP;
+	}
 
-	content = tifiles_content_create_tigroup(CALC_NONE, 0);
-	err = tifiles_file_read_tigroup(filename, content);
-	if(err) goto tfdf;
+	if (unzGetGlobalInfo(uf, &gi) != UNZ_OK)
+	{
+		unzClose(uf);
+		return ERR_FILE_ZIP;
+	}
 
-	tifiles_content_del_te(content, entry);
-	err = tifiles_file_write_tigroup(filename, content);
-	if(err) goto tfdf;
+	comment = (char *)g_malloc0(gi.size_comment + 1);
+	unzGetGlobalComment(uf, comment, gi.size_comment + 1);
 
-tfdf:
-	tifiles_content_delete_tigroup(content);
-	return 0;
-}
+	// Load deduplication manifest, if any
+	if (unzLocateFile(uf, DEDUP_MANIFEST, 1) == UNZ_OK)
+	{
+		uint8_t *data;
 
-// ---------------------------------------------------------------------------
+		if (unzGetCurrentFileInfo(uf,&file_info,NULL,0,NULL,0,NULL,0) != UNZ_OK ||
+			tigroup_extract_current(uf, file_info.uncompressed_size, &data) != UNZ_OK)
+		{
+			err = ERR_FILE_ZIP;
+			goto tfdf;
+		}
+		data[file_info.uncompressed_size] = '\0';
+		dups = g_strsplit((char *)data, "\n", -1);
+		g_free(data);
+	}
+
+	if (unzGoToFirstFile(uf) != UNZ_OK)
+	{
+		err = ERR_FILE_ZIP;
+		goto tfdf;
+	}
+
+	// New archive is built into a sibling file which replaces filename when complete
+	fd = fcreate_sibling(filename, &tmpname);
+	if (fd == -1)
+	{
+		printf("Can't open this file: %s\n", filename);
+		err = ERR_FILE_OPEN;
+		goto tfdf;
+	}
+	close(fd);
+
+	zf = zipOpen(tmpname, APPEND_STATUS_CREATE);
+	if (zf == NULL)
+	{
+		printf("Can't open this file: %s\n", filename);
+		fcommit_sibling(tmpname, filename, 0);
+		err = ERR_FILE_ZIP;
+		goto tfdf;
+	}
+
+	// Copy members but the one to remove
+	for (i = 0; i < gi.number_entry && !err; i++)
+	{
+		if (i > 0 && unzGoToNextFile(uf) != UNZ_OK)
+		{
+			err = ERR_FILE_ZIP;
+			break;
+		}
+
+		if (unzGetCurrentFileInfo(uf,&file_info,filename_inzip,sizeof(filename_inzip),NULL,0,NULL,0) != UNZ_OK)
+		{
+			err = ERR_FILE_ZIP;
+			break;
+		}
+
+		// rewritten below
+		if (dups != NULL && !strcmp(filename_inzip, DEDUP_MANIFEST))
+			continue;
+
+		if (!deleted && !strcmp(g_basename(filename_inzip), entry->filename))
+		{
+			char *promoted = tigroup_dedup_promote(dups, filename_inzip);
+
+			// first copy of member (if any) is stored in its place
+			if (promoted != NULL)
+				err = zip_copy_raw(uf, &zf, promoted, &file_info);
+			g_free(promoted);
+
+			deleted = 1;
+			continue;
+		}
+
+		err = zip_copy_raw(uf, &zf, filename_inzip, &file_info);
+	}
+
+	// Entry may be a copy listed in manifest only
+	for (k = 0; !deleted && dups != NULL && dups[k] != NULL; k++)
+	{
+		char *tab = strchr(dups[k], '\t');
+		char *name;
+
+		if (tab == NULL)
+			continue;
+
+		name = g_strndup(dups[k], tab - dups[k]);
+		if (!strcmp(g_basename(name), entry->filename))
+		{
+			dups[k][0] = '\0';
+			deleted = 1;
+		}
+		g_free(name);
+	}
+
+	// Write manifest back with remaining copies
+	manifest = g_string_new("");
+	for (k = 0; dups != NULL && dups[k] != NULL; k++)
+	{
+		if (strchr(dups[k], '\t') == NULL)
+			continue;
+
+		g_string_append(manifest, dups[k]);
+		g_string_append(manifest, "\n");
+	}
+	if (manifest->len > 0 && !err)
+		err = zip_write(&zf, DEDUP_MANIFEST, (uint8_t *)manifest->str, manifest->len, DEFAULT_COMP_LEVEL);
+	g_string_free(manifest, TRUE);
+
+	if (zipClose(zf, comment) != ZIP_OK && !err)
+		err = ERR_FILE_ZIP;
+	unzClose(uf);
+	g_free(comment);
+	g_strfreev(dups);
+
+	// leave file untouched if entry is not found
+	if (!deleted)
+		fcommit_sibling(tmpname, filename, 0);
+	else if (fcommit_sibling(tmpname, filename, !err) && !err)
+		err = ERR_FILE_CLOSE;
+
+	return err;
+
+tfdf:	// release on exit
+	unzClose(uf);
+	g_free(comment);
+	g_strfreev(dups);
+	return err;
+}
 
 /**
  * tifiles_tigroup_contents:
@@ -736,11 +961,12 @@ tuf:
  **/
 TIEXPORT2 TigContent* TICALL tifiles_content_create_tigroup(CalcModel model, int n)
 {
-	TigContent* content = g_malloc0(sizeof(FileContent));
+	TigContent* content = g_malloc0(sizeof(TigContent));
+	char comment[64];
 
 	content->model = content->model_dst = model;
-	content->comment = g_strdup(tifiles_comment_set_tigroup());
-	content->comp_level = 4;
+	content->comment = g_strdup(tifiles_comment_set_tigroup_r(comment));
+	content->comp_level = DEFAULT_COMP_LEVEL;
 	content->var_entries = (TigEntry **)g_malloc0(sizeof(TigEntry *));
 	content->app_entries = (TigEntry **)g_malloc0(sizeof(TigEntry *));
 
@@ -774,6 +1000,269 @@ TIEXPORT2 int TICALL tifiles_content_delete_tigroup(TigContent *content)
 	return 0;
 }
 
+/*
+  Deduplication of members (see #TigContent): the writer keeps a table of 
+  the digests of stored members and lists duplicates in a manifest which is
+  the last member of the archive. Readers restore duplicates from it.
+*/
+
+static char* tigroup_digest(const uint8_t *data, size_t len)
+{
+#if GLIB_CHECK_VERSION(2, 16, 0)
+	return g_compute_checksum_for_data(G_CHECKSUM_SHA256, data, len);
+#else
+	return NULL;	// no deduplication
+#endif
+}
+
+/*
+  Look for a stored member with the same digest. If found, 'name' is listed
+  into the manifest as a copy of it.
+  - digests [in/out]: digests of stored members (digest -> name)
+  - digest [in]: digest of member (released by this function)
+  - [out]: 1 if member is a duplicate and must not be stored, 0 otherwise
+*/
+static int tigroup_dedup(GHashTable *digests, GString *manifest, const char *name, char *digest)
+{
+	const char *orig;
+
+	if (digest == NULL)
+		return 0;
+
+	orig = (const char *)g_hash_table_lookup(digests, digest);
+	if (orig != NULL)
+	{
+		g_string_append(manifest, name);
+		g_string_append(manifest, "\t");
+		g_string_append(manifest, orig);
+		g_string_append(manifest, "\n");
+		g_free(digest);
+		return 1;
+	}
+
+	g_hash_table_insert(digests, digest, g_strdup(name));
+	return 0;
+}
+
+/*
+  Add the entries listed in a manifest as copies of their original.
+  - manifest [in]: content of manifest (NUL-terminated)
+  - [out]: 0 if successful, an error code otherwise
+*/
+static int tigroup_dedup_restore(TigContent *content, const char *manifest)
+{
+	const char *line, *tab, *eol;
+
+	for (line = manifest; *line; line = *eol ? eol + 1 : eol)
+	{
+		TigEntry *src = NULL;
+		TigEntry *te;
+		char *name, *orig;
+		int i;
+
+		eol = strchr(line, '\n');
+		if (eol == NULL)
+			eol = line + strlen(line);
+		tab = memchr(line, '\t', eol - line);
+		if (tab == NULL)
+			continue;
+
+		name = g_strndup(line, tab - line);
+		orig = g_strndup(tab + 1, eol - tab - 1);
+
+		for (i = 0; i < content->n_vars && src == NULL; i++)
+			if (!strcmp(content->var_entries[i]->filename, g_basename(orig)))
+				src = content->var_entries[i];
+		for (i = 0; i < content->n_apps && src == NULL; i++)
+			if (!strcmp(content->app_entries[i]->filename, g_basename(orig)))
+				src = content->app_entries[i];
+
+		if (src == NULL)
+		{
+			tifiles_warning("%s: original member %s not found", name, orig);
+			g_free(name);
+			g_free(orig);
+			return ERR_INVALID_FILE;
+		}
+
+		te = (TigEntry *)g_malloc0(sizeof(TigEntry));
+		te->filename = g_strdup(g_basename(name));
+		te->type = src->type;
+		if (src->type == TIFILE_FLASH)
+			te->content.flash = tifiles_content_dup_flash(src->content.flash);
+		else
+			te->content.regular = tifiles_content_dup_regular(src->content.regular);
+		tifiles_content_add_te(content, te);
+
+		g_free(name);
+		g_free(orig);
+	}
+
+	return 0;
+}
+
+/*
+  Guess the class of an archive member from its name and its first bytes.
+  Same rules as #tifiles_file_get_class but without any file access.
+  - data [in]: member content or NULL to guess from name only
+  - tib [out]: set if member is an old-style .tib file
+  - [out]: a value in #FileClass or 0 if not a TI file.
+*/
+static FileClass tigroup_member_class(const char *name, const uint8_t *data, unsigned long size, int *tib)
+{
+	CalcModel model = tifiles_file_get_model(name);
+	const char *e = tifiles_fext_get(name);
+	char buf[9];
+	int i;
+
+	*tib = 0;
+	if (!strcmp(e, "") || size < 8)
+		return 0;
+
+	if (!g_ascii_strcasecmp(e, "tib"))
+	{
+		*tib = data == NULL || (size >= 22 + strlen(TIB_SIGNATURE) && 
+			!memcmp(data + 22, TIB_SIGNATURE, strlen(TIB_SIGNATURE)));
+		return *tib ? TIFILE_FLASH : 0;
+	}
+
+	if (model == CALC_NONE)
+		return 0;
+
+	if (model == CALC_NSPIRE)
+	{
+		if (!g_ascii_strcasecmp(e, "tns"))
+			return TIFILE_SINGLE;
+		if (data == NULL)
+			return TIFILE_FLASH;
+		if (size >= strlen(TNO_SIGNATURE) && !memcmp(data, TNO_SIGNATURE, strlen(TNO_SIGNATURE)))
+			return TIFILE_FLASH;
+		return 0;
+	}
+
+	if (data != NULL)
+	{
+		for(i = 0; i < 8; i++)
+			buf[i] = toupper(data[i]);
+		buf[8] = '\0';
+		if (strncmp(buf, "**TI", 4) && strcmp(buf, "**V200**") && strncmp(buf, "*TI", 3))
+			return 0;
+	}
+
+	if (!g_ascii_strcasecmp(e, tifiles_fext_of_group(model)))
+		return TIFILE_GROUP;
+	if (!g_ascii_strcasecmp(e, tifiles_fext_of_backup(model)))
+		return TIFILE_BACKUP;
+	if (!g_ascii_strcasecmp(e, tifiles_fext_of_flash_os(model)) || 
+		!g_ascii_strcasecmp(e, tifiles_fext_of_flash_app(model)))
+		return TIFILE_FLASH;
+
+	return TIFILE_SINGLE;
+}
+
+/*
+  Parse an archive member held in memory into the content of 'entry'.
+  The entry is not released on error (see #tifiles_te_delete).
+*/
+static int tigroup_read_member(TigEntry *entry, const char *name, int tib, uint8_t *data, unsigned long size)
+{
+	CalcModel model = tifiles_file_get_model(name);
+	FILE *f;
+	int ret = ERR_BAD_CALC;
+
+	f = fopen_buffer(data, size);
+	if (f == NULL)
+		return ERR_FILE_IO;
+
+	if(entry->type == TIFILE_FLASH)
+	{
+#if !defined(DISABLE_TI8X)
+		if (tifiles_calc_is_ti8x(model))
+			ret = ti8x_fread_flash(f, model, entry->content.flash);
+		else
+#endif
+#if !defined(DISABLE_TI9X)
+		if (tifiles_calc_is_ti9x(model) || tib)
+			ret = ti9x_fread_flash(f, model, tib, entry->content.flash);
+		else
+#endif
+		if (model == CALC_NSPIRE)
+			ret = tnsp_fread_flash(f, entry->content.flash);
+	}
+	else
+	{
+#if !defined(DISABLE_TI8X)
+		if (tifiles_calc_is_ti8x(model))
+			ret = ti8x_fread_regular(f, entry->content.regular);
+		else
+#endif
+#if !defined(DISABLE_TI9X)
+		if (tifiles_calc_is_ti9x(model))
+			ret = ti9x_fread_regular(f, entry->content.regular);
+		else
+#endif
+		if (model == CALC_NSPIRE)
+			ret = tnsp_fread_regular(f, name, entry->content.regular);
+	}
+	fclose(f);
+
+	return ret;
+}
+
+/*
+  Uncompress the current file of an archive into a newly allocated buffer 
+  (to be released with g_free).
+  - uf [in]: an archive whose current file is the one to extract
+  - size [in]: uncompressed size of file
+  - data [out]: a buffer of size + 1 bytes
+  - [out]: an UNZ error code or UNZ_OK
+*/
+static int tigroup_extract_current(unzFile uf, unsigned long size, uint8_t **data)
+{
+	unsigned long n;
+	int err;
+
+	err = unzOpenCurrentFilePassword(uf, NULL);
+	if (err!=UNZ_OK)
+	{
+		printf("error %d with zipfile in unzOpenCurrentFilePassword\n",err);
+		return err;
+	}
+
+	*data = (uint8_t *)g_malloc(size + 1);
+	if (*data == NULL)
+	{
+		printf("Error allocating memory\n");
+		unzCloseCurrentFile(uf);
+		return UNZ_INTERNALERROR;
+	}
+
+	for(n = 0; n < size; n += err)
+	{
+		err = unzReadCurrentFile(uf, *data + n, size - n);
+		if (err<=0)
+			break;
+	}
+	if (err<0 || n < size)
+	{
+		printf("error %d with zipfile in unzReadCurrentFile\n",err);
+		unzCloseCurrentFile(uf);
+		g_free(*data);
+		return UNZ_ERRNO;
+	}
+
+	// check CRC
+	err = unzCloseCurrentFile(uf);
+	if (err!=UNZ_OK)
+	{
+		printf("error %d with zipfile in unzCloseCurrentFile\n",err);
+		g_free(*data);
+		return err;
+	}
+
+	return UNZ_OK;
+}
+
 /**
  * tifiles_file_read_tigroup:
  * @filename: the name of file to load.
@@ -781,7 +1270,8 @@ TIEXPORT2 int TICALL tifiles_content_delete_tigroup(TigContent *content)
  *
  * This function load & TiGroup and place its content into content.
  *
- * The temporary folder is used by this function to store temporary files.
+ * Each file of the archive is uncompressed into memory and parsed from there:
+ * no temporary file is used.
  * 
  * Return value: an error code if unsuccessful, 0 otherwise.
  **/
@@ -790,12 +1280,11 @@ TIEXPORT2 int TICALL tifiles_file_read_tigroup(const char *filename, TigContent
 	unzFile uf = NULL;
 	unz_global_info gi;
 	unz_file_info file_info;
-	int cnt, err = UNZ_OK;
+	int err = UNZ_OK;
 	char filename_inzip[256];
 	unsigned i;
-	void* buf = NULL;
-	const char *password = NULL;
 	int vi = 0, ai = 0;
+	char *manifest = NULL;
 
 	// Open ZIP archive
 	uf = unzOpen(filename);
@@ -805,14 +1294,6 @@ TIEXPORT2 int TICALL tifiles_file_read_tigroup(const char *filename, TigContent
 		return ERR_FILE_ZIP;
 	}
 
-	// Allocate
-	buf = (void*)malloc(WRITEBUFFERSIZE);
-    if (buf==NULL)
-    {
-        printf("Error allocating memory\n");
-		goto tfrt_exit;
-    }
-	
 	// Size of comment and number of files in archive
 	err = unzGetGlobalInfo (uf,&gi);
     if (err!=UNZ_OK)
@@ -832,16 +1313,16 @@ TIEXPORT2 int TICALL tifiles_file_read_tigroup(const char *filename, TigContent
 
 	// Get comment
 	g_free(content->comment);
-	content->comment = (char *)g_malloc((gi.size_comment+1) * sizeof(char));
-	err = unzGetGlobalComment(uf, content->comment, gi.size_comment);
+	content->comment = (char *)g_malloc0((gi.size_comment+1) * sizeof(char));
+	err = unzGetGlobalComment(uf, content->comment, gi.size_comment+1);
 
 	// Parse archive for files
 	for (i = 0; i < gi.number_entry; i++)
     {
-		FILE *f;
-		gchar *fname;
-		gchar *utf8;
-		gchar *gfe;
+		uint8_t *data;
+		unsigned long size;
+		FileClass type;
+		int tib;
 
 		// get infos
 		err = unzGetCurrentFileInfo(uf,&file_info,filename_inzip,sizeof(filename_inzip),NULL,0,NULL,0);
@@ -852,76 +1333,47 @@ TIEXPORT2 int TICALL tifiles_file_read_tigroup(const char *filename, TigContent
 		}
 		//printf("Extracting %s with %lu bytes\n", filename_inzip, file_info.uncompressed_size);
 
-		err = unzOpenCurrentFilePassword(uf,password);
-        if (err!=UNZ_OK)
-        {
-            printf("error %d with zipfile in unzOpenCurrentFilePassword\n",err);
+		// extract/uncompress into memory
+		size = file_info.uncompressed_size;
+		err = tigroup_extract_current(uf, size, &data);
+		if (err!=UNZ_OK)
 			goto tfrt_exit;
-        }
-
-		// extract/uncompress into temporary file
-		utf8 = g_locale_to_utf8(filename_inzip, -1, NULL, NULL, NULL);
-		gfe = g_filename_from_utf8(utf8, -1, NULL, NULL, NULL);		
-		fname = g_strconcat(g_get_tmp_dir(), G_DIR_SEPARATOR_S, gfe, NULL);
-		g_free(utf8);
-		g_free(gfe);
 
-		f = g_fopen(fname, "wb");
-		if(f == NULL)
+		// duplicates are restored once all members are read
+		if(!strcmp(filename_inzip, DEDUP_MANIFEST) && manifest == NULL)
 		{
-			err = ERR_FILE_OPEN;
-			goto tfrt_exit;
+			data[size] = '\0';
+			manifest = (char *)data;
+			data = NULL;
 		}
 
-		do
-        {
-            err = unzReadCurrentFile(uf,buf,WRITEBUFFERSIZE);
-            if (err<0)
-            {
-                printf("error %d with zipfile in unzReadCurrentFile\n",err);
-				fclose(f);
-                goto tfrt_exit;
-            }
-            if (err>0)
-			{
-				cnt = fwrite(buf, 1, err, f);
-				if(cnt == -1)
-                {
-                    printf("error in writing extracted file\n");
-                    err=UNZ_ERRNO;
-					fclose(f);
-                    goto tfrt_exit;
-                }
-            }
-        }
-		while (err>0);
-		fclose(f);
-
 		// add to TigContent
+		type = data ? tigroup_member_class(filename_inzip, data, size, &tib) : 0;
+		if(type)
 		{
-			int model = tifiles_file_get_model(fname);
+			int model = tifiles_file_get_model(filename_inzip);
 
 			if(content->model == CALC_NONE)
 				content->model = model;
 
-			if(tifiles_file_is_regular(fname))
+			if(type & TIFILE_REGULAR)
 			{
-				TigEntry *entry = tifiles_te_create(filename_inzip, tifiles_file_get_class(fname), content->model);
+				TigEntry *entry = tifiles_te_create(filename_inzip, type, content->model);
 				int ret;
 
-				ret = tifiles_file_read_regular(fname, entry->content.regular);
-				if(ret) { g_free(entry); unlink(fname); g_free(fname); err = ret; goto tfrt_exit; }
+				ret = tigroup_read_member(entry, filename_inzip, tib, data, size);
+				if(ret) { tifiles_te_delete(entry); g_free(data); err = ret; goto tfrt_exit; }
 
 				content->var_entries[vi++] = entry;
 				content->n_vars++;
 			}
-			else if(tifiles_file_is_flash(fname))
+			else if(type == TIFILE_FLASH)
 			{
-				TigEntry *entry = tifiles_te_create(filename_inzip, tifiles_file_get_class(fname), content->model);
+				TigEntry *entry = tifiles_te_create(filename_inzip, type, content->model);
 				int ret;
 
-				ret = tifiles_file_read_flash(fname, entry->content.flash);
-				if(ret) { g_free(entry); unlink(fname); g_free(fname); err = ret; goto tfrt_exit; }
+				ret = tigroup_read_member(entry, filename_inzip, tib, data, size);
+				if(ret) { tifiles_te_delete(entry); g_free(data); err = ret; goto tfrt_exit; }
 
 				content->app_entries[ai++] = entry;
 				content->n_apps++;
@@ -931,8 +1383,7 @@ TIEXPORT2 int TICALL tifiles_file_read_tigroup(const char *filename, TigContent
 				// skip
 			}
 		}
-		unlink(fname);
-		g_free(fname);
+		g_free(data);
 
 		// next file
 		if ((i+1) < gi.number_entry)
@@ -946,100 +1397,878 @@ TIEXPORT2 int TICALL tifiles_file_read_tigroup(const char *filename, TigContent
 		}
     }	
 
+	if(manifest != NULL)
+		err = tigroup_dedup_restore(content, manifest);
+
 	// Close
 tfrt_exit:
-	g_free(buf);
-	unzCloseCurrentFile(uf);
+	g_free(manifest);
+	unzClose(uf);
 	return err ? ERR_FILE_ZIP : 0;
 }
 
-static int zip_write(zipFile *zf, const char *fname, int comp_level)
+/*
+  Parallel loading of TiGroup files: the central directory is read once, then
+  each worker opens its own handle on the archive and picks members one after
+  the other until none remains or an error occurs. Members are stored at their
+  index and appended in archive order once all workers are done.
+*/
+
+typedef struct
 {
-		int err = ZIP_OK;
-		FILE *f = NULL;
-		zip_fileinfo zi;
-		char filenameinzip[256];
-		unsigned long crcFile=0;
-		int size_read;
-		void* buf=NULL;
+	char			name[256];
+	unz_file_pos	pos;
+	unsigned long	size;
 
-		// missing tmp file !
-		f = g_fopen(fname, "rb");
-		if(f == NULL)
+	TigEntry*		entry;		// NULL if member is not a TI file
+	CalcModel		model;
+	char*			manifest;	// content of member if deduplication manifest
+} TigMember;
+
+typedef struct
+{
+	const char*		filename;
+	CalcModel		model;		// model to create entries with (may be CALC_NONE)
+
+	TigMember*		members;
+	int				n_members;
+
+	volatile gint	next;		// index of next member to process
+	volatile gint	error;		// first error encountered
+} TigReadJob;
+
+static int tigroup_read_member_at(unzFile uf, TigReadJob *job, TigMember *m)
+{
+	uint8_t *data;
+	FileClass type;
+	int tib;
+	int err;
+
+	err = unzGoToFilePos(uf, &m->pos);
+	if (err!=UNZ_OK)
+	{
+		printf("error %d with zipfile in unzGoToFilePos\n",err);
+		return ERR_FILE_ZIP;
+	}
+
+	err = tigroup_extract_current(uf, m->size, &data);
+	if (err!=UNZ_OK)
+		return ERR_FILE_ZIP;
+
+	if (!strcmp(m->name, DEDUP_MANIFEST))
+	{
+		data[m->size] = '\0';
+		m->manifest = (char *)data;
+		return 0;
+	}
+
+	type = tigroup_member_class(m->name, data, m->size, &tib);
+	if((type & TIFILE_REGULAR) || type == TIFILE_FLASH)
+	{
+		m->model = tifiles_file_get_model(m->name);
+		m->entry = tifiles_te_create(m->name, type, job->model != CALC_NONE ? job->model : m->model);
+
+		err = tigroup_read_member(m->entry, m->name, tib, data, m->size);
+		if(err) 
+		{ 
+			tifiles_te_delete(m->entry);
+			m->entry = NULL;
+		}
+	}
+	g_free(data);
+
+	return err;
+}
+
+static gpointer tigroup_read_worker(gpointer data)
+{
+	TigReadJob *job = (TigReadJob *)data;
+	unzFile uf;
+	int i;
+
+	uf = unzOpen(job->filename);
+	if (uf == NULL)
+	{
+		printf("Can't open this file: %s\n", job->filename);
+		g_atomic_int_set(&job->error, ERR_FILE_ZIP);
+		return NULL;
+	}
+
+	while(!g_atomic_int_get(&job->error))
+	{
+		int err;
+
+		i = g_atomic_int_add(&job->next, 1);
+		if(i >= job->n_members)
+			break;
+
+		err = tigroup_read_member_at(uf, job, &job->members[i]);
+		if(err)
+			g_atomic_int_set(&job->error, err);
+	}
+
+	unzClose(uf);
+	return NULL;
+}
+
+/**
+ * tifiles_file_read_tigroup2:
+ * @filename: the name of file to load.
+ * @content: where to store content (may be re-allocated).
+ * @n_threads: number of worker threads or 0 for one per processor.
+ *
+ * Same as #tifiles_file_read_tigroup but the members of the archive are 
+ * uncompressed and parsed concurrently by several threads. Entries are stored 
+ * in the same order as with #tifiles_file_read_tigroup.
+ *
+ * The GLib thread system must have been initialized (this is done by 
+ * #tifiles_library_init).
+ * 
+ * Return value: an error code if unsuccessful, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_read_tigroup2(const char *filename, TigContent *content, int n_threads)
+{
+	unzFile uf = NULL;
+	unz_global_info gi;
+	unz_file_info file_info;
+	TigReadJob job;
+	GThread **threads = NULL;
+	char *manifest = NULL;
+	int err = UNZ_OK;
+	int i, n;
+	int vi = 0, ai = 0;
+
+	// Open ZIP archive
+	uf = unzOpen(filename);
+	if (uf == NULL)
+	{
+		printf("Can't open this file: %s\n", filename);
+		return ERR_FILE_ZIP;
+	}
+
+	// Size of comment and number of files in archive
+	err = unzGetGlobalInfo (uf,&gi);
+	if (err!=UNZ_OK)
+	{
+		printf("error %d with zipfile in unzGetGlobalInfo \n",err);
+		unzClose(uf);
+		return ERR_FILE_ZIP;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.filename = filename;
+	job.model = content->model;
+	job.n_members = gi.number_entry;
+	job.members = (TigMember *)g_malloc0((gi.number_entry + 1) * sizeof(TigMember));
+
+	g_free(content->var_entries);
+	content->var_entries = (TigEntry **)g_malloc0((gi.number_entry + 1) * sizeof(TigEntry *));
+	content->n_vars = 0;
+
+	g_free(content->app_entries);
+	content->app_entries = (TigEntry **)g_malloc0((gi.number_entry + 1) * sizeof(TigEntry *));
+	content->n_apps = 0;
+
+	// Get comment
+	g_free(content->comment);
+	content->comment = (char *)g_malloc0((gi.size_comment+1) * sizeof(char));
+	err = unzGetGlobalComment(uf, content->comment, gi.size_comment+1);
+
+	// Enumerate central directory
+	for (i = 0; i < job.n_members; i++)
+	{
+		TigMember *m = &job.members[i];
+
+		err = unzGetCurrentFileInfo(uf,&file_info,m->name,sizeof(m->name),NULL,0,NULL,0);
+		if (err!=UNZ_OK)
+		{
+			printf("error %d with zipfile in unzGetCurrentFileInfo\n",err);
+			err = ERR_FILE_ZIP;
+			goto tfrt2_exit;
+		}
+		m->size = file_info.uncompressed_size;
+
+		err = unzGetFilePos(uf, &m->pos);
+		if (err!=UNZ_OK)
+		{
+			printf("error %d with zipfile in unzGetFilePos\n",err);
+			err = ERR_FILE_ZIP;
+			goto tfrt2_exit;
+		}
+
+		// next file
+		if ((i+1) < job.n_members)
+		{
+			err = unzGoToNextFile(uf);
+			if (err!=UNZ_OK)
+			{
+				printf("error %d with zipfile in unzGoToNextFile\n",err);
+				err = ERR_FILE_ZIP;
+				goto tfrt2_exit;
+			}
+		}
+	}
+	unzClose(uf);
+	uf = NULL;
+
+	// Uncompress & parse members
+	if(n_threads <= 0)
+		n_threads = cpu_count();
+	if(n_threads > job.n_members)
+		n_threads = job.n_members;
+
+	threads = (GThread **)g_malloc0((n_threads + 1) * sizeof(GThread *));
+	for(n = 0; n < n_threads; n++)
+	{
+		threads[n] = g_thread_try_new("tigroup-read", tigroup_read_worker, &job, NULL);
+		if(threads[n] == NULL)
+			break;
+	}
+	if(n == 0)
+		tigroup_read_worker(&job);	// no thread at all: do it ourselves
+	for(i = 0; i < n; i++)
+		g_thread_join(threads[i]);
+	g_free(threads);
+
+	err = g_atomic_int_get(&job.error);
+
+	// Add to TigContent in archive order
+	for (i = 0; i < job.n_members; i++)
+	{
+		TigMember *m = &job.members[i];
+
+		// duplicates are restored once all members are added
+		if(m->manifest != NULL && manifest == NULL)
+			manifest = m->manifest;
+		else
+			g_free(m->manifest);
+
+		if(m->entry == NULL)
+			continue;
+
+		if(err)
+		{
+			tifiles_te_delete(m->entry);
+			continue;
+		}
+
+		if(content->model == CALC_NONE)
+			content->model = m->model;
+
+		if(m->entry->type == TIFILE_FLASH)
+		{
+			content->app_entries[ai++] = m->entry;
+			content->n_apps++;
+		}
+		else
+		{
+			content->var_entries[vi++] = m->entry;
+			content->n_vars++;
+		}
+	}
+
+	if(manifest != NULL && !err)
+		err = tigroup_dedup_restore(content, manifest);
+	g_free(manifest);
+
+	// Close
+tfrt2_exit:
+	if(uf != NULL)
+		unzClose(uf);
+	g_free(job.members);
+	return err;
+}
+
+/**
+ * tifiles_tigroup_open:
+ * @filename: the name of TiGroup file to open.
+ * @index: address of an index (allocated by this function).
+ *
+ * Read the central directory of a TiGroup file and build an index of its 
+ * members without uncompressing them. Members can then be loaded one by one 
+ * with #tifiles_tigroup_read_entry. The archive is kept opened until 
+ * #tifiles_tigroup_close is called. 
+ *
+ * Entries stored as a copy (see #TigContent) are indexed with the position
+ * of their original. As with #tifiles_file_read_tigroup, the file is
+ * rejected if an original is missing. The manifest member listing them is 
+ * not indexed.
+ *
+ * An index must not be used by several threads at the same time.
+ *
+ * Return value: an error code if unsuccessful, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_tigroup_open(const char *filename, TigIndex **index)
+{
+	TigIndex *idx;
+	TigIndexEntry *ie;
+	TigIndexEntry *manifest = NULL;
+	unzFile uf;
+	unz_global_info gi;
+	unz_file_info file_info;
+	char filename_inzip[256];
+	int err;
+	int i;
+
+	*index = NULL;
+
+	uf = unzOpen(filename);
+	if (uf == NULL)
+	{
+		printf("Can't open this file: %s\n", filename);
+		return ERR_FILE_ZIP;
+	}
+
+	err = unzGetGlobalInfo (uf,&gi);
+	if (err!=UNZ_OK)
+	{
+		printf("error %d with zipfile in unzGetGlobalInfo \n",err);
+		unzClose(uf);
+		return ERR_FILE_ZIP;
+	}
+
+	idx = (TigIndex *)g_malloc0(sizeof(TigIndex));
+	idx->filename = g_strdup(filename);
+	idx->model = CALC_NONE;
+	idx->uf = uf;
+	idx->names = g_hash_table_new(g_str_hash, g_str_equal);
+	idx->entries = (TigIndexEntry **)g_malloc0((gi.number_entry + 1) * sizeof(TigIndexEntry *));
+
+	idx->comment = (char *)g_malloc0((gi.size_comment+1) * sizeof(char));
+	unzGetGlobalComment(uf, idx->comment, gi.size_comment+1);
+
+	// Parse central directory
+	for (i = 0; i < (int)gi.number_entry; i++)
+	{
+		unz_file_pos pos;
+		int tib;
+
+		err = unzGetCurrentFileInfo(uf,&file_info,filename_inzip,sizeof(filename_inzip),NULL,0,NULL,0);
+		if (err!=UNZ_OK)
+		{
+			printf("error %d with zipfile in unzGetCurrentFileInfo\n",err);
+			err = ERR_FILE_ZIP;
+			goto ttgo_exit;
+		}
+
+		err = unzGetFilePos(uf, &pos);
+		if (err!=UNZ_OK)
+		{
+			printf("error %d with zipfile in unzGetFilePos\n",err);
+			err = ERR_FILE_ZIP;
+			goto ttgo_exit;
+		}
+
+		ie = (TigIndexEntry *)g_malloc0(sizeof(TigIndexEntry));
+		ie->filename = g_strdup(filename_inzip);
+		ie->size = file_info.uncompressed_size;
+		ie->compressed_size = file_info.compressed_size;
+		ie->pos[0] = pos.pos_in_zip_directory;
+		ie->pos[1] = pos.num_of_file;
+		ie->type = tigroup_member_class(filename_inzip, NULL, ie->size, &tib);
+
+		if(ie->type && idx->model == CALC_NONE)
+			idx->model = tifiles_file_get_model(filename_inzip);
+
+		if (!strcmp(ie->filename, DEDUP_MANIFEST))
+		{
+			// not a member for users of the index
+			if (manifest == NULL)
+				manifest = ie;
+			else
+			{
+				g_free(ie->filename);
+				g_free(ie);
+			}
+		}
+		else
+		{
+			// first member wins if a name is duplicated
+			idx->entries[idx->n_entries++] = ie;
+			if (g_hash_table_lookup(idx->names, ie->filename) == NULL)
+				g_hash_table_insert(idx->names, ie->filename, ie);
+		}
+
+		// next file
+		if ((i+1) < (int)gi.number_entry)
+		{
+			err = unzGoToNextFile(uf);
+			if (err!=UNZ_OK)
+			{
+				printf("error %d with zipfile in unzGoToNextFile\n",err);
+				err = ERR_FILE_ZIP;
+				goto ttgo_exit;
+			}
+		}
+	}
+
+	// Duplicates (see #TigContent) share the position of their original
+	if (manifest != NULL)
+	{
+		unz_file_pos pos;
+		uint8_t *data;
+		const char *line, *tab, *eol;
+
+		pos.pos_in_zip_directory = manifest->pos[0];
+		pos.num_of_file = manifest->pos[1];
+		err = unzGoToFilePos(uf, &pos);
+		if (err==UNZ_OK)
+			err = tigroup_extract_current(uf, manifest->size, &data);
+		if (err!=UNZ_OK)
+		{
+			err = ERR_FILE_ZIP;
+			goto ttgo_exit;
+		}
+		data[manifest->size] = '\0';
+
+		for (line = (char *)data; *line; line = *eol ? eol + 1 : eol)
+		{
+			TigIndexEntry *orig;
+			char *name;
+
+			eol = strchr(line, '\n');
+			if (eol == NULL)
+				eol = line + strlen(line);
+			tab = memchr(line, '\t', eol - line);
+			if (tab == NULL)
+				continue;
+
+			name = g_strndup(tab + 1, eol - tab - 1);
+			orig = (TigIndexEntry *)g_hash_table_lookup(idx->names, name);
+			if (orig == NULL)
+			{
+				// rejected as by tigroup_dedup_restore
+				tifiles_warning("%.*s: original member %s not found", (int)(tab - line), line, name);
+				g_free(name);
+				g_free(data);
+				err = ERR_INVALID_FILE;
+				goto ttgo_exit;
+			}
+			g_free(name);
+
+			ie = (TigIndexEntry *)g_malloc0(sizeof(TigIndexEntry));
+			*ie = *orig;
+			ie->filename = g_strndup(line, tab - line);
+
+			idx->entries = (TigIndexEntry **)g_realloc(idx->entries, (idx->n_entries + 2) * sizeof(TigIndexEntry *));
+			idx->entries[idx->n_entries++] = ie;
+			idx->entries[idx->n_entries] = NULL;
+			if (g_hash_table_lookup(idx->names, ie->filename) == NULL)
+				g_hash_table_insert(idx->names, ie->filename, ie);
+		}
+		g_free(data);
+	}
+
+ttgo_exit:
+	if(manifest != NULL)
+	{
+		g_free(manifest->filename);
+		g_free(manifest);
+	}
+	if(err)
+	{
+		tifiles_tigroup_close(idx);
+		return err;
+	}
+
+	*index = idx;
+	return 0;
+}
+
+/**
+ * tifiles_tigroup_read_entry:
+ * @index: an index returned by #tifiles_tigroup_open.
+ * @name: the name of member in archive.
+ * @entry: address of an entry (allocated by this function).
+ *
+ * Uncompress and parse a single member of a TiGroup file. The entry must be
+ * released with #tifiles_te_delete.
+ *
+ * Return value: an error code if unsuccessful, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_tigroup_read_entry(TigIndex *index, const char *name, TigEntry **entry)
+{
+	TigIndexEntry *ie;
+	unz_file_pos pos;
+	uint8_t *data;
+	FileClass type;
+	int tib;
+	int err;
+
+	*entry = NULL;
+
+	ie = (TigIndexEntry *)g_hash_table_lookup(index->names, name);
+	if (ie == NULL)
+	{
+		tifiles_warning("%s: no such member in %s", name, index->filename);
+		return ERR_INVALID_FILE;
+	}
+
+	pos.pos_in_zip_directory = ie->pos[0];
+	pos.num_of_file = ie->pos[1];
+	err = unzGoToFilePos(index->uf, &pos);
+	if (err!=UNZ_OK)
+	{
+		printf("error %d with zipfile in unzGoToFilePos\n",err);
+		return ERR_FILE_ZIP;
+	}
+
+	err = tigroup_extract_current(index->uf, ie->size, &data);
+	if (err!=UNZ_OK)
+		return ERR_FILE_ZIP;
+
+	type = tigroup_member_class(ie->filename, data, ie->size, &tib);
+	if(!(type & TIFILE_REGULAR) && type != TIFILE_FLASH)
+	{
+		g_free(data);
+		return ERR_INVALID_FILE;
+	}
+
+	*entry = tifiles_te_create(ie->filename, type, index->model);
+	err = tigroup_read_member(*entry, ie->filename, tib, data, ie->size);
+	g_free(data);
+
+	if(err)
+	{
+		tifiles_te_delete(*entry);
+		*entry = NULL;
+	}
+
+	return err;
+}
+
+/**
+ * tifiles_tigroup_close:
+ * @index: an index returned by #tifiles_tigroup_open.
+ *
+ * Close the archive and release the index.
+ *
+ * Return value: always 0.
+ **/
+TIEXPORT2 int TICALL tifiles_tigroup_close(TigIndex *index)
+{
+	int i;
+
+	if(index == NULL)
+		return 0;
+
+	unzClose(index->uf);
+	g_hash_table_destroy(index->names);
+
+	for(i = 0; i < index->n_entries; i++)
+	{
+		g_free(index->entries[i]->filename);
+		g_free(index->entries[i]);
+	}
+	g_free(index->entries);
+	g_free(index->comment);
+	g_free(index->filename);
+	g_free(index);
+
+	return 0;
+}
+
+/*
+  Serialize an entry into a memory buffer (to be freed with free()).
+*/
+static int tigroup_write_member(TigEntry *entry, uint8_t **data, size_t *len)
+{
+	FILE *f;
+	CalcModel model;
+	int ret;
+
+	f = fopen_memstream(data, len);
+	if (f == NULL)
+		return ERR_MALLOC;
+
+	if(entry->type == TIFILE_FLASH)
+	{
+		model = entry->content.flash->model;
+#if !defined(DISABLE_TI8X)
+		if (tifiles_calc_is_ti8x(model))
+			ret = ti8x_fwrite_flash(f, entry->content.flash);
+		else
+#endif
+#if !defined(DISABLE_TI9X)
+		if (tifiles_calc_is_ti9x(model))
+			ret = ti9x_fwrite_flash(f, entry->content.flash);
+		else
+#endif
+		ret = ERR_BAD_CALC;
+	}
+	else
+	{
+		model = entry->content.regular->model;
+#if !defined(DISABLE_TI8X)
+		if (tifiles_calc_is_ti8x(model))
+			ret = ti8x_fwrite_regular(f, entry->content.regular);
+		else
+#endif
+#if !defined(DISABLE_TI9X)
+		if (tifiles_calc_is_ti9x(model))
+			ret = ti9x_fwrite_regular(f, entry->content.regular);
+		else
+#endif
+		if (model == CALC_NSPIRE)
+			ret = tnsp_fwrite_regular(f, entry->content.regular);
+		else
+			ret = ERR_BAD_CALC;
+	}
+
+	if(fclose_memstream(f, data, len))
+		return ret ? ret : ERR_FILE_IO;
+	if(ret)
+	{
+		free(*data);
+		*data = NULL;
+	}
+
+	return ret;
+}
+
+static int zip_deflate(const uint8_t *data, size_t len, int level, uint8_t **cdata, size_t *clen);
+
+/*
+  Give the zlib level to store a member with.
+  - comp_level [in]: see #TigContent
+  - data [in]: member to store (used by adaptive mode only)
+  - [out]: a zlib compression level or 0 if member must be stored
+  The strategy is always Z_DEFAULT_STRATEGY (see #TigContent).
+*/
+static int zip_level(int comp_level, const uint8_t *data, size_t len)
+{
+	// comp_level 1 to 4 is slow to fast
+	static const int levels[] = { 0, 9, 6, 3, 1 };
+	uint8_t *cdata;
+	size_t clen, n;
+
+	if (comp_level <= 0)
+		return 0;
+	if (comp_level < ADAPTIVE_COMP_LEVEL)
+		return levels[comp_level];
+	
+	// adaptive: tiny members aren't worth it...
+	if (len < ADAPTIVE_MIN_SIZE)
+		return 0;
+
+	// ... as well as members which are already compressed or encrypted (some
+	// flash apps, certificates, Nspire documents). Sample is taken in the middle 
+	// of member to skip headers.
+	n = len < ADAPTIVE_SAMPLE ? len : ADAPTIVE_SAMPLE;
+	if (zip_deflate(data + (len - n) / 2, n, 1, &cdata, &clen))
+		return levels[2];
+	free(cdata);
+
+	return clen * 100 < n * ADAPTIVE_MAX_RATIO ? levels[2] : 0;
+}
+
+static void zip_fileinfo_now(zip_fileinfo *zi)
+{
+		time_t now = time(NULL);
+		struct tm lt;
+
+#ifdef __WIN32__
+		lt = *localtime(&now);	// thread-local storage in the C runtime
+#else
+		localtime_r(&now, &lt);
+#endif
+
+		// time stamp is the creation time of the archive
+		zi->tmz_date.tm_sec = lt.tm_sec;
+		zi->tmz_date.tm_min = lt.tm_min;
+		zi->tmz_date.tm_hour = lt.tm_hour;
+		zi->tmz_date.tm_mday = lt.tm_mday;
+		zi->tmz_date.tm_mon = lt.tm_mon;
+		zi->tmz_date.tm_year = lt.tm_year;
+        zi->dosDate = 0;
+        zi->internal_fa = 0;
+        zi->external_fa = 0;
+}
+
+static int zip_write(zipFile *zf, const char *filenameinzip, const uint8_t *data, size_t len, int comp_level)
+{
+		int err = ZIP_OK;
+		zip_fileinfo zi;
+		unsigned long crcFile=0;
+		int level = zip_level(comp_level, data, len);
+
+		zip_fileinfo_now(&zi);
+
+		err = zipOpenNewFileInZip3(*zf,filenameinzip,&zi,
+                                 NULL,0,NULL,0,NULL /* comment*/,
+                                 level ? Z_DEFLATED : 0 /* comp method */,
+                                 level /*comp level */,0,
+                                 -MAX_WBITS, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY,
+                                 NULL /* no pwd*/,crcFile);
+        if (err != ZIP_OK)
+		{
+            printf("error in opening %s in zipfile\n",filenameinzip);
+			return ERR_FILE_ZIP;
+		}		
+
+		// feed with our data
+		if (len > 0)
+		{
+			err = zipWriteInFileInZip (*zf,data,len);
+			if (err<0)
+				printf("error in writing %s in the zipfile\n", filenameinzip);
+		}
+
+		// close file
+		if (zipCloseFileInZip(*zf) != ZIP_OK && err == ZIP_OK)
+		{
+            printf("error in closing %s in the zipfile\n", filenameinzip);
+			err = ZIP_ERRNO;
+		}
+
+		return err == ZIP_OK ? 0 : ERR_FILE_ZIP;
+}
+
+/*
+  Same as zip_write but data has already been compressed ('raw' data).
+  - size [in]: uncompressed size of data
+  - crc [in]: CRC32 of uncompressed data
+  - level [in]: zlib level data was compressed with (0 if stored)
+*/
+static int zip_write_raw(zipFile *zf, const char *filenameinzip, const uint8_t *data, size_t len, 
+						 unsigned long size, unsigned long crc, int level)
+{
+		int err = ZIP_OK;
+		zip_fileinfo zi;
+
+		zip_fileinfo_now(&zi);
+
+		err = zipOpenNewFileInZip2(*zf,filenameinzip,&zi,
+                                 NULL,0,NULL,0,NULL /* comment*/,
+                                 level ? Z_DEFLATED : 0 /* comp method */,
+                                 level /*comp level */, 1 /* raw */);
+        if (err != ZIP_OK)
+		{
+            printf("error in opening %s in zipfile\n",filenameinzip);
+			return ERR_FILE_ZIP;
+		}		
+
+		if (len > 0)
 		{
-		  printf("error in opening tmp file %s\n", fname);
-			err = ERR_FILE_OPEN;
-			goto zw_exit;
+			err = zipWriteInFileInZip (*zf,data,len);
+			if (err<0)
+				printf("error in writing %s in the zipfile\n", filenameinzip);
 		}
-		strcpy(filenameinzip, fname);
 
-		// Allocate buffer
-		buf = (void*)g_malloc(WRITEBUFFERSIZE);
-		if (buf==NULL)
+		if (zipCloseFileInZipRaw(*zf, size, crc) != ZIP_OK && err == ZIP_OK)
 		{
-			printf("Error allocating memory\n");
-			goto zw_exit;
+            printf("error in closing %s in the zipfile\n", filenameinzip);
+			err = ZIP_ERRNO;
 		}
 
-		// update time stamp (to do ?)
-		zi.tmz_date.tm_sec = zi.tmz_date.tm_min = zi.tmz_date.tm_hour =
-        zi.tmz_date.tm_mday = zi.tmz_date.tm_mon = zi.tmz_date.tm_year = 0;
-        zi.dosDate = 0;
-        zi.internal_fa = 0;
-        zi.external_fa = 0;
-        filetime(filenameinzip,&zi.tmz_date,&zi.dosDate);
+		return err == ZIP_OK ? 0 : ERR_FILE_ZIP;
+}
 
-		err = zipOpenNewFileInZip3(*zf,filenameinzip,&zi,
+/*
+  Copy the current file of an archive into another archive without 
+  uncompressing it (time stamp and attributes are kept).
+*/
+static int zip_copy_raw(unzFile uf, zipFile *zf, const char *filenameinzip, unz_file_info *fi)
+{
+		int err = ZIP_OK;
+		zip_fileinfo zi;
+		uint8_t buf[8192];
+		int method, level;
+		int n;
+
+		zi.tmz_date.tm_sec = fi->tmu_date.tm_sec;
+		zi.tmz_date.tm_min = fi->tmu_date.tm_min;
+		zi.tmz_date.tm_hour = fi->tmu_date.tm_hour;
+		zi.tmz_date.tm_mday = fi->tmu_date.tm_mday;
+		zi.tmz_date.tm_mon = fi->tmu_date.tm_mon;
+		zi.tmz_date.tm_year = fi->tmu_date.tm_year;
+        zi.dosDate = fi->dosDate;
+        zi.internal_fa = fi->internal_fa;
+        zi.external_fa = fi->external_fa;
+
+		err = unzOpenCurrentFile2(uf, &method, &level, 1);
+		if (err != UNZ_OK)
+		{
+			printf("error %d with zipfile in unzOpenCurrentFile2\n",err);
+			return ERR_FILE_ZIP;
+		}
+
+		err = zipOpenNewFileInZip2(*zf,filenameinzip,&zi,
                                  NULL,0,NULL,0,NULL /* comment*/,
-                                 comp_level ? Z_DEFLATED : 0 /* comp method */,
-                                 1 /*comp level */,0,
-                                 -MAX_WBITS, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY,
-                                 NULL /* no pwd*/,crcFile);
+                                 method, level, 1 /* raw */);
         if (err != ZIP_OK)
 		{
             printf("error in opening %s in zipfile\n",filenameinzip);
+			unzCloseCurrentFile(uf);
 			return ERR_FILE_ZIP;
 		}		
 
-		do
-        {
-			// feed with our data
-            err = ZIP_OK;
-			size_read = fread(buf, 1, WRITEBUFFERSIZE, f);
-
-            if (size_read < WRITEBUFFERSIZE)
+		while ((n = unzReadCurrentFile(uf, buf, sizeof(buf))) > 0)
+		{
+			err = zipWriteInFileInZip (*zf,buf,n);
+			if (err != ZIP_OK)
 			{
-				if (!feof(f))
-				{
-					printf("error in reading %s\n",filenameinzip);
-					err = ZIP_ERRNO;
-					goto zw_exit;
-				}
+				printf("error in writing %s in the zipfile\n", filenameinzip);
+				break;
 			}
-            if (size_read > 0)
-            {
-                err = zipWriteInFileInZip (*zf,buf,size_read);
-                if (err<0)
-                {
-                    printf("error in writing %s in the zipfile\n", filenameinzip);
-					goto zw_exit;
-                }
-
-            }
-        } while ((err == ZIP_OK) && (size_read>0));
+		}
+		if (n < 0 && err == ZIP_OK)
+		{
+			printf("error %d with zipfile in unzReadCurrentFile\n",n);
+			err = ZIP_ERRNO;
+		}
+		unzCloseCurrentFile(uf);
 
-		// close file
-		err = zipCloseFileInZip(*zf);
-        if (err!=ZIP_OK)
+		if (zipCloseFileInZipRaw(*zf, fi->uncompressed_size, fi->crc) != ZIP_OK && err == ZIP_OK)
 		{
             printf("error in closing %s in the zipfile\n", filenameinzip);
-			goto zw_exit;
+			err = ZIP_ERRNO;
 		}
 
-zw_exit:
-		g_free(buf);
-		fclose(f);
-		return err;
+		return err == ZIP_OK ? 0 : ERR_FILE_ZIP;
+}
+
+/*
+  Compress a buffer the same way as zip_write does (raw deflate, no zlib 
+  header) into a newly allocated buffer (to be released with free).
+  - level [in]: zlib compression level
+  - [out]: 0 if successful, an error code otherwise
+*/
+static int zip_deflate(const uint8_t *data, size_t len, int level, uint8_t **cdata, size_t *clen)
+{
+	z_stream zs;
+	int err;
+
+	memset(&zs, 0, sizeof(zs));
+	err = deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+	if (err != Z_OK)
+		return ERR_FILE_ZIP;
+
+	*clen = deflateBound(&zs, len);
+	*cdata = (uint8_t *)malloc(*clen);
+	if (*cdata == NULL)
+	{
+		deflateEnd(&zs);
+		return ERR_MALLOC;
+	}
+
+	zs.next_in = (Bytef *)data;
+	zs.avail_in = len;
+	zs.next_out = *cdata;
+	zs.avail_out = *clen;
+
+	err = deflate(&zs, Z_FINISH);
+	*clen = zs.total_out;
+	deflateEnd(&zs);
+
+	if (err != Z_STREAM_END)
+	{
+		free(*cdata);
+		*cdata = NULL;
+		return ERR_FILE_ZIP;
+	}
+
+	return 0;
 }
 
 /**
@@ -1050,7 +2279,8 @@ zw_exit:
  * This function store TiGroup contents to file. Please note that contents 
  * can contains no data. In this case, the file is void but created.
  *
- * The temporary folder is used by this function to store temporary files.
+ * Each entry is serialized into memory and stored from there into the
+ * archive: no temporary file is used and the current directory is kept.
  *
  * Return value: an error code if unsuccessful, 0 otherwise.
  **/
@@ -1058,71 +2288,571 @@ TIEXPORT2 int TICALL tifiles_file_write_tigroup(const char *filename, TigContent
 {
 	zipFile zf;
 	int err = ZIP_OK;
-	gchar *old_dir = g_get_current_dir();
 	TigEntry **ptr;
+	char *tmpname;
+	int fd;
+	GHashTable *digests = NULL;
+	GString *manifest = NULL;
+
+	// Archive is built into a sibling file which replaces filename when complete
+	fd = fcreate_sibling(filename, &tmpname);
+	if (fd == -1)
+	{
+		printf("Can't open this file: %s\n", filename);
+		return ERR_FILE_OPEN;
+	}
+	close(fd);
 
 	// Open ZIP archive (and set comment)
 #ifdef USEWIN32IOAPI
         zlib_filefunc_def ffunc;
         fill_win32_filefunc(&ffunc);
 
-        zf = zipOpen2(filename, APPEND_STATUS_CREATE, &(content->comment), &ffunc);
+        zf = zipOpen2(tmpname, APPEND_STATUS_CREATE, &(content->comment), &ffunc);
 #else
-        zf = zipOpen(filename, APPEND_STATUS_CREATE);
+        zf = zipOpen(tmpname, APPEND_STATUS_CREATE);
 #endif
 	if (zf == NULL)
 	{
 		printf("Can't open this file: %s\n", filename);
+		fcommit_sibling(tmpname, filename, 0);
 		return ERR_FILE_ZIP;
 	}
-	g_chdir(g_get_tmp_dir());
+
+	if(content->dedup)
+	{
+		digests = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+		manifest = g_string_new("");
+	}
 
 	// Parse entries and store
-	for(ptr = content->var_entries; *ptr; ptr++)
+	for(ptr = content->var_entries; *ptr && !err; ptr++)
 	{
 		TigEntry* entry = *ptr;
 		char *fname = NULL;
+		uint8_t *data;
+		size_t len;
+
+		// build TI file into memory
+		err = tigroup_write_member(entry, &data, &len);
+		if(err)
+			break;
 
 		// ZIP archives don't like greek chars
 		fname = ticonv_gfe_to_zfe(content->model, entry->filename);
 
-		// write TI file into tmp folder
-		TRYC(tifiles_file_write_regular(fname, entry->content.regular, NULL));
-
-		err = zip_write(&zf, fname, content->comp_level);
+		if(!digests || !tigroup_dedup(digests, manifest, fname, tigroup_digest(data, len)))
+			err = zip_write(&zf, fname, data, len, content->comp_level);
 		g_free(fname);
-
-		if(err)
-			break;
+		free(data);
 	}
 
-	for(ptr = content->app_entries; *ptr; ptr++)
+	for(ptr = content->app_entries; *ptr && !err; ptr++)
 	{
 		TigEntry* entry = *ptr;
 		char *fname = NULL;
+		uint8_t *data;
+		size_t len;
+
+		// build TI file into memory
+		err = tigroup_write_member(entry, &data, &len);
+		if(err)
+			break;
 
 		// ZIP archives don't like greek chars
 		fname = ticonv_gfe_to_zfe(content->model, entry->filename);
 
-		// write TI file into tmp folder
-		TRYC(tifiles_file_write_flash(fname, entry->content.flash));
-
-		err = zip_write(&zf, fname, content->comp_level);
+		if(!digests || !tigroup_dedup(digests, manifest, fname, tigroup_digest(data, len)))
+			err = zip_write(&zf, fname, data, len, content->comp_level);
 		g_free(fname);
+		free(data);
+	}
+
+	if(digests)
+	{
+		if(manifest->len > 0 && !err)
+			err = zip_write(&zf, DEDUP_MANIFEST, (uint8_t *)manifest->str, manifest->len, content->comp_level);
+		g_hash_table_destroy(digests);
+		g_string_free(manifest, TRUE);
+	}
+
+	// close archive
+	if (zipClose(zf,NULL) != ZIP_OK && err == ZIP_OK)
+		err = ERR_FILE_ZIP;
+    if (err != ZIP_OK)
+    {
+        printf("error in closing %s\n",filename);
+    }
+	
+	if(fcommit_sibling(tmpname, filename, err == ZIP_OK) && err == ZIP_OK)
+		err = ERR_FILE_CLOSE;
+	return err;
+}
+
+/*
+  Parallel writing of TiGroup files: worker threads build and compress entries 
+  while the calling thread stores them into the archive, in the original order, 
+  as soon as they are ready. Workers can't get more than a few members ahead of 
+  the calling thread so that memory use stays bounded.
+*/
+
+typedef struct
+{
+	TigEntry*		entry;
+
+	uint8_t*		data;		// compressed data (allocated with malloc)
+	size_t			len;
+	unsigned long	size;		// uncompressed size
+	unsigned long	crc;
+	int				level;		// zlib level (0 if stored)
+	char*			digest;		// content digest if deduplication
+
+	int				err;
+	int				done;		// protected by mutex
+} TigPacked;
+
+typedef struct
+{
+	TigPacked*		members;
+	int				n_members;
+	int				comp_level;
+	int				dedup;
+
+	volatile gint	next;		// index of next member to process
+	volatile gint	error;		// set to stop workers
+
+	int				window;		// max number of members packed but not stored yet
+	int				stored;		// number of members stored (protected by mutex)
+
+	GMutex			mutex;
+	GCond			cond;		// signaled when a member is done
+	GCond			space;		// signaled when a member is stored
+} TigWriteJob;
+
+static int tigroup_pack_member(TigWriteJob *job, TigPacked *m)
+{
+	uint8_t *data;
+	size_t len;
+	int err;
+
+	err = tigroup_write_member(m->entry, &data, &len);
+	if(err)
+		return err;
+
+	m->size = len;
+	m->crc = crc32(crc32(0L, Z_NULL, 0), data, len);
+	if(job->dedup)
+		m->digest = tigroup_digest(data, len);
+
+	m->level = zip_level(job->comp_level, data, len);
+	if(m->level)
+	{
+		err = zip_deflate(data, len, m->level, &m->data, &m->len);
+		free(data);
+	}
+	else
+	{
+		m->data = data;
+		m->len = len;
+	}
+
+	return err;
+}
+
+static gpointer tigroup_write_worker(gpointer data)
+{
+	TigWriteJob *job = (TigWriteJob *)data;
+	int i, err;
+
+	while(!g_atomic_int_get(&job->error))
+	{
+		TigPacked *m;
+
+		i = g_atomic_int_add(&job->next, 1);
+		if(i >= job->n_members)
+			break;
+		m = &job->members[i];
+
+		// wait for the calling thread to catch up
+		g_mutex_lock(&job->mutex);
+		while(i >= job->stored + job->window && !g_atomic_int_get(&job->error))
+			g_cond_wait(&job->space, &job->mutex);
+		g_mutex_unlock(&job->mutex);
+
+		// a member which has been taken is always marked as done (with the 
+		// error of another member if any) else the calling thread would wait
+		// for it forever
+		err = g_atomic_int_get(&job->error);
+		if(!err)
+		{
+			err = tigroup_pack_member(job, m);
+			if(err)
+				g_atomic_int_set(&job->error, err);
+		}
+
+		g_mutex_lock(&job->mutex);
+		m->err = err;
+		m->done = 1;
+		g_cond_broadcast(&job->cond);
+		g_mutex_unlock(&job->mutex);
+	}
+
+	return NULL;
+}
+
+/**
+ * tifiles_file_write_tigroup2:
+ * @filename: the name of file to load.
+ * @content: where to store content.
+ * @n_threads: number of worker threads or 0 for one per processor.
+ *
+ * Same as #tifiles_file_write_tigroup but entries are built and compressed 
+ * concurrently by several threads. The archive is written by the calling 
+ * thread in the same order as with #tifiles_file_write_tigroup. At most 
+ * twice as many entries as threads are held in memory at once.
+ *
+ * The GLib thread system must have been initialized (this is done by 
+ * #tifiles_library_init).
+ *
+ * Return value: an error code if unsuccessful, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_file_write_tigroup2(const char *filename, TigContent *content, int n_threads)
+{
+	zipFile zf;
+	int err = ZIP_OK;
+	TigWriteJob job;
+	GThread **threads;
+	TigEntry **ptr;
+	char *tmpname;
+	int fd;
+	int i, n;
+	GHashTable *digests = NULL;
+	GString *manifest = NULL;
+
+	// Archive is built into a sibling file which replaces filename when complete
+	fd = fcreate_sibling(filename, &tmpname);
+	if (fd == -1)
+	{
+		printf("Can't open this file: %s\n", filename);
+		return ERR_FILE_OPEN;
+	}
+	close(fd);
+
+	// Open ZIP archive (and set comment)
+#ifdef USEWIN32IOAPI
+        zlib_filefunc_def ffunc;
+        fill_win32_filefunc(&ffunc);
+
+        zf = zipOpen2(tmpname, APPEND_STATUS_CREATE, &(content->comment), &ffunc);
+#else
+        zf = zipOpen(tmpname, APPEND_STATUS_CREATE);
+#endif
+	if (zf == NULL)
+	{
+		printf("Can't open this file: %s\n", filename);
+		fcommit_sibling(tmpname, filename, 0);
+		return ERR_FILE_ZIP;
+	}
+
+	// List entries: variables then applications
+	memset(&job, 0, sizeof(job));
+	job.comp_level = content->comp_level;
+	job.dedup = content->dedup;
+	job.members = (TigPacked *)g_malloc0((content->n_vars + content->n_apps + 1) * sizeof(TigPacked));
+	for(ptr = content->var_entries; *ptr; ptr++)
+		job.members[job.n_members++].entry = *ptr;
+	for(ptr = content->app_entries; *ptr; ptr++)
+		job.members[job.n_members++].entry = *ptr;
+	g_mutex_init(&job.mutex);
+	g_cond_init(&job.cond);
+	g_cond_init(&job.space);
+
+	if(content->dedup)
+	{
+		digests = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+		manifest = g_string_new("");
+	}
+
+	// Start workers
+	if(n_threads <= 0)
+		n_threads = cpu_count();
+	if(n_threads > job.n_members)
+		n_threads = job.n_members;
+	job.window = 2 * n_threads;
+
+	threads = (GThread **)g_malloc0((n_threads + 1) * sizeof(GThread *));
+	for(n = 0; n < n_threads; n++)
+	{
+		threads[n] = g_thread_try_new("tigroup-write", tigroup_write_worker, &job, NULL);
+		if(threads[n] == NULL)
+			break;
+	}
+	if(n == 0)
+	{
+		job.window = job.n_members;	// nobody stores while we work
+		tigroup_write_worker(&job);	// no thread at all: do it ourselves
+	}
+
+	// Store entries as soon as they are ready
+	for(i = 0; i < job.n_members && !err; i++)
+	{
+		TigPacked *m = &job.members[i];
+		char *fname;
 
+		g_mutex_lock(&job.mutex);
+		while(!m->done)
+			g_cond_wait(&job.cond, &job.mutex);
+		g_mutex_unlock(&job.mutex);
+
+		err = m->err;
 		if(err)
 			break;
+
+		// ZIP archives don't like greek chars
+		fname = ticonv_gfe_to_zfe(content->model, m->entry->filename);
+
+		if(!digests || !tigroup_dedup(digests, manifest, fname, m->digest))
+			err = zip_write_raw(&zf, fname, m->data, m->len, m->size, m->crc, m->level);
+		m->digest = NULL;
+		g_free(fname);
+		free(m->data);
+		m->data = NULL;
+
+		g_mutex_lock(&job.mutex);
+		job.stored = i + 1;
+		g_cond_broadcast(&job.space);
+		g_mutex_unlock(&job.mutex);
+	}
+
+	// Stop workers on error and wait for them
+	if(err)
+	{
+		g_mutex_lock(&job.mutex);
+		g_atomic_int_set(&job.error, err);
+		g_cond_broadcast(&job.space);
+		g_mutex_unlock(&job.mutex);
+	}
+	for(i = 0; i < n; i++)
+		g_thread_join(threads[i]);
+	g_free(threads);
+
+	for(i = 0; i < job.n_members; i++)
+	{
+		free(job.members[i].data);
+		g_free(job.members[i].digest);
+	}
+	g_free(job.members);
+
+	if(digests)
+	{
+		if(manifest->len > 0 && !err)
+			err = zip_write(&zf, DEDUP_MANIFEST, (uint8_t *)manifest->str, manifest->len, content->comp_level);
+		g_hash_table_destroy(digests);
+		g_string_free(manifest, TRUE);
 	}
+	g_mutex_clear(&job.mutex);
+	g_cond_clear(&job.cond);
+	g_cond_clear(&job.space);
 
 	// close archive
-	err = zipClose(zf,NULL);
+	if (zipClose(zf,NULL) != ZIP_OK && err == ZIP_OK)
+		err = ERR_FILE_ZIP;
     if (err != ZIP_OK)
     {
         printf("error in closing %s\n",filename);
-		unlink(filename);
     }
 	
-	g_chdir(old_dir);
+	if(fcommit_sibling(tmpname, filename, err == ZIP_OK) && err == ZIP_OK)
+		err = ERR_FILE_CLOSE;
+	return err;
+}
+
+/**
+ * tifiles_tigroup_writer_open:
+ * @filename: the name of TiGroup file to write.
+ * @model: a calculator model or CALC_NONE to use the model of the first entry.
+ * @comp_level: compression level (see #TigContent).
+ * @writer: address of a writer (allocated by this function).
+ *
+ * Start writing a TiGroup file one entry at a time: each entry given to 
+ * #tifiles_tigroup_writer_add_regular or #tifiles_tigroup_writer_add_flash
+ * is compressed into the archive at once and is not referenced any longer, 
+ * hence the memory used doesn't depend on the size of the archive.
+ *
+ * The archive is built into a temporary file which replaces filename when
+ * #tifiles_tigroup_writer_close is called.
+ *
+ * Return value: an error code if unsuccessful, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_tigroup_writer_open(const char *filename, CalcModel model, int comp_level, TigWriter **writer)
+{
+	TigWriter *w;
+	char *tmpname;
+	zipFile zf;
+	int fd;
+
+	*writer = NULL;
+
+	fd = fcreate_sibling(filename, &tmpname);
+	if (fd == -1)
+	{
+		printf("Can't open this file: %s\n", filename);
+		return ERR_FILE_OPEN;
+	}
+	close(fd);
+
+	zf = zipOpen(tmpname, APPEND_STATUS_CREATE);
+	if (zf == NULL)
+	{
+		printf("Can't open this file: %s\n", filename);
+		fcommit_sibling(tmpname, filename, 0);
+		return ERR_FILE_ZIP;
+	}
+
+	w = (TigWriter *)g_malloc0(sizeof(TigWriter));
+	w->filename = g_strdup(filename);
+	w->model = model;
+	w->comp_level = comp_level;
+	w->tmpname = tmpname;
+	w->zf = zf;
+
+	*writer = w;
+	return 0;
+}
+
+/*
+  Serialize an entry and compress it into the archive.
+*/
+static int tigroup_writer_add(TigWriter *writer, TigEntry *te)
+{
+	char *fname;
+	uint8_t *data;
+	size_t len;
+	int err;
+
+	if (writer->err)
+		return writer->err;
+
+	// build TI file into memory (entry is left as is if failure)
+	err = tigroup_write_member(te, &data, &len);
+	if (err)
+		return err;
+
+	// ZIP archives don't like greek chars
+	fname = ticonv_gfe_to_zfe(writer->model, te->filename);
+
+	// archive is damaged if failure
+	err = zip_write((zipFile *)&writer->zf, fname, data, len, writer->comp_level);
+	writer->err = err;
+
+	g_free(fname);
+	free(data);
+
+	return err;
+}
+
+/**
+ * tifiles_tigroup_writer_add_regular:
+ * @writer: a writer returned by #tifiles_tigroup_writer_open.
+ * @content: a single/group file content.
+ *
+ * Compress a single/group file into the archive. The content is not 
+ * referenced once this function returns and can be released at once.
+ *
+ * Return value: an error code if unsuccessful, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_tigroup_writer_add_regular(TigWriter *writer, FileContent *content)
+{
+	TigEntry te;
+	int err;
+
+	if (content->num_entries == 0)
+		return ERR_INVALID_FILE;
+
+	if (writer->model == CALC_NONE)
+		writer->model = content->model;
+
+	te.filename = tifiles_build_filename(writer->model, content->entries[0]);
+	te.type = TIFILE_GROUP;
+	te.content.regular = content;
+
+	err = tigroup_writer_add(writer, &te);
+	g_free(te.filename);
+
+	if (!err)
+		writer->n_vars++;
+	return err;
+}
+
+/**
+ * tifiles_tigroup_writer_add_flash:
+ * @writer: a writer returned by #tifiles_tigroup_writer_open.
+ * @content: a FLASH content (app or OS).
+ *
+ * Compress a FLASH app/OS into the archive. The content is not 
+ * referenced once this function returns and can be released at once.
+ *
+ * Return value: an error code if unsuccessful, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_tigroup_writer_add_flash(TigWriter *writer, FlashContent *content)
+{
+	TigEntry te;
+	VarEntry ve;
+	FlashContent *ptr;
+	int err;
+
+	if (writer->model == CALC_NONE)
+		writer->model = content->model;
+
+	// name is the one of the app (TI9x contents may have a license first)
+	for (ptr = content; ptr; ptr = ptr->next)
+		if(ptr->data_type == tifiles_flash_type(writer->model))
+			break;
+	if (ptr == NULL)
+		ptr = content;
+
+	memset(&ve, 0, sizeof(ve));
+	strcpy(ve.folder, "");
+	strcpy(ve.name, ptr->name);
+	ve.type = ptr->data_type;
+
+	te.filename = tifiles_build_filename(writer->model, &ve);
+	te.type = TIFILE_FLASH;
+	te.content.flash = content;
+
+	err = tigroup_writer_add(writer, &te);
+	g_free(te.filename);
+
+	if (!err)
+		writer->n_apps++;
+	return err;
+}
+
+/**
+ * tifiles_tigroup_writer_close:
+ * @writer: a writer returned by #tifiles_tigroup_writer_open.
+ *
+ * Finish the archive and release the writer. The TiGroup file is replaced
+ * only if the archive has been completely written (if an error occurred, any
+ * existing file is left as is).
+ *
+ * Return value: an error code if unsuccessful, 0 otherwise.
+ **/
+TIEXPORT2 int TICALL tifiles_tigroup_writer_close(TigWriter *writer)
+{
+	int err = writer->err;
+
+	if (zipClose((zipFile)writer->zf, NULL) != ZIP_OK && !err)
+		err = ERR_FILE_ZIP;
+	if (err)
+		printf("error in closing %s\n", writer->filename);
+
+	if (fcommit_sibling(writer->tmpname, writer->filename, !err) && !err)
+		err = ERR_FILE_CLOSE;
+
+	g_free(writer->filename);
+	g_free(writer);
+
 	return err;
 }
 
@@ -23,7 +23,7 @@
   Variable type ID and file extensions
 */
 
-static int warnings = 0;
+static const int warnings = 0;
 
 #ifndef DISABLE_TI9X
 
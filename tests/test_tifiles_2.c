@@ -29,14 +29,19 @@
 #endif
 
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #ifdef __WIN32__
 #include <direct.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 #include "../src/tifiles.h"
+#include "../src/error.h"
 
 /*
   Compare 2 files bytes per bytes and show differences
@@ -159,6 +164,7 @@ static int test_ti84p_regular_support(void);
 static int test_ti84p_group_support(void);
 static int test_ti84p_ungroup_support(void);	
 static int test_ti84p_flash_support(void);  
+static int test_ti84p_lazy_support(void);
 
 static int test_ti85_regular_support(void);
 
@@ -174,6 +180,9 @@ static int test_ti92_backup_support(void);
 static int test_ti92_regular_support(void);
 static int test_ti92_group_support(void);
 static int test_ti92_ungroup_support(void);
+static int test_ti92_lazy_support(void);
+
+static int test_nspire_regular_support(void);
 
 static int test_ti8x_cert_support();
 static int test_ti9x_cert_support();
@@ -181,6 +190,19 @@ static int test_ti9x_cert_support();
 static int test_ti8x_group_merge();
 
 static int test_tigroup();
+static int test_tigroup_dedup();
+static int test_tigroup_threads();
+static int test_tigroup_roundtrip();
+
+static int test_streams();
+
+static int test_atomic();
+
+static int test_threads();
+
+static int test_ti8x_convert();
+
+static int test_async();
 
 /*
   The main function
@@ -330,6 +352,7 @@ int main(int argc, char **argv)
 	//test_ti84p_group_support();
 	//test_ti84p_ungroup_support();	
 	test_ti84p_flash_support();
+	test_ti84p_lazy_support();
 #endif
 
 	// TI85 support
@@ -361,6 +384,12 @@ int main(int argc, char **argv)
 	test_ti92_regular_support();
 	test_ti92_group_support();
 	test_ti92_ungroup_support();
+	test_ti92_lazy_support();
+#endif
+
+	// TI-Nspire support
+#if 0
+	test_nspire_regular_support();
 #endif
 
 	// TIXX certificates
@@ -379,6 +408,34 @@ int main(int argc, char **argv)
 #if 0
 	change_dir(PATH("tig"));
 	test_tigroup();
+	test_tigroup_dedup();
+	test_tigroup_threads();
+	test_tigroup_roundtrip();
+#endif
+
+	// Streams (pipes)
+#if 0
+	test_streams();
+#endif
+
+	// Atomic writes
+#if 0
+	test_atomic();
+#endif
+
+	// Concurrent use (build with -fsanitize=thread to check for races)
+#if 0
+	test_threads();
+#endif
+
+	// Conversion
+#if 0
+	test_ti8x_convert();
+#endif
+
+	// Asynchronous reading/writing
+#if 0
+	test_async();
 #endif
 
 	// end of test
@@ -785,6 +842,48 @@ static int test_ti84p_flash_support()
   return 0;
 }
 
+static int test_ti84p_lazy_support()
+{
+  FileContent *content;
+  FileIndex *index;
+  VarEntry *ve;
+  int i, ret;
+
+  printf("--> Testing TI84+ lazy loading of group...\n");
+  content = tifiles_content_create_regular(CALC_TI84P);
+  tifiles_file_read_regular(PATH("ti84p/group.8Xg"), content);
+
+  ret = tifiles_file_open_regular(PATH("ti84p/group.8Xg"), &index);
+  if(ret || index->content->num_entries != content->num_entries)
+  {
+    printf("\nUnable to index ti84p/group.8Xg !!!\n");
+    if(!ret)
+      tifiles_file_close_regular(index);
+    tifiles_content_delete_regular(content);
+    return ret;
+  }
+
+  // last entry first: entries are loaded in any order
+  for(i = content->num_entries - 1; i >= 0; i--)
+  {
+    ve = index->content->entries[i];
+    if(ve->data != NULL)
+      printf("\nEntry %i loaded before use !!!\n", i);
+    tifiles_file_load_entry(index, ve);
+
+    if(ve->size == content->entries[i]->size && 
+       !memcmp(ve->data, content->entries[i]->data, ve->size))
+      printf("    Entries match !\n");
+    else
+      printf("\nEntries do not match !!!\n");
+  }
+
+  tifiles_file_close_regular(index);
+  tifiles_content_delete_regular(content);
+
+  return 0;
+}
+
 /*********/
 /* TI-85 */
 /*********/
@@ -987,6 +1086,34 @@ static int test_ti92_ungroup_support()
   return 0;
 }
 
+static int test_ti92_lazy_support()
+{
+  FileContent *content;
+  FileIndex *index;
+  VarEntry *ve;
+  int n;
+
+  printf("--> Testing TI92 lazy loading of group...\n");
+  content = tifiles_content_create_regular(CALC_TI92);
+  tifiles_file_read_regular(PATH("ti92/group2.92g"), content);
+
+  tifiles_file_open_regular(PATH("ti92/group2.92g"), &index);
+  n = index->content->num_entries - 1;
+  ve = index->content->entries[n];
+  tifiles_file_load_entry(index, ve);
+
+  if(ve->size == content->entries[n]->size && 
+     !memcmp(ve->data, content->entries[n]->data, ve->size))
+    printf("    Entries match !\n");
+  else
+    printf("\nEntries do not match !!!\n");
+
+  tifiles_file_close_regular(index);
+  tifiles_content_delete_regular(content);
+
+  return 0;
+}
+
 /*********/
 /* TI-89 */
 /*********/
@@ -1159,6 +1286,955 @@ int test_tigroup()
 	return 0;
 }
 
+/*
+  Build a deduplicated TiGroup file where a1.8Xn and a2.8Xn have the same
+  content (a2.8Xn is stored as a copy of a1.8Xn).
+*/
+static int tigroup_dedup_build(const char *filename)
+{
+	const char *names[] = { "a1.8Xn", "a2.8Xn", "b.8Xn" };
+	const char *files[] = { "tig/A.8Xn", "tig/A.8Xn", "tig/B.8Xn" };
+	TigContent *content;
+	int i, ret;
+
+	content = tifiles_content_create_tigroup(CALC_TI84P, 0);
+	content->dedup = 1;
+
+	for(i = 0; i < 3; i++)
+	{
+		TigEntry *te = tifiles_te_create(names[i], TIFILE_SINGLE, CALC_TI84P);
+
+		tifiles_file_read_regular(PATH(files[i]), te->content.regular);
+		tifiles_content_add_te(content, te);
+	}
+
+	ret = tifiles_file_write_tigroup(filename, content);
+	tifiles_content_delete_tigroup(content);
+
+	return ret;
+}
+
+/*
+  Check the entries of a TiGroup file with both readers. The content of
+  'name' is written to 'dst' if found.
+*/
+static int tigroup_dedup_check(const char *filename, const char *name, const char *dst, int n_vars)
+{
+	TigContent *content;
+	int i, ret;
+
+	content = tifiles_content_create_tigroup(CALC_NONE, 0);
+	ret = tifiles_file_read_tigroup2(filename, content, 2);
+	if(ret || content->n_vars != n_vars)
+		printf("\nError %i reading %s (%i entries) !!!\n", ret, filename, content->n_vars);
+	tifiles_content_delete_tigroup(content);
+
+	content = tifiles_content_create_tigroup(CALC_NONE, 0);
+	ret = tifiles_file_read_tigroup(filename, content);
+	if(ret || content->n_vars != n_vars)
+		printf("\nError %i reading %s (%i entries) !!!\n", ret, filename, content->n_vars);
+
+	for(i = 0; i < content->n_vars; i++)
+		if(!strcmp(content->var_entries[i]->filename, name))
+			tifiles_file_write_regular(dst, content->var_entries[i]->content.regular, NULL);
+	tifiles_content_delete_tigroup(content);
+
+	return ret;
+}
+
+static int test_tigroup_dedup()
+{
+	TigEntry te = { 0 };
+	TigEntry *entry;
+	TigIndex *index;
+	FileContent *regular;
+	int i;
+
+	printf("--> Testing add/del from deduplicated TiGroup (r/w)...\n");
+
+	// remove a copy: the manifest is updated
+	tigroup_dedup_build(PATH("tig/dedup.tig"));
+	te.filename = "a2.8Xn";
+	tifiles_tigroup_del_file(&te, PATH("tig/dedup.tig"));
+	tigroup_dedup_check(PATH("tig/dedup.tig"), "a1.8Xn", PATH("tig/a1.8Xn"), 2);
+	compare_files(PATH("tig/A.8Xn"), PATH2("tig/a1.8Xn"));
+
+	// the index lists the copy but not the manifest
+	tigroup_dedup_build(PATH("tig/dedup.tig"));
+	if(tifiles_tigroup_open(PATH("tig/dedup.tig"), &index))
+		printf("\nUnable to index tig/dedup.tig !!!\n");
+	else
+	{
+		if(index->n_entries != 3)
+			printf("\n%i entries indexed instead of 3 !!!\n", index->n_entries);
+		for(i = 0; i < index->n_entries; i++)
+			if(!strcmp(index->entries[i]->filename, "tifiles-dedup.txt"))
+				printf("\nManifest has been indexed !!!\n");
+		if(tifiles_tigroup_read_entry(index, "a2.8Xn", &entry))
+			printf("\nUnable to read a2.8Xn !!!\n");
+		else
+		{
+			tifiles_file_write_regular(PATH("tig/a2.8Xn"), entry->content.regular, NULL);
+			compare_files(PATH("tig/A.8Xn"), PATH2("tig/a2.8Xn"));
+			tifiles_te_delete(entry);
+		}
+		tifiles_tigroup_close(index);
+	}
+
+	// remove the original: its copy takes its place
+	tigroup_dedup_build(PATH("tig/dedup.tig"));
+	te.filename = "a1.8Xn";
+	tifiles_tigroup_del_file(&te, PATH("tig/dedup.tig"));
+	tigroup_dedup_check(PATH("tig/dedup.tig"), "a2.8Xn", PATH("tig/a2.8Xn"), 2);
+	compare_files(PATH("tig/A.8Xn"), PATH2("tig/a2.8Xn"));
+
+	// and can be removed in turn
+	te.filename = "a2.8Xn";
+	tifiles_tigroup_del_file(&te, PATH("tig/dedup.tig"));
+	tigroup_dedup_check(PATH("tig/dedup.tig"), "b.8Xn", PATH("tig/b.8Xn"), 1);
+	compare_files(PATH("tig/B.8Xn"), PATH2("tig/b.8Xn"));
+
+	// adding an existing member replaces it, even if it is a copy
+	tigroup_dedup_build(PATH("tig/dedup.tig"));
+	regular = tifiles_content_create_regular(CALC_TI84P);
+	tifiles_file_read_regular(PATH("tig/B.8Xn"), regular);
+	tifiles_file_write_regular(PATH("tig/a2.8Xn"), regular, NULL);
+	tifiles_tigroup_add_file(PATH("tig/a2.8Xn"), PATH2("tig/dedup.tig"));
+	tigroup_dedup_check(PATH("tig/dedup.tig"), "a2.8Xn", PATH("tig/a2_.8Xn"), 3);
+	compare_files(PATH("tig/B.8Xn"), PATH2("tig/a2_.8Xn"));
+	tigroup_dedup_check(PATH("tig/dedup.tig"), "a1.8Xn", PATH("tig/a1.8Xn"), 3);
+	compare_files(PATH("tig/A.8Xn"), PATH2("tig/a1.8Xn"));
+
+	// or the original of copies
+	tigroup_dedup_build(PATH("tig/dedup.tig"));
+	tifiles_file_write_regular(PATH("tig/a1.8Xn"), regular, NULL);
+	tifiles_tigroup_add_file(PATH("tig/a1.8Xn"), PATH2("tig/dedup.tig"));
+	tigroup_dedup_check(PATH("tig/dedup.tig"), "a1.8Xn", PATH("tig/a1_.8Xn"), 3);
+	compare_files(PATH("tig/B.8Xn"), PATH2("tig/a1_.8Xn"));
+	tigroup_dedup_check(PATH("tig/dedup.tig"), "a2.8Xn", PATH("tig/a2_.8Xn"), 3);
+	compare_files(PATH("tig/A.8Xn"), PATH2("tig/a2_.8Xn"));
+	tifiles_content_delete_regular(regular);
+
+	return 0;
+}
+
+/*
+  Build a TiGroup content of n copies of tig/A.8Xn. The entry 'bad' (if any)
+  can't be written.
+*/
+static TigContent* tigroup_build(int n, int bad)
+{
+	TigContent *content;
+	int i;
+
+	content = tifiles_content_create_tigroup(CALC_TI84P, 0);
+	for(i = 0; i < n; i++)
+	{
+		char name[16];
+		TigEntry *te;
+
+		sprintf(name, "v%02i.8Xn", i);
+		te = tifiles_te_create(name, TIFILE_SINGLE, CALC_TI84P);
+		tifiles_file_read_regular(PATH("tig/A.8Xn"), te->content.regular);
+		if(i == bad)
+			te->content.regular->model = CALC_NONE;
+		tifiles_content_add_te(content, te);
+	}
+
+	return content;
+}
+
+static int test_tigroup_threads()
+{
+	TigContent *content;
+	int i, ret;
+
+	printf("--> Testing parallel TiGroup writer with a bad entry...\n");
+
+	// any member may fail while others are being packed: it must not hang
+	for(i = 0; i < 32; i++)
+	{
+		content = tigroup_build(32, i);
+		ret = tifiles_file_write_tigroup2(PATH("tig/threads.tig"), content, 4);
+		if(ret != ERR_BAD_CALC)
+			printf("\nBad entry %i has been written (%i) !!!\n", i, ret);
+		tifiles_content_delete_tigroup(content);
+	}
+	printf("    Errors reported !\n");
+
+	return 0;
+}
+
+/*
+  Compare the entries of two TiGroup contents, in order. Returns the number
+  of differences.
+*/
+static int tigroup_compare(TigContent *a, TigContent *b)
+{
+	int errors = 0;
+	int i, j;
+
+	if(a->n_vars != b->n_vars || a->n_apps != b->n_apps)
+		return 1;
+
+	for(i = 0; i < a->n_vars; i++)
+	{
+		FileContent *ra = a->var_entries[i]->content.regular;
+		FileContent *rb = b->var_entries[i]->content.regular;
+
+		errors += strcmp(a->var_entries[i]->filename, b->var_entries[i]->filename) != 0;
+		errors += ra->num_entries != rb->num_entries;
+		for(j = 0; j < ra->num_entries && j < rb->num_entries; j++)
+			errors += ra->entries[j]->size != rb->entries[j]->size ||
+				memcmp(ra->entries[j]->data, rb->entries[j]->data, ra->entries[j]->size);
+	}
+
+	for(i = 0; i < a->n_apps; i++)
+	{
+		FlashContent *fa = a->app_entries[i]->content.flash;
+		FlashContent *fb = b->app_entries[i]->content.flash;
+
+		errors += strcmp(a->app_entries[i]->filename, b->app_entries[i]->filename) != 0;
+		errors += fa->data_length != fb->data_length ||
+			memcmp(fa->data_part, fb->data_part, fa->data_length);
+	}
+
+	return errors;
+}
+
+/*
+  Load a TiGroup file with the parallel reader and entry by entry from its 
+  index: both must give 'ref' (what the sequential reader gets).
+*/
+static int tigroup_check_readers(const char *filename, TigContent *ref)
+{
+	TigContent *content;
+	TigIndex *index;
+	TigEntry *entry;
+	int errors = 0;
+	int i, ret;
+
+	content = tifiles_content_create_tigroup(CALC_NONE, 0);
+	ret = tifiles_file_read_tigroup2(filename, content, 3);
+	if(ret || tigroup_compare(ref, content))
+	{
+		printf("\nParallel reader differs on %s (%i) !!!\n", filename, ret);
+		errors++;
+	}
+	tifiles_content_delete_tigroup(content);
+
+	ret = tifiles_tigroup_open(filename, &index);
+	if(ret)
+	{
+		printf("\nUnable to index %s (%i) !!!\n", filename, ret);
+		return errors + 1;
+	}
+
+	// index lists members in archive order
+	content = tifiles_content_create_tigroup(CALC_NONE, 0);
+	for(i = 0; i < index->n_entries && !ret; i++)
+	{
+		ret = tifiles_tigroup_read_entry(index, index->entries[i]->filename, &entry);
+		if(!ret)
+			tifiles_content_add_te(content, entry);
+	}
+	tifiles_tigroup_close(index);
+
+	if(ret || tigroup_compare(ref, content))
+	{
+		printf("\nIndexed reader differs on %s (%i) !!!\n", filename, ret);
+		errors++;
+	}
+	tifiles_content_delete_tigroup(content);
+
+	return errors;
+}
+
+static int test_tigroup_roundtrip()
+{
+	FileContent *group;
+	FileContent **singles;
+	FileContent *regular;
+	FlashContent *flash;
+	TigContent *content;
+	TigIndex *index;
+	TigEntry *entry;
+	TigWriter *writer;
+	int errors = 0;
+	int i, ret, ret2;
+
+	printf("--> Testing TiGroup readers and writers against each other...\n");
+
+	// the variables of a group then an application, added one at a time
+	group = tifiles_content_create_regular(CALC_TI89);
+	tifiles_file_read_regular(PATH("ti89/group.89g"), group);
+	tifiles_ungroup_content(group, &singles);
+
+	flash = tifiles_content_create_flash(CALC_TI89);
+	flash->device_type = 0x98;
+	flash->data_type = tifiles_flash_type(CALC_TI89);
+	strcpy(flash->name, "roundtrp");
+	flash->data_length = 5000;
+	flash->data_part = g_malloc(flash->data_length);
+	for(i = 0; i < (int)flash->data_length; i++)
+		flash->data_part[i] = (uint8_t)(i * 11);
+
+	ret = tifiles_tigroup_writer_open(PATH("tig/roundtrip.tig"), CALC_TI89, 4, &writer);
+	if(ret)
+	{
+		printf("\nUnable to create tig/roundtrip.tig (%i) !!!\n", ret);
+		return -1;
+	}
+	for(i = 0; singles[i] != NULL; i++)
+		errors += tifiles_tigroup_writer_add_regular(writer, singles[i]) != 0;
+	errors += tifiles_tigroup_writer_add_flash(writer, flash) != 0;
+	errors += tifiles_tigroup_writer_close(writer) != 0;
+
+	// the sequential reader gives the reference: members in the order added
+	content = tifiles_content_create_tigroup(CALC_NONE, 0);
+	ret = tifiles_file_read_tigroup(PATH("tig/roundtrip.tig"), content);
+	if(ret || content->n_vars != group->num_entries || content->n_apps != 1)
+	{
+		printf("\nError %i reading tig/roundtrip.tig (%i entries) !!!\n", ret, content->n_vars);
+		errors++;
+	}
+	for(i = 0; i < content->n_vars; i++)
+	{
+		char *name = tifiles_build_filename(CALC_TI89, singles[i]->entries[0]);
+
+		errors += strcmp(content->var_entries[i]->filename, name) != 0;
+		g_free(name);
+	}
+	errors += tigroup_check_readers(PATH("tig/roundtrip.tig"), content);
+
+	// what both writers write reads the same
+	errors += tifiles_file_write_tigroup(PATH("tig/roundtrip1.tig"), content) != 0;
+	errors += tigroup_check_readers(PATH("tig/roundtrip1.tig"), content);
+	errors += tifiles_file_write_tigroup2(PATH("tig/roundtrip2.tig"), content, 3) != 0;
+	errors += tigroup_check_readers(PATH("tig/roundtrip2.tig"), content);
+	tifiles_content_delete_tigroup(content);
+
+	// a member which can't be parsed is not an archive error: a TI-92 
+	// string stored under a TI-84+ name
+	regular = tifiles_content_create_regular(CALC_TI92);
+	tifiles_file_read_regular(PATH("ti92/str.92s"), regular);
+	tifiles_tigroup_writer_open(PATH("tig/roundtrip.tig"), CALC_TI84P, 4, &writer);
+	tifiles_tigroup_writer_add_regular(writer, regular);
+	tifiles_tigroup_writer_close(writer);
+	tifiles_content_delete_regular(regular);
+
+	content = tifiles_content_create_tigroup(CALC_NONE, 0);
+	ret = tifiles_file_read_tigroup2(PATH("tig/roundtrip.tig"), content, 3);
+	tifiles_content_delete_tigroup(content);
+
+	ret2 = tifiles_tigroup_open(PATH("tig/roundtrip.tig"), &index);
+	if(!ret2)
+	{
+		ret2 = tifiles_tigroup_read_entry(index, index->entries[0]->filename, &entry);
+		if(!ret2)
+			tifiles_te_delete(entry);
+		tifiles_tigroup_close(index);
+	}
+	if(!ret || ret == ERR_FILE_ZIP || ret2 != ret)
+	{
+		printf("\nBad member reported as %i and %i !!!\n", ret, ret2);
+		errors++;
+	}
+
+	tifiles_content_delete_group(singles);
+	tifiles_content_delete_regular(group);
+	tifiles_content_delete_flash(flash);
+
+	if(errors)
+		printf("\n%i errors !!!\n", errors);
+	else
+		printf("    Contents match !\n");
+
+	return errors;
+}
+
 //tifiles_file_display(PATH("misc/str.92s"));
 //tifiles_file_display(PATH(g_locale_to_utf8("misc/pp.92s", -1, NULL, NULL, NULL)));
 //return 0;
+
+/*************/
+/* TI-Nspire */
+/*************/
+
+/*
+  There are no documents around: build one (documents are opaque).
+*/
+static int build_document(const char *filename, int size)
+{
+	FILE *f;
+	int i;
+
+	f = fopen(filename, "wb");
+	if(f == NULL)
+		return -1;
+	fputs("*TIMLP0500", f);
+	for(i = 10; i < size; i++)
+		fputc(i * 13, f);
+	fclose(f);
+
+	return 0;
+}
+
+static int test_nspire_regular_support()
+{
+	FileContent *content;
+	void *map;
+	int ret;
+#ifndef __WIN32__
+	char *cmd;
+	FILE *f;
+#endif
+
+	printf("--> Testing TI-Nspire regular support (mapping)...\n");
+	build_document(PATH("misc/doc.tns"), 300000);
+
+	content = tifiles_content_create_regular(CALC_NSPIRE);
+	ret = tifiles_file_map_regular(PATH("misc/doc.tns"), content, &map);
+	if(ret || map == NULL || content->num_entries != 1 || content->entries[0]->size != 300000)
+		printf("\nDocument has not been mapped (%i) !!!\n", ret);
+	else
+	{
+		tifiles_file_write_regular(PATH("misc/doc.tns_"), content, NULL);
+		compare_files(PATH("misc/doc.tns"), PATH2("misc/doc.tns_"));
+	}
+	tifiles_file_unmap_regular(content, map);
+
+	printf("--> Testing TI-Nspire regular support (copy)...\n");
+	remove(PATH("misc/doc2.tns_"));
+	ret = tifiles_file_copy_regular(PATH("misc/doc.tns"), PATH2("misc/doc2.tns_"));
+	if(ret)
+		printf("\nDocument has not been copied (%i) !!!\n", ret);
+	else
+		compare_files(PATH("misc/doc.tns"), PATH2("misc/doc2.tns_"));
+
+	// overwriting an existing copy
+	build_document(PATH("misc/doc.tns"), 1000);
+	ret = tifiles_file_copy_regular(PATH("misc/doc.tns"), PATH2("misc/doc2.tns_"));
+	if(ret)
+		printf("\nDocument has not been copied (%i) !!!\n", ret);
+	else
+		compare_files(PATH("misc/doc.tns"), PATH2("misc/doc2.tns_"));
+
+	// not a document
+	if(tifiles_file_copy_regular(PATH("misc/str.92s"), PATH2("misc/str.92s_")) == 0)
+		printf("\nNot a document but copied !!!\n");
+
+#ifndef __WIN32__
+	// to a FIFO (the kernel copy needs file offsets)
+	remove(PATH("misc/fifo.tns_"));
+	remove(PATH("misc/fifo.tns__"));
+	mkfifo(PATH("misc/fifo.tns_"), 0600);
+	cmd = g_strdup_printf("cat %s > %s", PATH("misc/fifo.tns_"), PATH2("misc/fifo.tns__"));
+	f = popen(cmd, "r");
+	g_free(cmd);
+	ret = tifiles_file_copy_regular(PATH("misc/doc.tns"), PATH2("misc/fifo.tns_"));
+	pclose(f);
+	if(ret)
+		printf("\nDocument has not been copied to a FIFO (%i) !!!\n", ret);
+	else
+		compare_files(PATH("misc/doc.tns"), PATH2("misc/fifo.tns__"));
+	remove(PATH("misc/fifo.tns_"));
+	remove(PATH("misc/fifo.tns__"));
+#endif
+
+	remove(PATH("misc/doc.tns"));
+
+	return 0;
+}
+
+/******************/
+/* Concurrent use */
+/******************/
+
+#define NTHREADS	8
+#define NLOOPS		16
+
+static const char *thread_files[] = 
+{
+	"ti92/group.92g", "ti92/str.92s", "ti92/backup.92b", 
+	"ti84p/group.8Xg", "ti84p/aa.8Xn", "tig/test.tig", 
+	"ti89/thread.89u", "misc/thread.tns", NULL
+};
+
+// the files above as given by PATH (which is not reentrant)
+static char *thread_paths[sizeof(thread_files) / sizeof(thread_files[0])];
+
+/*
+  Each thread reads every file and writes it back under its own name.
+  Returns the number of failures.
+*/
+static gpointer thread_func(gpointer data)
+{
+	int n = GPOINTER_TO_INT(data);
+	int errors = 0;
+	int i, j;
+
+	for(i = 0; i < NLOOPS; i++)
+	{
+		for(j = 0; thread_paths[j] != NULL; j++)
+		{
+			const char *src = thread_paths[j];
+			char *dst = g_strdup_printf("%s_%i", src, n);
+			CalcModel model = tifiles_file_get_model(src);
+			char folder[FLDNAME_MAX];
+
+			if(tifiles_file_is_tigroup(src))
+			{
+				TigContent *content = tifiles_content_create_tigroup(model, 0);
+
+				errors += tifiles_file_read_tigroup(src, content) != 0;
+				errors += tifiles_file_write_tigroup(dst, content) != 0;
+				tifiles_content_delete_tigroup(content);
+			}
+			else if(tifiles_file_is_flash(src))
+			{
+				FlashContent *content = tifiles_content_create_flash(model);
+
+				errors += tifiles_file_read_flash(src, content) != 0;
+				errors += tifiles_file_write_flash(dst, content) != 0;
+				tifiles_content_delete_flash(content);
+			}
+			else if(tifiles_file_is_regular(src))
+			{
+				FileContent *content = tifiles_content_create_regular(model);
+
+				errors += tifiles_file_read_regular(src, content) != 0;
+				errors += tifiles_file_write_regular(dst, content, NULL) != 0;
+				tifiles_content_delete_regular(content);
+			}
+			else
+			{
+				BackupContent *content = tifiles_content_create_backup(model);
+
+				errors += tifiles_file_read_backup(src, content) != 0;
+				errors += tifiles_file_write_backup(dst, content) != 0;
+				tifiles_content_delete_backup(content);
+			}
+
+			// functions returning a string
+			errors += strcmp(tifiles_get_fldname("main\\var"), "main") != 0;
+			errors += strcmp(tifiles_get_fldname_r("fld\\var", folder), "fld") != 0;
+			errors += strlen(tifiles_comment_set_single()) > 40;
+
+			g_free(dst);
+		}
+	}
+
+	return GINT_TO_POINTER(errors);
+}
+
+/*
+  TiGroup archives are not rebuilt byte for byte (time stamps): compare entries.
+*/
+static void compare_tigroups(const char *src, const char *dst)
+{
+	TigContent *content1 = tifiles_content_create_tigroup(CALC_NONE, 0);
+	TigContent *content2 = tifiles_content_create_tigroup(CALC_NONE, 0);
+	int i, ret;
+
+	ret = tifiles_file_read_tigroup(src, content1);
+	if(!ret)
+		ret = tifiles_file_read_tigroup(dst, content2);
+	if(!ret && (content1->n_vars != content2->n_vars || content1->n_apps != content2->n_apps))
+		ret = -1;
+	for(i = 0; !ret && i < content1->n_vars; i++)
+		if(strcmp(content1->var_entries[i]->filename, content2->var_entries[i]->filename))
+			ret = -1;
+
+	if(ret)
+		printf("\nTiGroup files %s and %s differ !!!\n", src, dst);
+	tifiles_content_delete_tigroup(content1);
+	tifiles_content_delete_tigroup(content2);
+}
+
+static int test_threads()
+{
+	GThread *threads[NTHREADS];
+	FlashContent *flash;
+	int errors = 0;
+	int i, j;
+
+	printf("--> Testing concurrent use from %i threads...\n", NTHREADS);
+
+	for(j = 0; thread_files[j] != NULL; j++)
+		thread_paths[j] = g_strdup(PATH(thread_files[j]));
+
+	// there are no flash and Nspire files around: build them
+	flash = tifiles_content_create_flash(CALC_TI89);
+	flash->device_type = 0x98;
+	flash->data_type = 0x23;
+	strcpy(flash->name, "basecode");
+	flash->data_length = 100000;
+	flash->data_part = g_malloc(flash->data_length);
+	for(i = 0; i < (int)flash->data_length; i++)
+		flash->data_part[i] = (uint8_t)(i * 7);
+	tifiles_file_write_flash(PATH("ti89/thread.89u"), flash);
+	tifiles_content_delete_flash(flash);
+
+	build_document(PATH("misc/thread.tns"), 5000);
+
+	for(i = 0; i < NTHREADS; i++)
+		threads[i] = g_thread_new("test", thread_func, GINT_TO_POINTER(i));
+
+	for(i = 0; i < NTHREADS; i++)
+		errors += GPOINTER_TO_INT(g_thread_join(threads[i]));
+
+	if(errors)
+		printf("\n%i errors !!!\n", errors);
+
+	// outputs must be identical to the original files
+	for(i = 0; i < NTHREADS; i++)
+	{
+		for(j = 0; thread_paths[j] != NULL; j++)
+		{
+			char *dst = g_strdup_printf("%s_%i", thread_paths[j], i);
+
+			if(tifiles_file_is_tigroup(thread_paths[j]))
+				compare_tigroups(thread_paths[j], dst);
+			else
+				compare_files(thread_paths[j], dst);
+			g_free(dst);
+		}
+	}
+
+	remove(PATH("ti89/thread.89u"));
+	remove(PATH("misc/thread.tns"));
+	for(j = 0; thread_paths[j] != NULL; j++)
+	{
+		g_free(thread_paths[j]);
+		thread_paths[j] = NULL;
+	}
+
+	return errors;
+}
+
+/***********/
+/* Streams */
+/***********/
+
+#ifndef __WIN32__
+// Read a backup through a pipe and write it back through another one
+static int stream_backup(const char *src, const char *dst)
+{
+	BackupContent *content;
+	char *cmd;
+	FILE *f;
+	int ret;
+
+	content = tifiles_content_create_backup(CALC_NONE);
+
+	cmd = g_strdup_printf("cat %s", src);
+	f = popen(cmd, "r");
+	g_free(cmd);
+	ret = tifiles_fread_backup(f, src, content);
+	pclose(f);
+
+	if(!ret)
+	{
+		cmd = g_strdup_printf("cat > %s", dst);
+		f = popen(cmd, "w");
+		g_free(cmd);
+		ret = tifiles_fwrite_backup(f, content);
+		if(pclose(f) && !ret)
+			ret = -1;
+	}
+
+	// the content belongs to the caller even on error
+	tifiles_content_delete_backup(content);
+
+	return ret;
+}
+#endif
+
+static int test_streams()
+{
+#ifndef __WIN32__
+	FlashContent *content;
+	FlashContent *content2;
+	FileContent *regular;
+	char *cmd;
+	FILE *f;
+	int ret;
+	uint32_t i;
+
+	printf("--> Testing backup support over pipes...\n");
+	if(stream_backup(PATH("ti92/backup.92b"), PATH2("ti92/backup.92b_")))
+		printf("\nError reading/writing ti92/backup.92b !!!\n");
+	else
+		compare_files(PATH("ti92/backup.92b"), PATH2("ti92/backup.92b_"));
+	if(stream_backup(PATH("ti82/backup.82b"), PATH2("ti82/backup.82b_")))
+		printf("\nError reading/writing ti82/backup.82b !!!\n");
+	else
+		compare_files(PATH("ti82/backup.82b"), PATH2("ti82/backup.82b_"));
+
+	printf("--> Testing flash support over pipes...\n");
+	content = tifiles_content_create_flash(CALC_TI89);
+	content->device_type = 0x98;
+	content->data_type = 0x23;
+	strcpy(content->name, "basecode");
+	content->data_length = 100000;
+	content->data_part = g_malloc(content->data_length);
+	for(i = 0; i < content->data_length; i++)
+		content->data_part[i] = (uint8_t)(i * 7);
+
+	cmd = g_strdup_printf("cat > %s", PATH("ti89/stream.89u_"));
+	f = popen(cmd, "w");
+	g_free(cmd);
+	ret = tifiles_fwrite_flash(f, content);
+	if(pclose(f) && !ret)
+		ret = -1;
+
+	content2 = tifiles_content_create_flash(CALC_TI89);
+	if(!ret)
+	{
+		cmd = g_strdup_printf("cat %s", PATH("ti89/stream.89u_"));
+		f = popen(cmd, "r");
+		g_free(cmd);
+		ret = tifiles_fread_flash(f, "stream.89u", content2);
+		pclose(f);
+	}
+
+	if(!ret && content2->data_length == content->data_length &&
+	   !memcmp(content2->data_part, content->data_part, content->data_length))
+		printf("    Contents match !\n");
+	else
+		printf("\nContents do not match (%i) !!!\n", ret);
+	tifiles_content_delete_flash(content2);
+	tifiles_content_delete_flash(content);
+
+	// a truncated stream is an error but the content is still to be deleted
+	content2 = tifiles_content_create_flash(CALC_TI89);
+	cmd = g_strdup_printf("head -c 1000 %s", PATH("ti89/stream.89u_"));
+	f = popen(cmd, "r");
+	g_free(cmd);
+	ret = tifiles_fread_flash(f, "stream.89u", content2);
+	pclose(f);
+	tifiles_content_delete_flash(content2);
+	if(!ret)
+		printf("\nTruncated stream read without error !!!\n");
+
+	// TiGroup archives can't be read from a stream
+	regular = tifiles_content_create_regular(CALC_NONE);
+	cmd = g_strdup_printf("cat %s", PATH("tig/test.tig"));
+	f = popen(cmd, "r");
+	g_free(cmd);
+	ret = tifiles_fread_regular(f, "test.tig", regular);
+	pclose(f);
+	tifiles_content_delete_regular(regular);
+	if(ret != ERR_UNSUPPORTED)
+		printf("\nTiGroup read from a stream (%i) !!!\n", ret);
+#endif
+
+	return 0;
+}
+
+/*****************/
+/* Atomic writes */
+/*****************/
+
+static int test_atomic()
+{
+#ifndef __WIN32__
+	FileContent *content;
+	struct stat st;
+	char *cmd;
+	FILE *f;
+
+	content = tifiles_content_create_regular(CALC_TI92);
+	tifiles_file_read_regular(PATH("ti92/str.92s"), content);
+
+	printf("--> Testing atomic write of an existing file...\n");
+	tifiles_file_write_regular(PATH("ti92/str.92s_"), content, NULL);
+	chmod(PATH("ti92/str.92s_"), 0600);
+	tifiles_file_write_regular(PATH("ti92/str.92s_"), content, NULL);
+	if(stat(PATH("ti92/str.92s_"), &st) || (st.st_mode & 0777) != 0600)
+		printf("\nPermissions have not been kept !!!\n");
+	compare_files(PATH("ti92/str.92s"), PATH2("ti92/str.92s_"));
+
+	printf("--> Testing write through a symbolic link...\n");
+	remove(PATH("ti92/link.92s_"));
+	symlink("str.92s_", PATH("ti92/link.92s_"));
+	remove(PATH("ti92/str.92s_"));
+	tifiles_file_write_regular(PATH("ti92/link.92s_"), content, NULL);
+	if(lstat(PATH("ti92/link.92s_"), &st) || !S_ISLNK(st.st_mode))
+		printf("\nLink has been replaced !!!\n");
+	compare_files(PATH("ti92/str.92s"), PATH2("ti92/str.92s_"));
+	remove(PATH("ti92/link.92s_"));
+
+	printf("--> Testing write to a FIFO...\n");
+	remove(PATH("ti92/fifo.92s_"));
+	remove(PATH("ti92/fifo.92s__"));
+	mkfifo(PATH("ti92/fifo.92s_"), 0600);
+	cmd = g_strdup_printf("cat %s > %s", PATH("ti92/fifo.92s_"), PATH2("ti92/fifo.92s__"));
+	f = popen(cmd, "r");
+	g_free(cmd);
+	tifiles_file_write_regular(PATH("ti92/fifo.92s_"), content, NULL);
+	pclose(f);
+	if(lstat(PATH("ti92/fifo.92s_"), &st) || !S_ISFIFO(st.st_mode))
+		printf("\nFIFO has been replaced !!!\n");
+	compare_files(PATH("ti92/str.92s"), PATH2("ti92/fifo.92s__"));
+	remove(PATH("ti92/fifo.92s_"));
+	remove(PATH("ti92/fifo.92s__"));
+
+	tifiles_content_delete_regular(content);
+#endif
+
+	return 0;
+}
+
+/**************/
+/* Conversion */
+/**************/
+
+static void convert_done(const char *src, const char *dst, int err, void *user_data)
+{
+	if(err)
+		printf("    %s: error %i\n", src, err);
+	else
+		printf("    %s -> %s\n", src, dst);
+}
+
+static int test_ti8x_convert()
+{
+	const char *files[] = { "ti83/aa.83n", "ti83/bb.83n", "ti83/group.83g", "ti83/backup.83b", 
+		"ti83/../ti83/aa.83n", NULL };
+	const char *converted[] = { "aa.8Xn", "bb.8Xn", "group.8Xg", NULL };
+	char *src[sizeof(files) / sizeof(files[0])];
+	int errors[sizeof(files) / sizeof(files[0])];
+	ConvertOptions options = { 0 };
+	char *dir;
+	int i, ret;
+
+	printf("--> Testing TI83 to TI84+ conversion...\n");
+	options.done = convert_done;
+	options.errors = errors;
+
+	dir = g_build_filename(g_get_tmp_dir(), "tifiles-XXXXXX", NULL);
+	if(g_mkdtemp(dir) == NULL)
+	{
+		printf("\nUnable to create a temporary folder !!!\n");
+		g_free(dir);
+		return -1;
+	}
+
+	for(i = 0; files[i] != NULL; i++)
+		src[i] = g_strdup(PATH(files[i]));
+	src[i] = NULL;
+
+	// the backup can't be converted and aa.83n can't be written twice
+	ret = tifiles_convert_batch(src, dir, CALC_TI84P, &options);
+	if(errors[0] || errors[4] != ERR_FILE_OPEN)
+		printf("\nSame file converted twice !!!\n");
+
+	for(i = 0; converted[i] != NULL; i++)
+	{
+		char *dst = g_build_filename(dir, converted[i], NULL);
+
+		if(!tifiles_file_is_regular(dst))
+			printf("\n%s has not been converted !!!\n", converted[i]);
+		g_remove(dst);
+		g_free(dst);
+	}
+	if(g_rmdir(dir))
+		printf("\nUnexpected files left in %s !!!\n", dir);
+
+	for(i = 0; src[i] != NULL; i++)
+		g_free(src[i]);
+	g_free(dir);
+
+	return ret;
+}
+
+/****************/
+/* Asynchronous */
+/****************/
+
+static void async_progress(FileAsync *op, uint64_t done, uint64_t total, void *user_data)
+{
+	printf("    %s: %llu/%llu bytes\n", op->filename, (unsigned long long)done, (unsigned long long)total);
+}
+
+static void async_done(FileAsync *op, int err, void *user_data)
+{
+	printf("    %s: done (%i)\n", op->filename, err);
+}
+
+static int test_async()
+{
+	AsyncCallbacks callbacks = { NULL, async_progress, async_done, NULL };
+	FileContent *regular;
+	BackupContent *backup;
+	FileAsync *op1, *op2;
+	uint8_t data[110];
+	FILE *f;
+	int ret;
+
+	printf("--> Testing asynchronous reading/writing...\n");
+
+	// both files are read at the same time
+	regular = tifiles_content_create_regular(CALC_NONE);
+	backup = tifiles_content_create_backup(CALC_NONE);
+	tifiles_file_read_regular_async(PATH("ti92/group.92g"), regular, &callbacks, &op1);
+	tifiles_file_read_backup_async(PATH("ti92/backup.92b"), backup, &callbacks, &op2);
+	tifiles_async_wait(op1);
+	tifiles_async_wait(op2);
+	tifiles_async_free(op1);
+	tifiles_async_free(op2);
+
+	tifiles_file_write_regular_async(PATH("ti92/group.92g_"), regular, &callbacks, &op1);
+	tifiles_file_write_backup_async(PATH("ti92/backup.92b_"), backup, &callbacks, &op2);
+	tifiles_async_wait(op1);
+	tifiles_async_wait(op2);
+	tifiles_async_free(op1);
+	tifiles_async_free(op2);
+
+	compare_files(PATH("ti92/group.92g"), PATH2("ti92/group.92g_"));
+	compare_files(PATH("ti92/backup.92b"), PATH2("ti92/backup.92b_"));
+
+	// a cancelled write leaves the file untouched
+	remove(PATH("ti92/backup.92b__"));
+	tifiles_file_write_backup_async(PATH("ti92/backup.92b__"), backup, NULL, &op1);
+	tifiles_async_cancel(op1);
+	ret = tifiles_async_wait(op1);
+	tifiles_async_free(op1);
+	if(ret && g_file_test(PATH("ti92/backup.92b__"), G_FILE_TEST_EXISTS))
+		printf("\nCancelled file has been written !!!\n");
+
+	tifiles_content_delete_regular(regular);
+	tifiles_content_delete_backup(backup);
+
+	// a truncated file fails and leaves the content to the caller
+	f = fopen(PATH("ti92/group.92g"), "rb");
+	fread(data, 1, sizeof(data), f);
+	fclose(f);
+	f = fopen(PATH("ti92/truncated.92g"), "wb");
+	fwrite(data, 1, sizeof(data), f);
+	fclose(f);
+
+	regular = tifiles_content_create_regular(CALC_NONE);
+	tifiles_file_read_regular_async(PATH("ti92/truncated.92g"), regular, &callbacks, &op1);
+	ret = tifiles_async_wait(op1);
+	tifiles_async_free(op1);
+	if(!ret || regular->num_entries)
+		printf("\nTruncated file has been read (%i) !!!\n", ret);
+	tifiles_content_delete_regular(regular);
+	remove(PATH("ti92/truncated.92g"));
+
+	// so does a cancelled read
+	regular = tifiles_content_create_regular(CALC_NONE);
+	tifiles_file_read_regular_async(PATH("ti92/group.92g"), regular, NULL, &op1);
+	tifiles_async_cancel(op1);
+	ret = tifiles_async_wait(op1);
+	tifiles_async_free(op1);
+	if(ret && regular->num_entries)
+		printf("\nCancelled read has filled the content !!!\n");
+	tifiles_content_delete_regular(regular);
+
+	return 0;
+}
+